@@ -0,0 +1,621 @@
+/*
+ * Microbenchmarks for leak_tracker.
+ *
+ * Every workload runs twice, in a fresh child process each time: once on
+ * the system allocator and once through the tracker's macros. Each result
+ * is one JSON object per line on stdout:
+ *
+ *   {"bench":"churn","dist":"small","threads":1,"live":1024,"ops":...,
+ *    "system_ns_per_op":..,"tracked_ns_per_op":..,"slowdown":..,
+ *    "system_rss":..,"tracked_rss":..,"rss_per_block":..}
+ *
+ * ns_per_op is wall time divided by the number of allocator calls made by
+ * all threads together. The RSS figures are the growth of the child's
+ * resident set during the workload; rss_per_block is the extra resident
+ * memory per live block that tracking costs.
+ *
+ * With "-b old.jsonl" the run is compared against an earlier output and
+ * the program exits with status 1 if any slowdown or rss_per_block got
+ * worse by more than the tolerance ("-r", default 10%). Slowdowns are
+ * ratios against the system allocator on the same machine, so baselines
+ * stay comparable across runs.
+ *
+ * POSIX only (fork, pipes, clock_gettime).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+  #include <pthread.h>
+#endif
+
+/* The system side: these are compiled before the macros exist. */
+static void *sys_malloc(size_t n)           { return malloc(n); }
+static void *sys_realloc(void *p, size_t n) { return realloc(p, n); }
+static void  sys_free(void *p)              { free(p); }
+
+#include "leak_tracker.h"
+
+/* The tracked side: the same calls, now going through the macros. */
+static void *trk_malloc(size_t n)           { return malloc(n); }
+static void *trk_realloc(void *p, size_t n) { return realloc(p, n); }
+static void  trk_free(void *p)              { free(p); }
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t);
+    void *(*resize)(void *, size_t);
+    void  (*release)(void *);
+} Allocator;
+
+static const Allocator g_system  = { "system",  sys_malloc, sys_realloc, sys_free };
+static const Allocator g_tracked = { "tracked", trk_malloc, trk_realloc, trk_free };
+
+#define MAX_LIVE_DEFAULT    10000000u
+#define MAX_THREADS_DEFAULT 64u
+#define CHURN_SLOTS         1024u
+#define MAX_PHASES          3
+
+/* What a child reports back through its pipe. */
+typedef struct {
+    int ok;
+    unsigned phases;
+    struct {
+        unsigned long long ops;
+        double ns;
+        long long rss;
+    } phase[MAX_PHASES];
+} BenchResult;
+
+typedef struct BenchCase {
+    const char *bench;          /* workload name */
+    const char *dist;           /* size distribution, or "-" */
+    unsigned threads;
+    size_t live;                /* blocks kept live while measuring */
+    unsigned long long ops;     /* allocator calls per thread */
+    const char *phaseNames[MAX_PHASES]; /* NULL: one phase named 'bench' */
+    int trackedOnly;            /* no system counterpart (report scans) */
+    void (*run)(const Allocator *, const struct BenchCase *, BenchResult *);
+} BenchCase;
+
+static unsigned g_maxLive    = MAX_LIVE_DEFAULT;
+static unsigned g_maxThreads = MAX_THREADS_DEFAULT;
+static int      g_quick      = 0;
+static const char *g_only    = NULL;
+
+/* ---------------------------------------------------------------------
+ * Helpers
+ * --------------------------------------------------------------------- */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Resident set size in bytes (falls back to the peak where statm is missing). */
+static long long rss_bytes(void) {
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long long size = 0, resident = 0;
+        int n = fscanf(f, "%lld %lld", &size, &resident);
+        fclose(f);
+        if (n == 2) {
+            return resident * (long long)sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return (long long)ru.ru_maxrss;
+#else
+    return (long long)ru.ru_maxrss * 1024;
+#endif
+}
+
+static inline unsigned long long next_rand(unsigned long long *state) {
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static size_t pick_size(const char *dist, unsigned long long *rng) {
+    unsigned long long r = next_rand(rng);
+    switch (dist[0]) {
+    case 's':   /* small: 16..63 bytes, typical node/string sizes */
+        return 16 + (size_t)(r % 48);
+    case 'l':   /* large: 4 KB..64 KB */
+        return 4096 + (size_t)(r % (60 * 1024));
+    default:    /* mixed: log-uniform from 8 bytes to 8 KB */
+        return ((size_t)8 << (r % 11)) + (size_t)((r >> 8) % 8);
+    }
+}
+
+/* ---------------------------------------------------------------------
+ * Workloads
+ * --------------------------------------------------------------------- */
+
+typedef struct {
+    const Allocator *a;
+    const BenchCase *c;
+    unsigned long long seed;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_barrier_t *start;
+#endif
+} ChurnArgs;
+
+/* Replaces random blocks in a ring of CHURN_SLOTS, touching each new one. */
+static void *churn_thread(void *arg) {
+    ChurnArgs *args = arg;
+    const Allocator *a = args->a;
+    void *slots[CHURN_SLOTS] = { 0 };
+    unsigned long long rng = args->seed;
+    unsigned long long calls = 0;
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (args->start) {
+        pthread_barrier_wait(args->start);
+    }
+#endif
+    while (calls < args->c->ops) {
+        unsigned i = (unsigned)(next_rand(&rng) % CHURN_SLOTS);
+        if (slots[i]) {
+            a->release(slots[i]);
+            calls++;
+        }
+        size_t size = pick_size(args->c->dist, &rng);
+        slots[i] = a->alloc(size);
+        if (slots[i]) {
+            ((char *)slots[i])[0] = (char)i;
+        }
+        calls++;
+    }
+    for (unsigned i = 0; i < CHURN_SLOTS; i++) {
+        a->release(slots[i]);
+    }
+    return NULL;
+}
+
+static void run_churn(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    unsigned threads = c->threads ? c->threads : 1;
+    ChurnArgs *args = sys_malloc(threads * sizeof(*args));
+    if (!args) {
+        return;
+    }
+    long long rss0 = rss_bytes();
+    double t0;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_barrier_t start;
+    pthread_t *tids = sys_malloc(threads * sizeof(*tids));
+    if (!tids) {
+        sys_free(args);
+        return;
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (unsigned i = 0; i < threads; i++) {
+        args[i] = (ChurnArgs){ a, c, 0x9E3779B97F4A7C15ull * (i + 1), &start };
+        pthread_create(&tids[i], NULL, churn_thread, &args[i]);
+    }
+    pthread_barrier_wait(&start);
+    t0 = now_ns();
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&start);
+    sys_free(tids);
+#else
+    args[0] = (ChurnArgs){ a, c, 0x9E3779B97F4A7C15ull };
+    t0 = now_ns();
+    churn_thread(&args[0]);
+#endif
+    r->phase[0].ns = now_ns() - t0;
+    r->phase[0].ops = c->ops * threads;
+    r->phase[0].rss = rss_bytes() - rss0;
+    r->phases = 1;
+    r->ok = 1;
+    sys_free(args);
+}
+
+/*
+ * The StringList pattern from test_code.c: an array of pointers that
+ * doubles with realloc while short strings are copied into it, then freed.
+ */
+static void run_string_list(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    static const char *const names[] = { "Alice", "Bob", "Charlie", "Dennis", "Eve", "Frank" };
+    unsigned long long calls = 0;
+    long long rss0 = rss_bytes();
+    double t0 = now_ns();
+
+    while (calls < c->ops) {
+        size_t size = 0, capacity = 4;
+        char **data = a->alloc(capacity * sizeof(char *));
+        calls++;
+        if (!data) {
+            return;
+        }
+        for (size_t i = 0; i < c->live; i++) {
+            if (size >= capacity) {
+                char **grown = a->resize(data, capacity * 2 * sizeof(char *));
+                calls++;
+                if (!grown) {
+                    break;
+                }
+                data = grown;
+                capacity *= 2;
+            }
+            const char *s = names[i % 6];
+            size_t len = strlen(s);
+            char *copy = a->alloc(len + 1);
+            calls++;
+            if (copy) {
+                memcpy(copy, s, len + 1);
+                data[size++] = copy;
+            }
+        }
+        for (size_t i = 0; i < size; i++) {
+            a->release(data[i]);
+        }
+        a->release(data);
+        calls += size + 1;
+    }
+    r->phase[0].ns = now_ns() - t0;
+    r->phase[0].ops = calls;
+    r->phase[0].rss = rss_bytes() - rss0;
+    r->phases = 1;
+    r->ok = 1;
+}
+
+/* A buffer grown 16 bytes at a time: the O(n^2) copy pattern. */
+static void run_append(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    unsigned long long calls = 0;
+    long long rss0 = rss_bytes();
+    double t0 = now_ns();
+
+    while (calls < c->ops) {
+        char *buf = NULL;
+        for (size_t len = 16; len <= c->live * 16; len += 16) {
+            char *grown = a->resize(buf, len);
+            calls++;
+            if (!grown) {
+                break;
+            }
+            buf = grown;
+            buf[len - 1] = 0;
+        }
+        a->release(buf);
+        calls++;
+    }
+    r->phase[0].ns = now_ns() - t0;
+    r->phase[0].ops = calls;
+    r->phase[0].rss = rss_bytes() - rss0;
+    r->phases = 1;
+    r->ok = 1;
+}
+
+/*
+ * Builds 'live' 32-byte blocks, replaces random ones while they are live
+ * (lookup cost at this table size), then frees them all.
+ */
+static void run_live_set(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    void **blocks = sys_malloc(c->live * sizeof(void *));
+    if (!blocks) {
+        return;
+    }
+    memset(blocks, 0, c->live * sizeof(void *));
+    unsigned long long rng = 0x2545F4914F6CDD1Dull;
+    long long rss0 = rss_bytes();
+
+    double t0 = now_ns();
+    for (size_t i = 0; i < c->live; i++) {
+        blocks[i] = a->alloc(32);
+    }
+    r->phase[0].ns = now_ns() - t0;
+    r->phase[0].ops = c->live;
+    r->phase[0].rss = rss_bytes() - rss0;
+
+    t0 = now_ns();
+    for (unsigned long long n = 0; n < c->ops; n += 2) {
+        size_t i = (size_t)(next_rand(&rng) % c->live);
+        a->release(blocks[i]);
+        blocks[i] = a->alloc(32);
+    }
+    r->phase[1].ns = now_ns() - t0;
+    r->phase[1].ops = c->ops;
+    r->phase[1].rss = r->phase[0].rss;
+
+    t0 = now_ns();
+    for (size_t i = 0; i < c->live; i++) {
+        a->release(blocks[i]);
+    }
+    r->phase[2].ns = now_ns() - t0;
+    r->phase[2].ops = c->live;
+    r->phase[2].rss = r->phase[0].rss;
+    r->phases = 3;
+    r->ok = 1;
+    sys_free(blocks);
+}
+
+/* Times log_memory_leaks() over 'live' leaked blocks, written to /dev/null. */
+static void run_leak_scan(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    FILE *out = fopen("/dev/null", "w");
+    if (!out) {
+        return;
+    }
+    for (size_t i = 0; i < c->live; i++) {
+        (void)a->alloc(32);
+    }
+    long long rss0 = rss_bytes();
+    double t0 = now_ns();
+    log_memory_leaks(out);
+    r->phase[0].ns = now_ns() - t0;
+    r->phase[0].ops = c->live;
+    r->phase[0].rss = rss_bytes() - rss0;
+    r->phases = 1;
+    r->ok = 1;
+    fclose(out);
+}
+
+/* ---------------------------------------------------------------------
+ * Running and reporting
+ * --------------------------------------------------------------------- */
+
+/* Runs one case on one allocator in a child so each starts from a clean heap. */
+static int run_isolated(const Allocator *a, const BenchCase *c, BenchResult *r) {
+    int fds[2];
+    memset(r, 0, sizeof(*r));
+    fflush(stdout);
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        BenchResult res;
+        memset(&res, 0, sizeof(res));
+        close(fds[0]);
+        c->run(a, c, &res);
+        ssize_t n = write(fds[1], &res, sizeof(res));
+        _exit(n == (ssize_t)sizeof(res) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return (n == (ssize_t)sizeof(*r) && r->ok) ? 0 : -1;
+}
+
+typedef struct {
+    char key[128];
+    double slowdown;
+    double rssPerBlock;
+} BaselineRow;
+
+static BaselineRow *g_baseline = NULL;
+static size_t g_baselineCount = 0;
+static double g_tolerance = 0.10;
+static unsigned g_regressions = 0;
+
+static void make_key(char *key, size_t cap, const char *bench, const char *dist,
+                     unsigned threads, size_t live) {
+    snprintf(key, cap, "%s/%s/%u/%zu", bench, dist, threads, live);
+}
+
+static int json_string(const char *line, const char *name, char *out, size_t cap) {
+    char pat[40];
+    snprintf(pat, sizeof(pat), "\"%s\":\"", name);
+    const char *p = strstr(line, pat);
+    if (!p) {
+        return 0;
+    }
+    p += strlen(pat);
+    size_t n = 0;
+    while (p[n] && p[n] != '"' && n + 1 < cap) {
+        out[n] = p[n];
+        n++;
+    }
+    out[n] = 0;
+    return 1;
+}
+
+static double json_number(const char *line, const char *name) {
+    char pat[40];
+    snprintf(pat, sizeof(pat), "\"%s\":", name);
+    const char *p = strstr(line, pat);
+    return p ? strtod(p + strlen(pat), NULL) : 0.0;
+}
+
+static int load_baseline(const char *path) {
+    FILE *in = fopen(path, "r");
+    char line[1024];
+    size_t cap = 0;
+    if (!in) {
+        fprintf(stderr, "bench: cannot open baseline %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        char bench[48], dist[16];
+        if (!json_string(line, "bench", bench, sizeof(bench)) ||
+            !json_string(line, "dist", dist, sizeof(dist))) {
+            continue;
+        }
+        if (g_baselineCount == cap) {
+            size_t newCap = cap ? cap * 2 : 64;
+            BaselineRow *grown = sys_realloc(g_baseline, newCap * sizeof(*grown));
+            if (!grown) {
+                break;
+            }
+            g_baseline = grown;
+            cap = newCap;
+        }
+        BaselineRow *row = &g_baseline[g_baselineCount++];
+        make_key(row->key, sizeof(row->key), bench, dist,
+                 (unsigned)json_number(line, "threads"), (size_t)json_number(line, "live"));
+        row->slowdown = json_number(line, "slowdown");
+        row->rssPerBlock = json_number(line, "rss_per_block");
+    }
+    fclose(in);
+    return 0;
+}
+
+static void check_baseline(const char *bench, const char *dist, unsigned threads,
+                           size_t live, double slowdown, double rssPerBlock) {
+    char key[128];
+    make_key(key, sizeof(key), bench, dist, threads, live);
+    for (size_t i = 0; i < g_baselineCount; i++) {
+        const BaselineRow *row = &g_baseline[i];
+        if (strcmp(row->key, key) != 0) {
+            continue;
+        }
+        if (row->slowdown > 0 && slowdown > row->slowdown * (1.0 + g_tolerance)) {
+            fprintf(stderr, "bench: %s slowdown %.2fx, baseline %.2fx\n",
+                    key, slowdown, row->slowdown);
+            g_regressions++;
+        }
+        /* Guard against noise on tiny sets: allow at least 4 bytes. */
+        if (row->rssPerBlock > 0 &&
+            rssPerBlock > row->rssPerBlock * (1.0 + g_tolerance) + 4.0) {
+            fprintf(stderr, "bench: %s rss %.1f B/block, baseline %.1f B/block\n",
+                    key, rssPerBlock, row->rssPerBlock);
+            g_regressions++;
+        }
+        return;
+    }
+}
+
+static void report(const BenchCase *c, const BenchResult *sys, const BenchResult *trk) {
+    for (unsigned p = 0; p < trk->phases; p++) {
+        const char *bench = c->phaseNames[0] ? c->phaseNames[p] : c->bench;
+        double trkNs = trk->phase[p].ops ? trk->phase[p].ns / (double)trk->phase[p].ops : 0.0;
+        double sysNs = 0.0, slowdown = 0.0, rssPerBlock = 0.0;
+        printf("{\"bench\":\"%s\",\"dist\":\"%s\",\"threads\":%u,\"live\":%zu,\"ops\":%llu,",
+               bench, c->dist, c->threads, c->live, trk->phase[p].ops);
+        if (sys) {
+            sysNs = sys->phase[p].ops ? sys->phase[p].ns / (double)sys->phase[p].ops : 0.0;
+            slowdown = sysNs > 0 ? trkNs / sysNs : 0.0;
+            printf("\"system_ns_per_op\":%.2f,", sysNs);
+        }
+        else {
+            printf("\"system_ns_per_op\":null,");
+        }
+        printf("\"tracked_ns_per_op\":%.2f,", trkNs);
+        if (sys) {
+            printf("\"slowdown\":%.3f,\"system_rss\":%lld,", slowdown, sys->phase[p].rss);
+        }
+        else {
+            printf("\"slowdown\":null,\"system_rss\":null,");
+        }
+        printf("\"tracked_rss\":%lld", trk->phase[p].rss);
+        if (sys && c->live) {
+            rssPerBlock = (double)(trk->phase[p].rss - sys->phase[p].rss) / (double)c->live;
+            printf(",\"rss_per_block\":%.1f", rssPerBlock);
+        }
+        printf("}\n");
+        if (g_baseline) {
+            check_baseline(bench, c->dist, c->threads, c->live, slowdown, rssPerBlock);
+        }
+    }
+    fflush(stdout);
+}
+
+static void run_case(const BenchCase *c) {
+    BenchResult sys, trk;
+    if (g_only && strcmp(g_only, c->bench) != 0) {
+        return;
+    }
+    if (!c->trackedOnly && run_isolated(&g_system, c, &sys) != 0) {
+        fprintf(stderr, "bench: %s (%s, %zu live) failed on the system allocator\n",
+                c->bench, c->dist, c->live);
+        return;
+    }
+    if (run_isolated(&g_tracked, c, &trk) != 0) {
+        fprintf(stderr, "bench: %s (%s, %zu live) failed on the tracker\n",
+                c->bench, c->dist, c->live);
+        return;
+    }
+    report(c, c->trackedOnly ? NULL : &sys, &trk);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-q] [-l maxLive] [-t maxThreads] [-o bench] [-b baseline.jsonl] [-r tolerance]\n"
+            "  -q  quick run (up to 100k live blocks, 8 threads, fewer ops)\n"
+            "  -o  run only the named benchmark (churn, string_list, append, live, leak_scan)\n"
+            "  -b  compare with an earlier output; exit 1 on regressions\n"
+            "  -r  allowed relative regression, default 0.10\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *baseline = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "ql:t:o:b:r:h")) != -1) {
+        switch (opt) {
+        case 'q': g_quick = 1; break;
+        case 'l': g_maxLive = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 't': g_maxThreads = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'o': g_only = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 'r': g_tolerance = strtod(optarg, NULL); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (g_quick) {
+        if (g_maxLive > 100000) g_maxLive = 100000;
+        if (g_maxThreads > 8) g_maxThreads = 8;
+    }
+#ifdef NO_THREAD_SAFE_LEAK_TRACKER
+    g_maxThreads = 1;
+#endif
+    if (baseline && load_baseline(baseline) != 0) {
+        return 2;
+    }
+    unsigned long long ops = g_quick ? 200000ull : 2000000ull;
+    static const char *const dists[] = { "small", "mixed", "large" };
+
+    /* malloc/free throughput per size distribution, single thread */
+    for (unsigned d = 0; d < 3; d++) {
+        BenchCase c = { "churn", dists[d], 1, CHURN_SLOTS, ops, { NULL }, 0, run_churn };
+        run_case(&c);
+    }
+    /* scaling with threads, small blocks */
+    for (unsigned t = 2; t <= g_maxThreads; t *= 2) {
+        BenchCase c = { "churn", "small", t, CHURN_SLOTS * t, ops / 2, { NULL }, 0, run_churn };
+        run_case(&c);
+    }
+    /* realloc growth */
+    {
+        BenchCase list = { "string_list", "-", 1, 1000, ops, { NULL }, 0, run_string_list };
+        BenchCase append = { "append", "-", 1, 256, ops / 4, { NULL }, 0, run_append };
+        run_case(&list);
+        run_case(&append);
+    }
+    /* live-set size: build, churn at that size, teardown; then the leak report */
+    for (size_t live = 1000; live <= g_maxLive; live *= 10) {
+        BenchCase c = { "live", "-", 1, live, ops,
+                        { "live_build", "live_churn", "live_free" }, 0, run_live_set };
+        BenchCase scan = { "leak_scan", "-", 1, live, 0, { NULL }, 1, run_leak_scan };
+        run_case(&c);
+        run_case(&scan);
+    }
+    sys_free(g_baseline);
+    return g_regressions ? 1 : 0;
+}
+
+// gcc -O2 -Wall -Wextra -o bench_leak_tracker bench_leak_tracker.c leak_tracker.c -pthread
+// ./bench_leak_tracker -q > baseline.jsonl
+// ./bench_leak_tracker -q -b baseline.jsonl
@@ -1,3 +1,6 @@
+#if (defined(LEAK_TRACKER_PRELOAD) || defined(__linux__)) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE /* RTLD_NEXT, pthread_getattr_np() */
+#endif
 #include "leak_tracker.h"
 
 /* Undefine so we can call real malloc/realloc/calloc/free internally. */
@@ -5,380 +8,5973 @@
 #undef realloc
 #undef calloc
 #undef free
+#undef aligned_alloc
+#undef posix_memalign
+
+/* The system allocator's usable size of a block, where it tells (see rec_cost()) */
+#if !defined(LEAK_TRACKER_NO_USABLE_SIZE)
+  #if defined(__GLIBC__)
+    #include <malloc.h>
+    #define system_usable_size(p) malloc_usable_size(p)
+    #define HAVE_USABLE_SIZE 1
+  #elif defined(__APPLE__)
+    #include <malloc/malloc.h>
+    #define system_usable_size(p) malloc_size(p)
+    #define HAVE_USABLE_SIZE 1
+  #elif defined(_WIN32)
+    #include <malloc.h>
+    #define system_usable_size(p) _msize(p)
+    #define HAVE_USABLE_SIZE 1
+  #endif
+#endif
+
+/*
+ * LEAK_TRACKER_PRELOAD builds a shared object that replaces malloc & co.
+ * itself (see Preload Mode at the end), so inside this file the "real"
+ * calls go to the next allocator in link order instead.
+ */
+#ifdef LEAK_TRACKER_PRELOAD
+  #ifdef NO_THREAD_SAFE_LEAK_TRACKER
+    #error "LEAK_TRACKER_PRELOAD needs the thread-safe build"
+  #endif
+  #include <dlfcn.h>
+static void *real_malloc (size_t size);
+static void *real_calloc (size_t count, size_t size);
+static void *real_realloc(void *ptr, size_t size);
+static void  real_free   (void *ptr);
+static size_t real_usable_size(void *ptr);
+  #define malloc(size)       real_malloc(size)
+  #define calloc(count, size) real_calloc((count), (size))
+  #define realloc(ptr, size) real_realloc((ptr), (size))
+  #define free(ptr)          real_free(ptr)
+  #ifdef HAVE_USABLE_SIZE
+    #undef  system_usable_size
+    #define system_usable_size(p) real_usable_size(p)
+  #endif
+/* Reentrancy guard: what the C library allocates meanwhile isn't tracked */
+static __thread int t_inTracker __attribute__((tls_model("initial-exec")));
+  #define UNTRACKED_BEGIN() (t_inTracker++)
+  #define UNTRACKED_END()   (t_inTracker--)
+#else
+  #define UNTRACKED_BEGIN() ((void)0)
+  #define UNTRACKED_END()   ((void)0)
+#endif
 
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #include <x86intrin.h>
+  #define HAVE_RDTSC 1
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+  #include <fcntl.h>
+  #include <sched.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #define HAVE_MMAP 1
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__)
+  #include <execinfo.h>
+  #define HAVE_BACKTRACE 1
+#endif
+#if defined(__linux__)
+  #include <link.h>
+  #include <setjmp.h>
+  #define HAVE_REACH_SCAN 1
+#endif
 
-/* 
+/*
  * SENTINEL_SIZE bytes at front and back detect simple overruns.
  * We'll store a fixed pattern in these areas.
  */
 #define SENTINEL_SIZE 8
-static const unsigned char SENTINEL_PATTERN[8] = {0xDE, 0xAD, 0xC0, 0xDE, 0xDE, 0xAD, 0xC0, 0xDE};
+
+/*
+ * The guard zones can be made larger (leak_tracker_set_guard_size), up to
+ * SENTINEL_MAX bytes, always a multiple of SENTINEL_SIZE. They hold the
+ * pattern repeated; SENTINEL_PATTERN is one 64-byte stretch of it, so a
+ * vector load at any multiple of 8 into a guard compares against its start.
+ */
+#define SENTINEL_MAX 4096
+#define DEADC0DE_8   0xDE, 0xAD, 0xC0, 0xDE, 0xDE, 0xAD, 0xC0, 0xDE
+static const unsigned char SENTINEL_PATTERN[64] = {
+    DEADC0DE_8, DEADC0DE_8, DEADC0DE_8, DEADC0DE_8,
+    DEADC0DE_8, DEADC0DE_8, DEADC0DE_8, DEADC0DE_8
+};
+
+/*
+ * User pointers are aligned to at least MIN_ALIGN (what malloc promises),
+ * so the front guard is padded up to it. Block sizes are computed assuming
+ * only MALLOC_ALIGN from the real allocator, which covers 32-bit
+ * allocators that return less than max_align_t.
+ */
+#define MIN_ALIGN    _Alignof(max_align_t)
+#define MALLOC_ALIGN (2 * sizeof(void*))
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define NEVER_INLINE  __attribute__((noinline))
+#define PREFETCH(p)   __builtin_prefetch((p), 1)
+#if defined(__clang__) || __GNUC__ >= 8
+/* For code that reads memory it doesn't own, e.g. other threads' stacks */
+#define NO_SANITIZE   __attribute__((no_sanitize("address", "thread")))
+#endif
+#else
+#define ALWAYS_INLINE inline
+#define NEVER_INLINE
+#define PREFETCH(p)   ((void)(p))
+#endif
+#ifndef NO_SANITIZE
+#define NO_SANITIZE
+#endif
+
+/*
+ * The live set is split into SHARD_COUNT independent shards (table,
+ * quarantine and lock), picked by pointer hash, so threads touching
+ * different blocks rarely contend. Must be a power of two <= 256.
+ */
+#ifdef NO_THREAD_SAFE_LEAK_TRACKER
+#define SHARD_COUNT 1
+#elif defined(LEAK_TRACKER_SHARDS)
+#define SHARD_COUNT LEAK_TRACKER_SHARDS
+#else
+#define SHARD_COUNT 16
+#endif
 
 /* ========== Data Structures ========== */
 
-/* Linked list node for active allocations */
+/*
+ * Record for an active allocation, kept to 40 bytes: a scan over the live
+ * set (reports, teardown) only streams these, and the live table holds
+ * the hot part (pointer keys) separately. The real pointer, alignment and
+ * guard size are stored in compact form (see the rec_* helpers); what only
+ * some blocks need lives in RecordExtra, taken from the record slabs on
+ * first use.
+ */
+#define REC_SIZE_BITS  45
+#define REC_SITE_BITS  20
+#define REC_CHAIN_MAX  ((1u << (32 - REC_SITE_BITS)) - 1)
+#define REC_FRONT_MAX  0xFFFFFFFFu
+
+typedef struct RecordExtra RecordExtra;
+
 typedef struct Allocation {
-    void               *realPtr;       /* Pointer from real malloc (including sentinels). */
     void               *userPtr;       /* Pointer returned to the user (start of usable data). */
-    size_t             requestedSize;  /* Bytes the user requested. */
-    size_t             totalSize;      /* Actual allocated size (requested + sentinel overhead). */
-    const char         *file;
-    int                line;
-    struct Allocation  *next;
+    uint64_t           requestedSize : REC_SIZE_BITS; /* Bytes the user requested. */
+    uint64_t           guardUnits    : 9;  /* Sentinel bytes on each side / SENTINEL_SIZE - 1. */
+    uint64_t           alignShift    : 6;  /* log2 of userPtr's alignment (MIN_ALIGN or more). */
+    uint64_t           kind          : 2;  /* LEAK_TRACKER_KIND_*: how it must be freed. */
+    uint64_t           reach         : 2;  /* LEAK_TRACKER_REACH_* found by the last scan. */
+    unsigned long long born;           /* now_ticks() at allocation. */
+    RecordExtra        *extra;         /* NULL until one of its fields is needed. */
+    unsigned           site     : REC_SITE_BITS; /* Index into g_siteStats (file and line live there). */
+    unsigned           reallocs : 32 - REC_SITE_BITS; /* Reallocs so far, up to REC_CHAIN_MAX. */
+    unsigned           front;          /* userPtr - pointer from real malloc (or page run). */
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    unsigned           magic;          /* HEADER_MAGIC while the block is live. */
+#endif
 } Allocation;
 
-/* Linked list node for freed pointers (to detect double-free) */
-typedef struct Freed {
-    void         *ptr;
-    struct Freed *next;
-} Freed;
+/* The rarely needed part of a record */
+struct RecordExtra {
+    size_t             pages;          /* Accessible pages of a guard-page run, 0 = malloc'd. */
+    double             sampleWeight;   /* 1/p if picked by sampling, 0 if always tracked. */
+    unsigned           stack;          /* Call stack id, 0 = not captured. */
+    atomic_uint        epoch;          /* Epoch it was allocated in, 0 = none. */
+    Allocation         *epochPrev;     /* Links in that epoch's list. */
+    Allocation         *epochNext;
+};
+
+/*
+ * With LEAK_TRACKER_INLINE_HEADER the record is stored in the block itself,
+ * in front of the front sentinel:
+ *
+ *   realPtr -> [Allocation][padding][front sentinel][user data][back sentinel]
+ *
+ * so each tracked allocation costs a single real malloc. Otherwise records
+ * are separate nodes and HEADER_SIZE is 0. The padding (possibly none) puts
+ * the user data on the block's alignment; the front sentinel always sits
+ * right before it.
+ */
+#ifdef LEAK_TRACKER_INLINE_HEADER
+#define HEADER_SIZE  sizeof(Allocation)
+#define HEADER_MAGIC 0x4C54524BU /* "LTRK" */
+#else
+#define HEADER_SIZE  0
+#endif
+
+/*
+ * Live allocations are kept in an open-addressing (linear probing) hash
+ * table keyed by userPtr. The key is stored in the slot so probing never
+ * has to dereference the record.
+ */
+typedef struct {
+    void       *key;    /* userPtr, NULL = empty slot */
+    Allocation *alloc;
+} AllocSlot;
+
+typedef struct {
+    AllocSlot *slots;
+    size_t     capacity; /* power of two, 0 = not allocated yet */
+    size_t     count;
+} AllocTable;
+
+#define TABLE_MIN_CAPACITY 64
+#define TABLE_MIGRATE_STEP 16 /* old slots moved per insert while resizing */
+
+/*
+ * Quarantine of recently freed pointers (to detect double-free).
+ * A FIFO ring bounded by entry count and bytes, indexed by a hash set of
+ * ring positions so every lookup is O(1) regardless of uptime.
+ */
+typedef struct {
+    void   *ptr;     /* user pointer, NULL = dead (pointer was reused) */
+    void   *realPtr; /* still owned by us when reuse is delayed, else NULL */
+    size_t  size;    /* user size, counted against the byte budget */
+} QuarantineEntry;
+
+/* Ring and its hash set (set slot = ring index + 1, 0 = empty) */
+typedef struct {
+    QuarantineEntry *ring;
+    unsigned        *set;
+    size_t           setCapacity;
+    size_t           capacity;    /* ring entries, this shard's share of the limit */
+    size_t           head;
+    size_t           length;
+    size_t           bytes;
+} Quarantine;
+
+#define QUARANTINE_DEFAULT_ENTRIES 65536
+#define QUARANTINE_DEFAULT_BYTES   ((size_t)64 * 1024 * 1024)
+#define QUARANTINE_MAX_ENTRIES     ((size_t)1 << 30)
+
+/*
+ * Separate records, and every RecordExtra, are carved out of fixed-size
+ * slabs held by a global depot; both fit the same SLAB_UNIT, so one pool
+ * serves them. Each thread keeps a magazine of free units and only visits the
+ * depot to exchange MAGAZINE_SIZE of them at a time, so creating and
+ * destroying records neither reaches the system allocator nor takes a
+ * shared lock on the common path. Slabs are only released by a teardown,
+ * and only those all of whose records are back in the depot.
+ */
+#define SLAB_SIZE     ((size_t)64 * 1024)
+#define MAGAZINE_SIZE 64
+
+typedef struct Slab {
+    struct Slab *next;
+    size_t       freeCount; /* records in the depot, see release_free_slabs() */
+} Slab;
+
+#ifdef LEAK_TRACKER_INLINE_HEADER
+#define SLAB_UNIT    sizeof(RecordExtra) /* records live in their blocks */
+#else
+#define SLAB_UNIT    (sizeof(Allocation) > sizeof(RecordExtra) ? sizeof(Allocation) : sizeof(RecordExtra))
+#endif
+#define SLAB_FIRST   ((sizeof(Slab) + 15) & ~(size_t)15)
+#define SLAB_RECORDS ((SLAB_SIZE - SLAB_FIRST) / SLAB_UNIT)
+
+typedef struct SlabRecord {
+    struct SlabRecord *next; /* overlays a free Allocation */
+} SlabRecord;
+
+/*
+ * One shard of the tracker. Growing the table is incremental: the previous
+ * table becomes oldTable and is drained a few slots at a time on each
+ * insert, so no single call pays for rehashing millions of records.
+ */
+typedef struct {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_t lock;
+#endif
+    AllocTable  table;
+    AllocTable  oldTable;
+    size_t      migrateCursor;
+    unsigned    resizes;        /* bumped whenever a new table is put in */
+    Quarantine  quarantine;
+    _Atomic size_t trackerBytes; /* bytes this shard holds (tables, quarantine) */
+    size_t      teardownCursor; /* next slot for leak_tracker_teardown_step() */
+    void      **forgotten;      /* blocks a FORGET teardown dropped, sorted */
+    size_t      forgottenCount;
+    int         forgetAll;      /* that list couldn't be made: every unknown block is one */
+} Shard;
+
+/*
+ * In batched mode new records are first parked in the allocating thread's
+ * pending list and published to the shards PENDING_MAX at a time, taking
+ * each shard lock once per batch. Blocks freed while still pending never
+ * touch the shared tables at all.
+ */
+#define PENDING_MAX 32
+
+/*
+ * Per-thread state: usage counters, record magazine and pending records.
+ *
+ * The counters are summed only when stats are read. Only the owning
+ * thread writes them (relaxed atomic load + store, no locked instruction),
+ * readers load them without any lock. Bytes freed by another thread than
+ * the one that allocated them make a thread's values go "negative": they
+ * are unsigned and wrap, and the sum over all threads is still exact. For
+ * the same reason a slot released by an exiting thread keeps its values
+ * (and its magazine) and is simply reused by the next one; only its
+ * unfolded in-use delta is folded into the shared counter.
+ */
+/* Histograms kept per thread (MemHistograms) */
+#define HIST_SIZES     0
+#define HIST_GROWTH    1
+#define HIST_LIFETIMES 2
+#define HIST_KINDS     3
+#define HIST_SUB_BITS  2 /* 4 sub-bins per power of two */
+
+typedef struct ThreadState {
+    _Atomic size_t      totalAllocated;  /* cumulative bytes allocated by this slot */
+    _Atomic size_t      allocationCount; /* allocations minus frees by this slot */
+    _Atomic size_t      unfoldedBytes;   /* in-use delta not yet folded into g_currentAllocated */
+    atomic_int          inUse;           /* owned by a live thread */
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_t           thread;          /* the owner, whose stack a scan reads */
+#endif
+    struct ThreadState *next;            /* registry link, immutable once published */
+    SlabRecord         *magazine;        /* free records, owner only */
+    size_t              magazineCount;
+    size_t              bytesUntilSample; /* sampling countdown, owner only */
+    size_t              sampleGap;        /* interval the countdown was drawn for */
+    unsigned long long  rngState;
+    _Atomic unsigned long long estExtraBytes;  /* sum of size * (w - 1) over sampled blocks */
+    _Atomic unsigned long long estExtraBlocks; /* sum of (w - 1), 16.16 fixed point */
+    _Atomic unsigned long long estVariance;    /* sum of (w^2 - w) * size^2 */
+    _Atomic size_t      hist[HIST_KINDS][LEAK_TRACKER_HIST_BINS]; /* see hist_bin() */
+    unsigned            epoch;           /* current epoch of the owner, 0 = none */
+    /* Trace chunk being written (leak_tracker_trace_start), owner only */
+    unsigned char      *traceChunk;      /* mapped chunk, NULL = none */
+    size_t              traceCap;        /* its size */
+    size_t              traceUsed;
+    unsigned long long  traceTicks;      /* last event's time and pointer, for deltas */
+    uintptr_t           tracePtr;
+    unsigned            traceGen;        /* trace the chunk belongs to */
+    unsigned            traceThread;     /* thread number in traces, 0 = unassigned */
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_t     cacheLock;       /* guards pending[]: owner vs. flushing threads */
+    size_t              pendingCount;
+    Allocation         *pending[PENDING_MAX];
+#endif
+} ThreadState;
+
+/*
+ * In-use bytes are folded into the shared counter once a thread's delta
+ * exceeds this. In between, the peak is checked against the folded total
+ * plus the thread's own delta, so Peak In-Use is exact for a single
+ * allocating thread and within STATS_FOLD_BYTES per other thread.
+ */
+#ifdef NO_THREAD_SAFE_LEAK_TRACKER
+#define STATS_FOLD_BYTES 0
+#else
+#define STATS_FOLD_BYTES ((size_t)64 * 1024)
+#endif
+
+static Shard g_shards[SHARD_COUNT];
+
+/*
+ * Teardown: g_teardownShard is the shard the next teardown step starts
+ * with. The blocks a LEAK_TRACKER_TEARDOWN_FORGET teardown drops are kept
+ * in their shard's forgotten list, so freeing one of them later is
+ * recognised and left alone (its real pointer is lost).
+ */
+static atomic_uint g_teardownShard;
+
+/* Record depot, see MAGAZINE_SIZE */
+static Slab          *g_depotSlabs   = NULL;
+static SlabRecord    *g_depotRecords = NULL;
+static _Atomic size_t g_depotBytes   = 0;
+
+/*
+ * Sampling (leak_tracker_set_sample_interval): when g_sampleInterval is
+ * non-zero only about one allocation per g_sampleInterval bytes is tracked,
+ * the rest go straight to the system allocator. Blocks are picked by a
+ * Poisson process over allocated bytes, so a block of size s is tracked
+ * with probability p = 1 - exp(-s / interval) and stands for 1/p blocks
+ * (Horvitz-Thompson estimator).
+ *
+ * Once sampling has been enabled, every tracked block and every quarantined
+ * pointer is also counted in g_sampleFilter (a counting Bloom filter indexed
+ * by pointer hash), so a free of an untracked block is recognised without
+ * taking any lock, while a double free still reaches the quarantine.
+ */
+#define SAMPLE_FILTER_SIZE ((size_t)1 << 16)
+
+static size_t              g_sampleInterval = 0;
+static int                 g_filterOn       = 0;
+static atomic_uint         g_sampleFilter[SAMPLE_FILTER_SIZE];
+static _Atomic unsigned long long g_estExtraBytes  = 0; /* as in ThreadState, no slot */
+static _Atomic unsigned long long g_estExtraBlocks = 0;
+static _Atomic unsigned long long g_estVariance    = 0;
+
+/* Histogram counts with no thread slot, and the clock calibration point */
+static _Atomic size_t             g_hist[HIST_KINDS][LEAK_TRACKER_HIST_BINS];
+static unsigned long long         g_clockStartTicks = 0;
+static unsigned long long         g_clockStartNs    = 0;
+
+/* Quarantine limits, see leak_tracker_set_quarantine() */
+static size_t g_qMaxEntries = QUARANTINE_DEFAULT_ENTRIES;
+static size_t g_qMaxBytes   = QUARANTINE_DEFAULT_BYTES;
+static int    g_qDelayReuse = 0;
+
+/* Guard zone size for new blocks, see leak_tracker_set_guard_size() */
+static size_t g_guardSize = SENTINEL_SIZE;
+
+/*
+ * Guard pages (leak_tracker_set_guard_pages): selected blocks get their own
+ * run of pages followed by an inaccessible page, with the user data ending
+ * right at it (give or take alignment, the slack holds the back sentinel),
+ * so an overrun faults at the offending store. Freed runs are made
+ * inaccessible as well and parked in a FIFO pool per page count, so reuse
+ * costs one mprotect instead of mmap + munmap and stale pointers keep
+ * faulting for a while.
+ */
+#define PAGE_POOL_CLASSES 16 /* runs of 1..16 pages are pooled */
+#define PAGE_POOL_DEPTH   64 /* runs kept per class */
+
+typedef struct {
+    void  *runs[PAGE_POOL_DEPTH];
+    size_t head;
+    size_t count;
+} PagePool;
+
+static size_t   g_pageSize        = 0;
+static size_t   g_pageMin         = 0;
+static size_t   g_pageMax         = 0; /* 0 = guard pages off */
+static int      g_pageSampledOnly = 0;
+static PagePool g_pagePools[PAGE_POOL_CLASSES];
+
+/*
+ * Memory usage counters shared by all threads. Totals and counts live in
+ * ThreadState; these hold what could not be attributed to a thread slot.
+ */
+static _Atomic size_t g_totalAllocated   = 0; /* cumulative total bytes ever allocated */
+static _Atomic size_t g_currentAllocated = 0; /* currently allocated (in-use) bytes, folded */
+static _Atomic size_t g_peakAllocated    = 0; /* peak in-use bytes */
+static _Atomic size_t g_allocationCount  = 0; /* count of active allocations */
+
+/*
+ * Diagnostics (double free, unknown pointer, corruption...) are never
+ * printed from inside the allocator. They are pushed as small binary events
+ * into a bounded lock-free MPSC ring and formatted later by
+ * leak_tracker_drain() or the background reporter, so a noisy bug can't
+ * stall allocating threads on stderr.
+ *
+ * Each event slot carries a sequence number stored relative to its index
+ * (seq - index), so the all-zero static ring is already initialised.
+ */
+typedef enum {
+    DIAG_DOUBLE_FREE,
+    DIAG_FREE_UNKNOWN,
+    DIAG_REALLOC_UNKNOWN,
+    DIAG_FRONT_SENTINEL,
+    DIAG_BACK_SENTINEL,
+    DIAG_HEADER_CORRUPT,
+    DIAG_REALLOC_UNTRACKED,
+    DIAG_UNTRACKED,
+    DIAG_CALLOC_OVERFLOW,
+    DIAG_MISMATCHED_FREE,
+    DIAG_SIZE_MISMATCH,
+    DIAG_PROCESS_BUDGET,
+    DIAG_SITE_BUDGET,
+    DIAG_REALLOC_FREED,
+    DIAG_TYPE_COUNT
+} DiagType;
+
+typedef struct {
+    _Atomic size_t seq;
+    const void    *ptr;
+    const char    *file;  /* call site, or allocation site for corruption */
+    int            line;
+    int            type;
+} DiagEvent;
+
+/*
+ * Per-site rate limiting: a site (file, line, type) enqueues at most
+ * DIAG_SITE_BURST events between two drains; the rest are only counted and
+ * summarised by the next drain.
+ */
+typedef struct {
+    atomic_int     state;      /* 0 = free, 1 = being claimed, 2 = ready */
+    const char    *file;
+    int            line;
+    int            type;
+    atomic_uint    emitted;    /* events enqueued since the last drain */
+    _Atomic size_t suppressed; /* events dropped since the last drain */
+} DiagSite;
+
+#define DIAG_RING_SIZE  4096 /* power of two */
+#define DIAG_SITE_COUNT 256  /* power of two */
+#define DIAG_SITE_BURST 4
+
+static DiagEvent      g_diagRing[DIAG_RING_SIZE];
+static _Atomic size_t g_diagHead    = 0; /* next slot to fill (producers) */
+static size_t         g_diagTail    = 0; /* next slot to read (drain only) */
+static _Atomic size_t g_diagDropped = 0; /* lost because the ring was full */
+static DiagSite       g_diagSites[DIAG_SITE_COUNT];
+
+/*
+ * Per-call-site aggregates, updated on every malloc/free so a top-N report
+ * never has to walk the live set. Sites are interned by (file, line)
+ * content: g_siteSlots maps each distinct (__FILE__ pointer, line) seen to
+ * its site, and is read without locks; new entries are only added under
+ * g_siteMutex, which also guards g_siteByName (content hash -> site).
+ * Site 0 collects everything once SITE_MAX sites exist.
+ */
+#ifndef LEAK_TRACKER_SITES
+#define LEAK_TRACKER_SITES 4096
+#endif
+#define SITE_MAX   LEAK_TRACKER_SITES       /* power of two */
+#if SITE_MAX > (1 << REC_SITE_BITS)
+  #error "LEAK_TRACKER_SITES must fit in REC_SITE_BITS"
+#endif
+#define SITE_SLOTS (2 * LEAK_TRACKER_SITES) /* pointer slots, load <= 1/2 */
+
+typedef struct {
+    const char     *file;
+    int             line;
+    _Atomic size_t  liveCount;
+    _Atomic size_t  liveBytes;
+    _Atomic size_t  peakBytes;
+    _Atomic size_t  totalCount;
+    _Atomic size_t  totalBytes;
+    /* As a realloc call site: */
+    _Atomic size_t  reallocs;
+    _Atomic size_t  grows;
+    _Atomic size_t  moves;        /* block moved, data copied */
+    _Atomic size_t  bytesCopied;
+    _Atomic size_t  bytesGrown;
+    _Atomic unsigned long long growthSum; /* new/old size of growing calls, 16.16 */
+    atomic_uint     longestChain;
+    atomic_int      disabled;     /* leak_tracker_enable_site(): don't track new blocks */
+    /* What its live blocks cost beyond liveBytes, see rec_cost(): */
+    _Atomic size_t  liveOverhead;
+    _Atomic size_t  liveSlack;
+    /* Budget and failure injection, see g_policyOn: */
+    _Atomic size_t  budget;       /* max live bytes, 0 = none */
+    _Atomic unsigned long long failEvery; /* fail every Nth call here, 0 = never */
+    atomic_uint     failRate;     /* failure probability, 0.32 fixed point */
+    _Atomic unsigned long long failCalls; /* calls counted for the above */
+} SiteStats;
+
+typedef struct {
+    atomic_int  ready;   /* fields below are valid */
+    const char *file;
+    int         line;
+    unsigned    site;
+} SiteSlot;
+
+static SiteStats       g_siteStats[SITE_MAX] = { { .file = "(other sites)" } };
+static atomic_uint     g_siteCount = 1;
+static SiteSlot        g_siteSlots[SITE_SLOTS];
+static unsigned        g_siteByName[SITE_SLOTS]; /* site + 1, 0 = empty */
+
+/*
+ * Budgets (leak_tracker_set_budget) and failure injection
+ * (leak_tracker_inject_failures). g_policyOn is the only thing the
+ * allocation path looks at until one of them is set; the checks then read
+ * the running counters, never walk anything. g_policySites counts the
+ * sites with a setting of their own. Failures are drawn from a hash of the
+ * seed and a per-site call number, so a run that makes the same calls in
+ * the same order fails the same ones.
+ */
+static atomic_int      g_policyOn;
+static atomic_uint     g_policySites;
+static SiteStats       g_allSites;          /* process-wide settings, in the same fields */
+static _Atomic unsigned long long g_failSeed;
+static _Atomic(LeakBudgetHandler) g_budgetHandler;
+static void * _Atomic  g_budgetCtx;
+static _Atomic size_t  g_injected;          /* failures injected so far */
+static _Atomic size_t  g_overBudget;        /* allocations refused for a budget */
+
+/*
+ * Epochs (leak_tracker_epoch_begin): blocks allocated by a thread inside
+ * one are linked into that epoch's list, so checking what survived it
+ * costs O(its live blocks). A new epoch takes the next slot (round-robin)
+ * that isn't in an active epoch; reusing a slot forgets the blocks the old
+ * epoch still had. An id is a multiple of EPOCH_MAX plus its slot.
+ */
+#ifndef LEAK_TRACKER_EPOCHS
+#define LEAK_TRACKER_EPOCHS 1024
+#endif
+#define EPOCH_MAX LEAK_TRACKER_EPOCHS /* power of two */
+
+typedef struct {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_t lock;
+#endif
+    unsigned    id;        /* epoch using the slot, 0 = never used */
+    unsigned    parent;    /* epoch to return to when it ends */
+    int         active;    /* between begin and end */
+    size_t      liveCount;
+    size_t      liveBytes;
+    Allocation *head;
+} Epoch;
+
+static Epoch           g_epochs[EPOCH_MAX];
+static atomic_uint     g_epochCursor;
 
-/* Global pointers to the lists */
-static Allocation *g_allocations = NULL;
-static Freed      *g_freed       = NULL;
+/*
+ * Allocation trace (leak_tracker_trace_start): every thread appends its
+ * events to its own chunk of a memory-mapped file, so recording costs a
+ * few varint stores and no lock. Chunks are handed out under g_traceMutex,
+ * which also guards the fields below; g_traceOn holds the running trace's
+ * generation (0 = off) and is checked without the lock.
+ */
+static atomic_uint     g_traceOn;
+static unsigned        g_traceGen;
+static int             g_traceFd         = -1;
+static size_t          g_traceChunkSize  = 0;
+static size_t          g_traceDataOffset = 0;
+static size_t          g_traceChunks     = 0;
+static atomic_uint     g_traceThreads;
+
+/*
+ * Call stacks (leak_tracker_set_stack_depth): captured with backtrace() at
+ * allocation time and hash-consed, so a record only keeps a stack id.
+ * Like the site slots, g_stackSlots is probed without locks and only grows
+ * under g_stackMutex. Frames are turned into names (backtrace_symbols())
+ * when a report first prints the stack, and the result is kept.
+ */
+#ifndef LEAK_TRACKER_STACKS
+#define LEAK_TRACKER_STACKS 16384
+#endif
+#define STACK_MAX        LEAK_TRACKER_STACKS       /* ids, power of two */
+#define STACK_SLOTS      (2 * LEAK_TRACKER_STACKS) /* hash slots, load <= 1/2 */
+#define STACK_MAX_DEPTH  32
+#define STACK_FRAME_POOL ((size_t)LEAK_TRACKER_STACKS * 16)
 
-/* Memory usage counters */
-static size_t g_totalAllocated   = 0; /* cumulative total bytes ever allocated */
-static size_t g_currentAllocated = 0; /* currently allocated (in-use) bytes */
-static size_t g_peakAllocated    = 0; /* peak in-use bytes */
-static size_t g_allocationCount  = 0; /* count of active allocations */
+typedef struct {
+    atomic_uint  id;      /* stack id, 0 = empty; fields below valid once set */
+    unsigned     hash;
+    unsigned     depth;
+    size_t       offset;  /* first frame in g_stackFrames */
+} StackSlot;
 
-/* Optional mutex for thread safety */
+typedef struct {
+    size_t   offset;
+    unsigned depth;
+    char   **symbols;     /* lazily filled, under g_stackMutex */
+} StackInfo;
+
+static int        g_stackDepth      = 0;
+static StackSlot  g_stackSlots[STACK_SLOTS];
+static StackInfo  g_stackInfo[STACK_MAX];     /* by id */
+static void      *g_stackFrames[STACK_FRAME_POOL];
+static unsigned   g_stackCount      = 1;      /* id 0 is "no stack" */
+static size_t     g_stackFramesUsed = 0;
+
+/*
+ * Optional locks for thread safety: one per shard, one for the record depot
+ * and one per thread for its pending list. The runtime threading mode can
+ * turn them all off (LEAK_TRACKER_THREADS_SINGLE) or enable batching.
+ */
 #ifndef NO_THREAD_SAFE_LEAK_TRACKER
-static pthread_mutex_t g_allocMutex = PTHREAD_MUTEX_INITIALIZER;
-#define LOCK_TRACKER()   pthread_mutex_lock(&g_allocMutex)
-#define UNLOCK_TRACKER() pthread_mutex_unlock(&g_allocMutex)
+static pthread_once_t  g_initOnce    = PTHREAD_ONCE_INIT;
+static pthread_key_t   g_stateKey;
+static pthread_mutex_t g_depotMutex  = PTHREAD_MUTEX_INITIALIZER;
+static ThreadState * _Atomic g_threads = NULL; /* lock-free, push-only registry */
+static _Thread_local ThreadState *t_state = NULL;
+static int             g_threadMode  = LEAK_TRACKER_THREADS_LOCKED;
+static pthread_mutex_t g_drainMutex  = PTHREAD_MUTEX_INITIALIZER; /* one consumer at a time */
+static pthread_mutex_t g_siteMutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_stackMutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_pageMutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_traceMutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_reporterMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_reporterWake  = PTHREAD_COND_INITIALIZER;
+static pthread_t       g_reporter;
+static int             g_reporterRunning = 0;
+static pthread_mutex_t g_agentMutex  = PTHREAD_MUTEX_INITIALIZER; /* one publisher at a time */
+static pthread_cond_t  g_agentWake   = PTHREAD_COND_INITIALIZER;
+static pthread_t       g_agent;
+static int             g_agentThread = 0;
+#define LOCKING_ON()     (g_threadMode != LEAK_TRACKER_THREADS_SINGLE)
+#define BATCHING_ON()    (g_threadMode == LEAK_TRACKER_THREADS_BATCHED)
+#define LOCK_SHARD(s)    do { if (LOCKING_ON()) pthread_mutex_lock(&(s)->lock); } while (0)
+#define UNLOCK_SHARD(s)  do { if (LOCKING_ON()) pthread_mutex_unlock(&(s)->lock); } while (0)
+#define LOCK_DEPOT()     do { if (LOCKING_ON()) pthread_mutex_lock(&g_depotMutex); } while (0)
+#define UNLOCK_DEPOT()   do { if (LOCKING_ON()) pthread_mutex_unlock(&g_depotMutex); } while (0)
+#define LOCK_CACHE(t)    do { if (LOCKING_ON()) pthread_mutex_lock(&(t)->cacheLock); } while (0)
+#define UNLOCK_CACHE(t)  do { if (LOCKING_ON()) pthread_mutex_unlock(&(t)->cacheLock); } while (0)
+#define LOCK_SITES()     do { if (LOCKING_ON()) pthread_mutex_lock(&g_siteMutex); } while (0)
+#define UNLOCK_SITES()   do { if (LOCKING_ON()) pthread_mutex_unlock(&g_siteMutex); } while (0)
+#define LOCK_STACKS()    do { if (LOCKING_ON()) pthread_mutex_lock(&g_stackMutex); } while (0)
+#define UNLOCK_STACKS()  do { if (LOCKING_ON()) pthread_mutex_unlock(&g_stackMutex); } while (0)
+#define LOCK_PAGES()     do { if (LOCKING_ON()) pthread_mutex_lock(&g_pageMutex); } while (0)
+#define UNLOCK_PAGES()   do { if (LOCKING_ON()) pthread_mutex_unlock(&g_pageMutex); } while (0)
+#define LOCK_EPOCH(e)    do { if (LOCKING_ON()) pthread_mutex_lock(&(e)->lock); } while (0)
+#define UNLOCK_EPOCH(e)  do { if (LOCKING_ON()) pthread_mutex_unlock(&(e)->lock); } while (0)
+#define LOCK_TRACE()     do { if (LOCKING_ON()) pthread_mutex_lock(&g_traceMutex); } while (0)
+#define UNLOCK_TRACE()   do { if (LOCKING_ON()) pthread_mutex_unlock(&g_traceMutex); } while (0)
+#define FOLD_BYTES()     (LOCKING_ON() ? STATS_FOLD_BYTES : 0)
 #else
-#define LOCK_TRACKER()   ((void)0)
-#define UNLOCK_TRACKER() ((void)0)
+static ThreadState  g_localState;
+static ThreadState *g_threads = &g_localState;
+#define BATCHING_ON()    0
+#define LOCK_SHARD(s)    ((void)(s))
+#define UNLOCK_SHARD(s)  ((void)(s))
+#define LOCK_DEPOT()     ((void)0)
+#define UNLOCK_DEPOT()   ((void)0)
+#define LOCK_SITES()     ((void)0)
+#define UNLOCK_SITES()   ((void)0)
+#define LOCK_STACKS()    ((void)0)
+#define UNLOCK_STACKS()  ((void)0)
+#define LOCK_PAGES()     ((void)0)
+#define UNLOCK_PAGES()   ((void)0)
+#define LOCK_EPOCH(e)    ((void)(e))
+#define UNLOCK_EPOCH(e)  ((void)(e))
+#define LOCK_TRACE()     ((void)0)
+#define UNLOCK_TRACE()   ((void)0)
+#define FOLD_BYTES()     STATS_FOLD_BYTES
 #endif
 
+/* Relaxed counter helpers: single-writer add, and read */
+#define COUNTER_GET(c)    atomic_load_explicit(&(c), memory_order_relaxed)
+#define COUNTER_ADD(c, d) atomic_store_explicit(&(c), COUNTER_GET(c) + (d), memory_order_relaxed)
+
 /* ========== Internal Helpers ========== */
 
-/* Add Freed record for double-free detection */
-static void add_to_freed(void *ptr) {
-    Freed *node = (Freed*)malloc(sizeof(Freed));
-    if (!node) return;
-    node->ptr = ptr;
-    node->next = g_freed;
-    g_freed = node;
+/*
+ * Tracker-owned memory, counted in MemStats.trackerOverhead. The counter
+ * belongs to whatever lock the caller holds (a shard's or the depot's).
+ */
+static void* tracker_alloc(_Atomic size_t *counter, size_t bytes) {
+    void *p = malloc(bytes);
+    if (p) COUNTER_ADD(*counter, bytes);
+    return p;
 }
 
-static int was_pointer_freed(void *ptr) {
-    Freed *cur = g_freed;
-    while (cur) {
-        if (cur->ptr == ptr) return 1; /* double-free */
-        cur = cur->next;
-    }
-    return 0;
+static void* tracker_calloc(_Atomic size_t *counter, size_t count, size_t size) {
+    void *p = calloc(count, size);
+    if (p) COUNTER_ADD(*counter, count * size);
+    return p;
 }
 
-/* Remove a pointer from Freed list if present */
-static void remove_from_freed(void *ptr) {
-    Freed **pp = &g_freed;
-    while (*pp) {
-        Freed *cur = *pp;
-        if (cur->ptr == ptr) {
-            *pp = cur->next;
-            free(cur);
-            return;
-        }
-        pp = &cur->next;
-    }
+static void tracker_free(_Atomic size_t *counter, void *p, size_t bytes) {
+    if (!p) return;
+    COUNTER_ADD(*counter, (size_t)0 - bytes);
+    free(p);
 }
 
-/* Find an allocation record by user pointer */
-static Allocation* find_allocation(void *userPtr, Allocation **prevOut) {
-    Allocation *prev = NULL;
-    Allocation *cur  = g_allocations;
-    while (cur) {
-        if (cur->userPtr == userPtr) {
-            if (prevOut) *prevOut = prev;
-            return cur;
-        }
-        prev = cur;
-        cur = cur->next;
-    }
-    return NULL;
+static void* rec_real(const Allocation *a) {
+    return (unsigned char*)a->userPtr - a->front;
 }
 
-/* Write sentinel bytes at the front and back of allocated region */
-static void write_sentinels(unsigned char *base, size_t userSize) {
-    /* front sentinel: base[0..SENTINEL_SIZE-1] */
-    memcpy(base, SENTINEL_PATTERN, SENTINEL_SIZE);
-    /* back sentinel: base[SENTINEL_SIZE+userSize .. SENTINEL_SIZE+userSize+SENTINEL_SIZE-1] */
-    memcpy(base + SENTINEL_SIZE + userSize, SENTINEL_PATTERN, SENTINEL_SIZE);
+static size_t rec_align(const Allocation *a) {
+    return (size_t)1 << a->alignShift;
 }
 
-/* Check sentinel bytes in debug_free; log if corrupted */
-static int check_sentinels(const Allocation *alloc) {
-    unsigned char *base = (unsigned char*)alloc->realPtr;
-    size_t userSize     = alloc->requestedSize;
-    /* Front check */
-    if (memcmp(base, SENTINEL_PATTERN, SENTINEL_SIZE) != 0) {
-        fprintf(stderr, 
-            "ERROR: Front sentinel corrupted for pointer %p (allocated at %s:%d)\n",
-            alloc->userPtr, alloc->file, alloc->line);
-        return 0;
-    }
-    /* Back check */
-    if (memcmp(base + SENTINEL_SIZE + userSize, SENTINEL_PATTERN, SENTINEL_SIZE) != 0) {
-        fprintf(stderr, 
-            "ERROR: Back sentinel corrupted for pointer %p (allocated at %s:%d)\n",
-            alloc->userPtr, alloc->file, alloc->line);
-        return 0;
-    }
-    return 1; /* OK */
+static size_t rec_guard(const Allocation *a) {
+    return ((size_t)a->guardUnits + 1) * SENTINEL_SIZE;
 }
 
-/* ========== Public Functions ========== */
+static size_t rec_pages(const Allocation *a) {
+    return a->extra ? a->extra->pages : 0;
+}
 
-void* debug_malloc(size_t size, const char *file, int line) {
-    /* Minimal check for 0-size. Some code does malloc(0). */
-    if (size == 0) size = 1;
+static double rec_weight(const Allocation *a) {
+    return a->extra ? a->extra->sampleWeight : 0.0;
+}
 
-    /* We allocate extra space for front+back sentinels. */
-    size_t totalSize = size + (2 * SENTINEL_SIZE);
-    /* Real memory from the system */
-    void *realPtr = malloc(totalSize);
-    if (!realPtr) return NULL; /* out of memory */
+static unsigned rec_stack(const Allocation *a) {
+    return a->extra ? a->extra->stack : 0;
+}
 
-    remove_from_freed(realPtr);
-    
-    LOCK_TRACKER();
+/* Hash a pointer into a table index (low bits are mostly alignment zeros) */
+static size_t hash_pointer(const void *ptr) {
+    unsigned long long h = (unsigned long long)(size_t)ptr;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
 
-    Allocation *node = (Allocation*)malloc(sizeof(Allocation));
-    if (!node) {
-        free(realPtr);
-        UNLOCK_TRACKER();
-        return NULL;
-    }
-    /* Write sentinel patterns */
-    write_sentinels((unsigned char*)realPtr, size);
+/* Shards are picked from the top hash byte; tables index with the low bits. */
+static size_t shard_index(const void *ptr) {
+    return (hash_pointer(ptr) >> (sizeof(size_t) * 8 - 8)) & (SHARD_COUNT - 1);
+}
 
-    /* userPtr is after the front sentinel */
-    void *userPtr = (unsigned char*)realPtr + SENTINEL_SIZE;
+static Shard* shard_for(const void *ptr) {
+    return &g_shards[shard_index(ptr)];
+}
 
-    /* Fill out allocation info */
-    node->realPtr       = realPtr;
-    node->userPtr       = userPtr;
-    node->requestedSize = size;
-    node->totalSize     = totalSize;
-    node->file          = file;
-    node->line          = line;
+/* ---- Thread state ---- */
 
-    /* Insert into linked list */
-    node->next = g_allocations;
-    g_allocations = node;
+static void flush_thread_cache(ThreadState *ts);
 
-    /* Update stats */
-    g_allocationCount++;
-    g_currentAllocated += size;
-    g_totalAllocated   += size;
-    if (g_currentAllocated > g_peakAllocated) {
-        g_peakAllocated = g_currentAllocated;
-    }
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+/* Thread exit: publish what is pending, then hand the slot to a future thread */
+static void fold_current(size_t bytesDelta);
 
-    UNLOCK_TRACKER();
-    return userPtr;
+static void release_thread_state(void *arg) {
+    ThreadState *ts = (ThreadState*)arg;
+    flush_thread_cache(ts);
+    /* Budgets only see the folded total: don't leave our share behind. */
+    size_t unfolded = COUNTER_GET(ts->unfoldedBytes);
+    if (unfolded) {
+        atomic_store_explicit(&ts->unfoldedBytes, 0, memory_order_relaxed);
+        fold_current(unfolded);
+    }
+    ts->epoch = 0;
+    t_state = NULL;
+    atomic_store_explicit(&ts->inUse, 0, memory_order_release);
 }
 
-void* debug_calloc(size_t count, size_t size, const char *file, int line) {
-    /* Check for overflow in multiplication: count * size */
-    if (count && size > (size_t)(-1) / count) {
-        fprintf(stderr, "ERROR: calloc overflow in multiplication at %s:%d\n", file, line);
-        return NULL;
+static void clock_init(void);
+
+static void init_tracker(void) {
+    clock_init();
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        pthread_mutex_init(&g_shards[i].lock, NULL);
     }
-    size_t total = count * size;
-    void *ptr = debug_malloc(total, file, line); /* relies on debug_malloc's boundary checks */
-    if (ptr) {
-        memset(ptr, 0, total);
+    for (size_t i = 0; i < EPOCH_MAX; i++) {
+        pthread_mutex_init(&g_epochs[i].lock, NULL);
     }
-    return ptr;
+    pthread_key_create(&g_stateKey, release_thread_state);
 }
 
-void* debug_realloc(void *oldPtr, size_t newSize, const char *file, int line) {
-    /* If oldPtr is NULL, this is basically malloc. */
-    if (!oldPtr) {
-        return debug_malloc(newSize, file, line);
+#define ENSURE_INIT() pthread_once(&g_initOnce, init_tracker)
+
+/* This thread's state: reuse a released slot or publish a new one */
+static ThreadState* thread_state(void) {
+    if (t_state) return t_state;
+    ThreadState *ts = atomic_load_explicit(&g_threads, memory_order_acquire);
+    for (; ts; ts = ts->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&ts->inUse, &expected, 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
     }
-    /* If newSize == 0, this is basically free. */
-    if (newSize == 0) {
-        debug_free(oldPtr, file, line);
-        return NULL;
+    if (!ts) {
+        ts = (ThreadState*)calloc(1, sizeof(ThreadState));
+        if (!ts) return NULL;
+        pthread_mutex_init(&ts->cacheLock, NULL);
+        atomic_init(&ts->inUse, 1);
+        ts->next = atomic_load_explicit(&g_threads, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&g_threads, &ts->next, ts,
+                   memory_order_release, memory_order_relaxed)) {
+        }
     }
+    ts->thread = pthread_self();
+    pthread_setspecific(g_stateKey, ts);
+    t_state = ts;
+    return ts;
+}
+#else
+static void clock_init(void);
+#define ENSURE_INIT() do { if (!g_clockStartNs) clock_init(); } while (0)
 
-    LOCK_TRACKER();
-    Allocation *prev = NULL;
-    Allocation *cur  = find_allocation(oldPtr, &prev);
-    if (!cur) {
-        /* Not an allocation we know about -> real realloc fallback. */
-        fprintf(stderr, 
-                "Warning: Attempt to realloc unknown pointer %p at %s:%d\n",
-                oldPtr, file, line);
-        UNLOCK_TRACKER();
-        return realloc(oldPtr, newSize);
-    }
+static ThreadState* thread_state(void) {
+    return &g_localState;
+}
+#endif
 
-    /* Check old sentinels before real realloc. */
-    check_sentinels(cur);
+/* Raise the peak to cur if it is higher */
+static void raise_peak(size_t cur) {
+    /*
+     * The folded value alone can dip below zero while other threads hold
+     * unfolded allocations; never take such a wrapped value as a peak.
+     */
+    if ((ptrdiff_t)cur <= 0) return;
+    size_t peak = atomic_load_explicit(&g_peakAllocated, memory_order_relaxed);
+    while (cur > peak &&
+           !atomic_compare_exchange_weak_explicit(&g_peakAllocated, &peak, cur,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
 
-    /* Store the old requested size BEFORE we overwrite it. */
-    size_t oldSize = cur->requestedSize;
+/* Add to the shared in-use counter and raise the peak if we passed it */
+static void fold_current(size_t bytesDelta) {
+    raise_peak(atomic_fetch_add_explicit(&g_currentAllocated, bytesDelta,
+                                         memory_order_relaxed) + bytesDelta);
+}
 
-    /* Perform real realloc with newSize + 2*SENTINEL_SIZE. */
-    size_t newTotalSize = newSize + 2 * SENTINEL_SIZE;
-    void *newRealPtr    = realloc(cur->realPtr, newTotalSize);
-    if (!newRealPtr) {
-        /* If real realloc fails, old pointer remains valid. */
-        UNLOCK_TRACKER();
-        return NULL;
+/*
+ * Account an allocation event on the calling thread. Deltas are unsigned
+ * and wrap, so (size_t)-n subtracts n.
+ */
+static void stats_update(size_t bytesDelta, size_t countDelta, size_t totalDelta) {
+    ThreadState *ts = thread_state();
+    if (!ts) {
+        /* Couldn't get a slot for this thread: account directly. */
+        atomic_fetch_add_explicit(&g_totalAllocated, totalDelta, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_allocationCount, countDelta, memory_order_relaxed);
+        fold_current(bytesDelta);
+        return;
+    }
+    COUNTER_ADD(ts->totalAllocated, totalDelta);
+    COUNTER_ADD(ts->allocationCount, countDelta);
+    size_t unfolded = COUNTER_GET(ts->unfoldedBytes) + bytesDelta;
+    if (unfolded > FOLD_BYTES() && -unfolded > FOLD_BYTES()) {
+        atomic_store_explicit(&ts->unfoldedBytes, 0, memory_order_relaxed);
+        fold_current(unfolded);
+    } else {
+        atomic_store_explicit(&ts->unfoldedBytes, unfolded, memory_order_relaxed);
+        /*
+         * Also check the peak against the folded total plus our own share:
+         * two plain loads normally, exact for a single allocating thread.
+         */
+        if ((ptrdiff_t)bytesDelta > 0) {
+            size_t cur = COUNTER_GET(g_currentAllocated) + unfolded;
+            if (cur > COUNTER_GET(g_peakAllocated)) raise_peak(cur);
+        }
     }
+}
 
-    /* Update allocation record. */
-    cur->realPtr       = newRealPtr;
-    cur->userPtr       = (unsigned char*)newRealPtr + SENTINEL_SIZE;
-    cur->totalSize     = newTotalSize;
-    cur->requestedSize = newSize;  /* Now we overwrite with new size. */
+/* Sum of the sampling estimate counters: extra bytes, extra blocks (16.16), variance */
+static void collect_estimates(unsigned long long est[3]) {
+    est[0] = COUNTER_GET(g_estExtraBytes);
+    est[1] = COUNTER_GET(g_estExtraBlocks);
+    est[2] = COUNTER_GET(g_estVariance);
+    for (ThreadState *ts = g_threads; ts; ts = ts->next) {
+        est[0] += COUNTER_GET(ts->estExtraBytes);
+        est[1] += COUNTER_GET(ts->estExtraBlocks);
+        est[2] += COUNTER_GET(ts->estVariance);
+    }
+}
 
-    /* Rewrite sentinels in front/back. */
-    write_sentinels((unsigned char*)cur->realPtr, newSize);
+static unsigned long long isqrt(unsigned long long v);
 
-    /*
-     * Correctly update usage stats:
-     *   1) Subtract the old requested size
-     *   2) Add the new size
-     */
-    g_currentAllocated -= oldSize;   
-    g_currentAllocated += newSize;
+/* Sum the shared counters and every thread slot; takes no lock */
+static void collect_stats(MemStats *st) {
+    st->totalAllocated   = COUNTER_GET(g_totalAllocated);
+    st->allocationCount  = COUNTER_GET(g_allocationCount);
+    st->currentAllocated = COUNTER_GET(g_currentAllocated);
+    st->peakAllocated    = COUNTER_GET(g_peakAllocated);
+    for (ThreadState *ts = g_threads; ts; ts = ts->next) {
+        st->totalAllocated   += COUNTER_GET(ts->totalAllocated);
+        st->allocationCount  += COUNTER_GET(ts->allocationCount);
+        st->currentAllocated += COUNTER_GET(ts->unfoldedBytes);
+    }
+    if ((ptrdiff_t)st->currentAllocated < 0) {
+        st->currentAllocated = 0; /* a fold raced with the walk */
+    }
+    if (st->currentAllocated > st->peakAllocated) {
+        st->peakAllocated = st->currentAllocated;
+    }
 
-    /* Update cumulative total if we expanded. */
-    if (newSize > oldSize) {
-        g_totalAllocated += (newSize - oldSize);
+    st->trackerOverhead = COUNTER_GET(g_depotBytes);
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        st->trackerOverhead += COUNTER_GET(g_shards[i].trackerBytes);
     }
 
-    /* Possibly update peak. */
-    if (g_currentAllocated > g_peakAllocated) {
-        g_peakAllocated = g_currentAllocated;
+    /* Exact per site, while currentAllocated may lag a little behind. */
+    st->overheadBytes = 0;
+    st->slackBytes    = 0;
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        st->overheadBytes += atomic_load_explicit(&g_siteStats[i].liveOverhead, memory_order_relaxed);
+        st->slackBytes    += atomic_load_explicit(&g_siteStats[i].liveSlack, memory_order_relaxed);
     }
+    if ((ptrdiff_t)st->overheadBytes < 0) st->overheadBytes = 0; /* resizes in flight */
+    if ((ptrdiff_t)st->slackBytes < 0)    st->slackBytes    = 0;
+    st->usableBytes = st->currentAllocated + st->overheadBytes + st->slackBytes;
 
-    UNLOCK_TRACKER();
-    return cur->userPtr;
+    /* Scale up by the sampled blocks' weights (no-op without sampling). */
+    unsigned long long est[3];
+    collect_estimates(est);
+    if ((long long)est[0] < 0) est[0] = 0; /* racing updates from other threads */
+    if ((long long)est[1] < 0) est[1] = 0;
+    if ((long long)est[2] < 0) est[2] = 0;
+    st->sampleInterval  = g_sampleInterval;
+    st->estimatedBytes  = st->currentAllocated + (size_t)est[0];
+    st->estimatedBlocks = st->allocationCount + (size_t)((est[1] + 32768) >> 16);
+    st->estimatedError  = (size_t)(2 * isqrt(est[2]));
 }
 
-void debug_free(void *ptr, const char *file, int line) {
-    if (!ptr) return; /* free(NULL) no-op */
-
-    LOCK_TRACKER();
+/* ---- Diagnostics ---- */
 
-    /* Double-free check */
-    if (was_pointer_freed(ptr)) {
-        fprintf(stderr, 
-                "ERROR: Double free detected for pointer %p at %s:%d\n",
-                ptr, file, line);
-        UNLOCK_TRACKER();
-        return;
+/* Find or claim the rate-limit slot of a site; NULL if the table is full */
+static DiagSite* diag_site(int type, const char *file, int line) {
+    size_t mask = DIAG_SITE_COUNT - 1;
+    size_t i    = (hash_pointer(file) + (size_t)line * 31 + (size_t)type) & mask;
+    for (size_t n = 0; n < DIAG_SITE_COUNT; n++, i = (i + 1) & mask) {
+        DiagSite *site = &g_diagSites[i];
+        int state = atomic_load_explicit(&site->state, memory_order_acquire);
+        if (state == 0) {
+            if (atomic_compare_exchange_strong_explicit(&site->state, &state, 1,
+                    memory_order_acquire, memory_order_acquire)) {
+                site->file = file;
+                site->line = line;
+                site->type = type;
+                atomic_store_explicit(&site->state, 2, memory_order_release);
+                return site;
+            }
+        }
+        /* A slot being claimed right now is skipped rather than waited for. */
+        if (state == 2 && site->file == file && site->line == line && site->type == type) {
+            return site;
+        }
     }
+    return NULL;
+}
 
-    Allocation *prev = NULL;
-    Allocation *cur  = find_allocation(ptr, &prev);
-    if (!cur) {
-        /* Unknown pointer -> free it anyway, but can't track stats. */
-        fprintf(stderr, 
-                "Warning: Attempt to free unknown pointer %p at %s:%d\n",
-                ptr, file, line);
-        free(ptr);
-        UNLOCK_TRACKER();
+/* Queue a diagnostic event. Never blocks; drops the event if the ring is full. */
+static void diag_report(int type, const void *ptr, const char *file, int line) {
+    DiagSite *site = diag_site(type, file, line);
+    if (site && atomic_fetch_add_explicit(&site->emitted, 1, memory_order_relaxed) >= DIAG_SITE_BURST) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
         return;
     }
 
-    /* Check if sentinels are intact. */
-    check_sentinels(cur);
-
-    /* Remove from active list */
-    if (!prev) {
-        g_allocations = cur->next;
-    } else {
-        prev->next = cur->next;
+    size_t pos = atomic_load_explicit(&g_diagHead, memory_order_relaxed);
+    for (;;) {
+        size_t     idx  = pos & (DIAG_RING_SIZE - 1);
+        DiagEvent *e    = &g_diagRing[idx];
+        size_t     seq  = atomic_load_explicit(&e->seq, memory_order_acquire) + idx;
+        ptrdiff_t  diff = (ptrdiff_t)(seq - pos);
+        if (diff == 0) {
+            /* Slot is free for this lap: try to claim position pos. */
+            if (atomic_compare_exchange_weak_explicit(&g_diagHead, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                e->ptr  = ptr;
+                e->file = file;
+                e->line = line;
+                e->type = type;
+                atomic_store_explicit(&e->seq, pos + 1 - idx, memory_order_release);
+                return;
+            }
+        } else if (diff < 0) {
+            /* Not yet consumed from the previous lap: the ring is full. */
+            atomic_fetch_add_explicit(&g_diagDropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&g_diagHead, memory_order_relaxed);
+        }
     }
+}
 
-    /* Update usage stats. */
-    g_allocationCount--;
-    g_currentAllocated -= cur->requestedSize;
-
-    /* Mark pointer as freed to detect double-frees. */
-    add_to_freed(ptr);
-
-    /* Free the metadata and the real pointer. */
-    free(cur->realPtr);
-    free(cur);
+static const char *const DIAG_NAMES[DIAG_TYPE_COUNT] = {
+    "double free",
+    "free of unknown pointer",
+    "realloc of unknown pointer",
+    "front sentinel",
+    "back sentinel",
+    "corrupted header",
+    "untracked by realloc",
+    "no longer tracked",
+    "calloc overflow",
+    "mismatched free",
+    "wrong size in sized delete",
+    "process budget",
+    "site budget",
+    "realloc of freed pointer",
+};
 
-    UNLOCK_TRACKER();
+/* Format one event the way the allocator used to print it */
+static void diag_print(FILE *out, const DiagEvent *e) {
+    switch (e->type) {
+    case DIAG_DOUBLE_FREE:
+        fprintf(out, "ERROR: Double free detected for pointer %p at %s:%d\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_FREE_UNKNOWN:
+        fprintf(out, "Warning: Attempt to free unknown pointer %p at %s:%d\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_REALLOC_UNKNOWN:
+        fprintf(out, "Warning: Attempt to realloc unknown pointer %p at %s:%d\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_FRONT_SENTINEL:
+        fprintf(out, "ERROR: Front sentinel corrupted for pointer %p (allocated at %s:%d)\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_BACK_SENTINEL:
+        fprintf(out, "ERROR: Back sentinel corrupted for pointer %p (allocated at %s:%d)\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_HEADER_CORRUPT:
+        fprintf(out, "ERROR: Allocation header corrupted for pointer %p\n", e->ptr);
+        break;
+    case DIAG_REALLOC_UNTRACKED:
+        fprintf(out, "ERROR: Tracker out of memory, realloc at %s:%d returns %p untracked\n",
+                e->file, e->line, e->ptr);
+        break;
+    case DIAG_UNTRACKED:
+        fprintf(out, "ERROR: Tracker out of memory, block %p is no longer tracked\n", e->ptr);
+        break;
+    case DIAG_CALLOC_OVERFLOW:
+        fprintf(out, "ERROR: calloc overflow in multiplication at %s:%d\n", e->file, e->line);
+        break;
+    case DIAG_MISMATCHED_FREE:
+        fprintf(out, "ERROR: Mismatched free/delete/delete[] (or realloc) of pointer %p at %s:%d\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_SIZE_MISMATCH:
+        fprintf(out, "ERROR: Sized delete of pointer %p at %s:%d passed the wrong size\n",
+                e->ptr, e->file, e->line);
+        break;
+    case DIAG_PROCESS_BUDGET:
+        fprintf(out, "ERROR: Process memory budget exceeded, allocation at %s:%d failed\n",
+                e->file, e->line);
+        break;
+    case DIAG_SITE_BUDGET:
+        fprintf(out, "ERROR: Memory budget of site %s:%d exceeded, allocation failed\n",
+                e->file, e->line);
+        break;
+    case DIAG_REALLOC_FREED:
+        fprintf(out, "ERROR: Realloc of freed pointer %p at %s:%d\n", e->ptr, e->file, e->line);
+        break;
+    }
 }
 
-void log_memory_leaks(FILE *out) {
-    LOCK_TRACKER();
-    if (!g_allocations) {
-        fprintf(out, "\n==== Memory Leak Check ====\nNo memory leaks detected.\n");
-        UNLOCK_TRACKER();
-        return;
+/* Write out everything queued so far (single consumer). Returns events written. */
+static size_t diag_drain(FILE *out) {
+    size_t written = 0;
+    for (;;) {
+        size_t     idx = g_diagTail & (DIAG_RING_SIZE - 1);
+        DiagEvent *e   = &g_diagRing[idx];
+        size_t     seq = atomic_load_explicit(&e->seq, memory_order_acquire) + idx;
+        if (seq != g_diagTail + 1) break; /* empty */
+        diag_print(out, e);
+        /* Hand the slot back to producers for the next lap. */
+        atomic_store_explicit(&e->seq, g_diagTail + DIAG_RING_SIZE - idx, memory_order_release);
+        g_diagTail++;
+        written++;
     }
-    fprintf(out, "\n==== Memory Leak Check ====\nPotential leaks:\n");
-    fprintf(out, "----------------------------------------------------\n");
-    fprintf(out, "  Pointer            Size     Location\n");
-    fprintf(out, "----------------------------------------------------\n");
 
-    Allocation *cur = g_allocations;
-    while (cur) {
-        fprintf(out, 
-            "  %p   %6zu   %s:%d\n",
-            cur->userPtr, cur->requestedSize, cur->file, cur->line);
-        cur = cur->next;
+    /* Summarise rate-limited sites and re-arm them. */
+    for (size_t i = 0; i < DIAG_SITE_COUNT; i++) {
+        DiagSite *site = &g_diagSites[i];
+        if (atomic_load_explicit(&site->state, memory_order_acquire) != 2) continue;
+        size_t n = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+        if (n) {
+            fprintf(out, "Note: %zu more '%s' reports at %s:%d suppressed\n",
+                    n, DIAG_NAMES[site->type], site->file ? site->file : "?", site->line);
+            written++;
+        }
+        atomic_store_explicit(&site->emitted, 0, memory_order_relaxed);
+    }
+    size_t dropped = atomic_exchange_explicit(&g_diagDropped, 0, memory_order_relaxed);
+    if (dropped) {
+        fprintf(out, "Note: %zu diagnostic reports dropped (queue full)\n", dropped);
+        written++;
     }
-    UNLOCK_TRACKER();
+    if (written) fflush(out);
+    return written;
 }
 
-void log_memory_stats(FILE *out) {
-    LOCK_TRACKER();
-    fprintf(out, "\n==== Memory Statistics ====\n");
-    fprintf(out, "  Current In-Use:  %zu bytes\n", g_currentAllocated);
-    fprintf(out, "  Total Allocated: %zu bytes (cumulative)\n", g_totalAllocated);
-    fprintf(out, "  Peak In-Use:     %zu bytes\n", g_peakAllocated);
-    fprintf(out, "  Active Blocks:   %zu\n", g_allocationCount);
-    UNLOCK_TRACKER();
+/* ---- Call sites ---- */
+
+static size_t site_slot_hash(const char *file, int line) {
+    return hash_pointer(file) + (size_t)line * 0x9E3779B9u;
 }
 
-void get_memory_stats(MemStats *statsOut) {
-    if (!statsOut) return;
-    LOCK_TRACKER();
-    statsOut->currentAllocated = g_currentAllocated;
-    statsOut->totalAllocated   = g_totalAllocated;
-    statsOut->peakAllocated    = g_peakAllocated;
-    statsOut->allocationCount  = g_allocationCount;
-    UNLOCK_TRACKER();
+static size_t site_name_hash(const char *file, int line) {
+    size_t h = 5381;
+    for (const char *c = file; *c; c++) {
+        h = h * 33 + (unsigned char)*c;
+    }
+    return hash_pointer((const void*)(h + (size_t)line * 0x9E3779B9u));
 }
 
-void free_all_tracked(void) {
-    LOCK_TRACKER();
-    /* Free everything in the allocation list */
-    Allocation *cur = g_allocations;
-    while (cur) {
-        Allocation *next = cur->next;
-        free(cur->realPtr);
-        free(cur);
-        cur = next;
-    }
-    g_allocations = NULL;
-    g_allocationCount  = 0;
-    g_currentAllocated = 0;
-    /* Freed list can be cleared as well */
-    Freed *fc = g_freed;
-    while (fc) {
-        Freed *fn = fc->next;
-        free(fc);
-        fc = fn;
-    }
-    g_freed = NULL;
-    UNLOCK_TRACKER();
+/* Slow path of site_index: intern (file, line) under g_siteMutex */
+static unsigned site_intern(const char *file, int line) {
+    size_t mask = SITE_SLOTS - 1;
+    unsigned site = 0;
+    LOCK_SITES();
+
+    /* Someone may have added it meanwhile; otherwise stop at the free slot. */
+    size_t i = site_slot_hash(file, line) & mask;
+    size_t probes = 0;
+    for (; probes < SITE_SLOTS; probes++, i = (i + 1) & mask) {
+        SiteSlot *slot = &g_siteSlots[i];
+        if (!atomic_load_explicit(&slot->ready, memory_order_relaxed)) break;
+        if (slot->file == file && slot->line == line) {
+            site = slot->site;
+            UNLOCK_SITES();
+            return site;
+        }
+    }
+    if (probes == SITE_SLOTS) {
+        UNLOCK_SITES();
+        return 0;
+    }
+
+    /* Same file name through another pointer (e.g. a header in several files)? */
+    size_t n = site_name_hash(file, line) & mask;
+    while (g_siteByName[n]) {
+        SiteStats *st = &g_siteStats[g_siteByName[n] - 1];
+        if (st->line == line && strcmp(st->file, file) == 0) {
+            site = g_siteByName[n] - 1;
+            break;
+        }
+        n = (n + 1) & mask;
+    }
+    if (!g_siteByName[n]) {
+        unsigned count = atomic_load_explicit(&g_siteCount, memory_order_relaxed);
+        if (count < SITE_MAX) {
+            site = count;
+            g_siteStats[site].file = file;
+            g_siteStats[site].line = line;
+            g_siteByName[n] = site + 1;
+            atomic_store_explicit(&g_siteCount, count + 1, memory_order_release);
+        }
+    }
+
+    g_siteSlots[i].file = file;
+    g_siteSlots[i].line = line;
+    g_siteSlots[i].site = site;
+    atomic_store_explicit(&g_siteSlots[i].ready, 1, memory_order_release);
+    UNLOCK_SITES();
+    return site;
+}
+
+/* Site of a (file, line) pair; lock-free once the pair has been seen */
+static unsigned site_index(const char *file, int line) {
+    if (!file) return 0;
+    size_t mask = SITE_SLOTS - 1;
+    size_t i    = site_slot_hash(file, line) & mask;
+    for (;;) {
+        SiteSlot *slot = &g_siteSlots[i];
+        if (!atomic_load_explicit(&slot->ready, memory_order_acquire)) break;
+        if (slot->file == file && slot->line == line) return slot->site;
+        i = (i + 1) & mask;
+    }
+    return site_intern(file, line);
+}
+
+/*
+ * Site of a macro call site's static descriptor, registered on first use.
+ * Racing first calls store the same id. (The id is a plain unsigned in the
+ * public header, accessed atomically here.)
+ */
+static unsigned site_of(LeakTrackerSite *desc) {
+    atomic_uint *id = (atomic_uint*)&desc->id;
+    unsigned v = atomic_load_explicit(id, memory_order_relaxed);
+    if (!v) {
+        v = site_index(desc->file, desc->line) + 1;
+        atomic_store_explicit(id, v, memory_order_relaxed);
+    }
+    return v - 1;
+}
+
+/* Add to a site's live bytes and raise its peak */
+static void site_grow(SiteStats *st, size_t bytes) {
+    size_t live = atomic_fetch_add_explicit(&st->liveBytes, bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&st->peakBytes, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&st->peakBytes, &peak, live,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static size_t block_size(size_t size, size_t align, size_t guard);
+
+/*
+ * What a live block costs beyond its requested bytes: 'overhead' is what
+ * the tracker adds (inline header, alignment padding, guard zones, the
+ * rest of a guard-page run), 'slack' what the system allocator rounds the
+ * real block up by (0 where it can't tell). Only valid while the real
+ * block is.
+ */
+static void rec_cost(const Allocation *a, size_t *overhead, size_t *slack) {
+    size_t pages = rec_pages(a);
+    if (pages) {
+        *overhead = (pages + 1) * g_pageSize - a->requestedSize;
+        *slack    = 0;
+        return;
+    }
+    size_t asked = block_size(a->requestedSize, rec_align(a), rec_guard(a));
+    *overhead = asked - a->requestedSize;
+#ifdef HAVE_USABLE_SIZE
+    size_t usable = system_usable_size(rec_real(a));
+    *slack = usable > asked ? usable - asked : 0;
+#else
+    *slack = 0;
+#endif
+}
+
+/* Account a new block at its site */
+static void site_alloc(const Allocation *a) {
+    SiteStats *st = &g_siteStats[a->site];
+    size_t overhead, slack;
+    rec_cost(a, &overhead, &slack);
+    atomic_fetch_add_explicit(&st->liveCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->totalCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->totalBytes, a->requestedSize, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->liveOverhead, overhead, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->liveSlack, slack, memory_order_relaxed);
+    site_grow(st, a->requestedSize);
+}
+
+/* Account a block going away (its real memory still valid) */
+static void site_free(const Allocation *a) {
+    SiteStats *st = &g_siteStats[a->site];
+    size_t overhead, slack;
+    rec_cost(a, &overhead, &slack);
+    atomic_fetch_sub_explicit(&st->liveCount, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&st->liveBytes, a->requestedSize, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&st->liveOverhead, overhead, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&st->liveSlack, slack, memory_order_relaxed);
+}
+
+/*
+ * A block of the site was resized from oldSize, which cost oldOverhead and
+ * oldSlack (rec_cost() before the resize); growth counts towards its total
+ * bytes
+ */
+static void site_resize(const Allocation *a, size_t oldSize, size_t oldOverhead, size_t oldSlack) {
+    SiteStats *st      = &g_siteStats[a->site];
+    size_t     newSize = a->requestedSize;
+    size_t overhead, slack;
+    rec_cost(a, &overhead, &slack);
+    if (newSize > oldSize) {
+        atomic_fetch_add_explicit(&st->totalBytes, newSize - oldSize, memory_order_relaxed);
+        site_grow(st, newSize - oldSize);
+    } else {
+        atomic_fetch_sub_explicit(&st->liveBytes, oldSize - newSize, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&st->liveOverhead, overhead - oldOverhead, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->liveSlack, slack - oldSlack, memory_order_relaxed);
+}
+
+/*
+ * A realloc at site resized cur from oldSize, moving it (and copying the
+ * data) unless the real block stayed at oldRealPtr
+ */
+static void site_realloc(unsigned site, Allocation *cur, size_t oldSize, const void *oldRealPtr) {
+    SiteStats *st      = &g_siteStats[site];
+    size_t     newSize = cur->requestedSize;
+    atomic_fetch_add_explicit(&st->reallocs, 1, memory_order_relaxed);
+    if (rec_real(cur) != oldRealPtr) {
+        atomic_fetch_add_explicit(&st->moves, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->bytesCopied, oldSize < newSize ? oldSize : newSize,
+                                  memory_order_relaxed);
+    }
+    if (newSize > oldSize) {
+        atomic_fetch_add_explicit(&st->grows, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->bytesGrown, newSize - oldSize, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->growthSum,
+                                  (unsigned long long)((double)newSize / (double)oldSize * 65536.0),
+                                  memory_order_relaxed);
+    }
+    /* The chain is counted in the record itself: no extra part for it. */
+    if (cur->reallocs < REC_CHAIN_MAX) cur->reallocs++;
+    unsigned chain   = cur->reallocs;
+    unsigned longest = atomic_load_explicit(&st->longestChain, memory_order_relaxed);
+    while (chain > longest &&
+           !atomic_compare_exchange_weak_explicit(&st->longestChain, &longest, chain,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/* ---- Budgets and failure injection ---- */
+
+static int policy_set(const SiteStats *st) {
+    return atomic_load_explicit(&st->budget, memory_order_relaxed) ||
+           atomic_load_explicit(&st->failEvery, memory_order_relaxed) ||
+           atomic_load_explicit(&st->failRate, memory_order_relaxed);
+}
+
+/* Whether the call counted in st fails; 'salt' keeps sites' streams apart */
+static int fail_drawn(SiteStats *st, unsigned long long salt) {
+    unsigned long long every = atomic_load_explicit(&st->failEvery, memory_order_relaxed);
+    unsigned           rate  = atomic_load_explicit(&st->failRate, memory_order_relaxed);
+    if (!every && !rate) return 0;
+    unsigned long long n = atomic_fetch_add_explicit(&st->failCalls, 1, memory_order_relaxed) + 1;
+    if (every && n % every == 0) return 1;
+    if (!rate) return 0;
+    unsigned long long h = atomic_load_explicit(&g_failSeed, memory_order_relaxed) ^ salt ^ n;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return (unsigned)(h >> 32) < rate;
+}
+
+/* 'live' + 'size' would pass 'budget': ask the handler, or fail and report */
+static int budget_refuses(unsigned site, size_t size, size_t live, size_t budget, int type) {
+    LeakBudgetHandler handler = atomic_load_explicit(&g_budgetHandler, memory_order_acquire);
+    void *ctx = atomic_load_explicit(&g_budgetCtx, memory_order_relaxed);
+    if (handler && handler(ctx, type == DIAG_SITE_BUDGET ? site : LEAK_TRACKER_ALL_SITES,
+                           size, live, budget)) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&g_overBudget, 1, memory_order_relaxed);
+    diag_report(type, NULL, g_siteStats[site].file, g_siteStats[site].line);
+    return 1;
+}
+
+/*
+ * Slow path once g_policyOn is set: may 'site' (the call site) add 'size'
+ * bytes to what 'owner' (the site whose block grows) holds? The process
+ * total is g_currentAllocated plus this thread's unfolded bytes, so it is
+ * exact for one thread and within STATS_FOLD_BYTES per other thread.
+ */
+static NEVER_INLINE int policy_refuses(unsigned site, unsigned owner, size_t size, ThreadState *ts) {
+    if (fail_drawn(&g_allSites, 0) ||
+        fail_drawn(&g_siteStats[site], (unsigned long long)(site + 1) << 40)) {
+        atomic_fetch_add_explicit(&g_injected, 1, memory_order_relaxed);
+        return 1;
+    }
+    if (!size) return 0;
+    size_t budget = atomic_load_explicit(&g_allSites.budget, memory_order_relaxed);
+    if (budget) {
+        size_t live = COUNTER_GET(g_currentAllocated) + (ts ? COUNTER_GET(ts->unfoldedBytes) : 0);
+        if ((ptrdiff_t)live < 0) live = 0;
+        if (live + size > budget && budget_refuses(site, size, live, budget, DIAG_PROCESS_BUDGET)) {
+            return 1;
+        }
+    }
+    SiteStats *st = &g_siteStats[owner];
+    budget = atomic_load_explicit(&st->budget, memory_order_relaxed);
+    if (budget) {
+        size_t live = atomic_load_explicit(&st->liveBytes, memory_order_relaxed);
+        if (live + size > budget && budget_refuses(owner, size, live, budget, DIAG_SITE_BUDGET)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define POLICY_REFUSES(site, owner, size, ts) \
+    (atomic_load_explicit(&g_policyOn, memory_order_relaxed) && \
+     policy_refuses((site), (owner), (size), (ts)))
+
+/* ---- Epochs ---- */
+
+static Epoch* epoch_slot(unsigned id) {
+    return &g_epochs[id & (EPOCH_MAX - 1)];
+}
+
+/* Link a record into epoch 'id' (if that epoch still owns its slot) */
+static void epoch_attach(Allocation *alloc, unsigned id) {
+    RecordExtra *x = alloc->extra; /* made by track_block() */
+    if (!x) return;
+    Epoch *e = epoch_slot(id);
+    LOCK_EPOCH(e);
+    if (e->id == id) {
+        x->epochPrev = NULL;
+        x->epochNext = e->head;
+        if (e->head) e->head->extra->epochPrev = alloc;
+        e->head = alloc;
+        e->liveCount++;
+        e->liveBytes += alloc->requestedSize;
+        atomic_store_explicit(&x->epoch, id, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&x->epoch, 0, memory_order_relaxed);
+    }
+    UNLOCK_EPOCH(e);
+}
+
+/* Unlink a record from its epoch; returns the epoch, 0 if it had none left */
+static unsigned epoch_detach(Allocation *alloc) {
+    RecordExtra *x = alloc->extra;
+    if (!x) return 0;
+    unsigned id = atomic_load_explicit(&x->epoch, memory_order_relaxed);
+    if (!id) return 0;
+    Epoch *e = epoch_slot(id);
+    LOCK_EPOCH(e);
+    /* The slot may have been reused, which already dropped the record. */
+    id = atomic_load_explicit(&x->epoch, memory_order_relaxed);
+    if (id && e->id == id) {
+        if (x->epochPrev) x->epochPrev->extra->epochNext = x->epochNext;
+        else              e->head = x->epochNext;
+        if (x->epochNext) x->epochNext->extra->epochPrev = x->epochPrev;
+        e->liveCount--;
+        e->liveBytes -= alloc->requestedSize;
+    } else {
+        id = 0;
+    }
+    atomic_store_explicit(&x->epoch, 0, memory_order_relaxed);
+    UNLOCK_EPOCH(e);
+    return id;
+}
+
+/* Empty a slot; the epoch lock must be held */
+static void epoch_clear(Epoch *e) {
+    for (Allocation *a = e->head; a; a = a->extra->epochNext) {
+        atomic_store_explicit(&a->extra->epoch, 0, memory_order_relaxed);
+    }
+    e->head      = NULL;
+    e->liveCount = 0;
+    e->liveBytes = 0;
+}
+
+/* ---- Call stacks ---- */
+
+static unsigned stack_hash(void *const *frames, unsigned depth) {
+    unsigned long long h = depth;
+    for (unsigned i = 0; i < depth; i++) {
+        h = (h ^ hash_pointer(frames[i])) * 0x100000001B3ull;
+    }
+    return (unsigned)(h ^ (h >> 32));
+}
+
+/* Id of the stack frames[0..depth), interning it if new; 0 when the table is full */
+static unsigned stack_intern(void *const *frames, unsigned depth) {
+    unsigned hash = stack_hash(frames, depth);
+    size_t   mask = STACK_SLOTS - 1;
+    size_t   i    = hash & mask;
+    int      locked = 0;
+    for (size_t probes = 0; probes < STACK_SLOTS; probes++, i = (i + 1) & mask) {
+        StackSlot *slot = &g_stackSlots[i];
+        unsigned id = atomic_load_explicit(&slot->id, memory_order_acquire);
+        if (!id) {
+            if (!locked) {
+                /* Take the lock, then look at this slot again. */
+                LOCK_STACKS();
+                locked = 1;
+                id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+            }
+            if (!id) {
+                if (g_stackCount == STACK_MAX ||
+                    g_stackFramesUsed + depth > STACK_FRAME_POOL) break;
+                id = g_stackCount++;
+                memcpy(&g_stackFrames[g_stackFramesUsed], frames, depth * sizeof(void*));
+                g_stackInfo[id].offset = g_stackFramesUsed;
+                g_stackInfo[id].depth  = depth;
+                g_stackFramesUsed += depth;
+                slot->hash   = hash;
+                slot->depth  = depth;
+                slot->offset = g_stackInfo[id].offset;
+                atomic_store_explicit(&slot->id, id, memory_order_release);
+                UNLOCK_STACKS();
+                return id;
+            }
+        }
+        if (slot->hash == hash && slot->depth == depth &&
+            memcmp(&g_stackFrames[slot->offset], frames, depth * sizeof(void*)) == 0) {
+            if (locked) UNLOCK_STACKS();
+            return id;
+        }
+    }
+    if (locked) UNLOCK_STACKS();
+    return 0;
+}
+
+/*
+ * Stack of the current call, minus the tracker's own frames (this one and
+ * the allocation entry point), hence never inlined.
+ */
+static NEVER_INLINE unsigned stack_capture(void) {
+#ifdef HAVE_BACKTRACE
+    void *frames[STACK_MAX_DEPTH + 2];
+    int n = backtrace(frames, g_stackDepth + 2);
+    return n > 2 ? stack_intern(frames + 2, (unsigned)(n - 2)) : 0;
+#else
+    return 0;
+#endif
+}
+
+/* Print stack id one frame per line, symbolising it on first use */
+static void stack_print(FILE *out, unsigned id) {
+    if (!id) return;
+    StackInfo *info = &g_stackInfo[id];
+    LOCK_STACKS();
+#ifdef HAVE_BACKTRACE
+    if (!info->symbols) {
+        info->symbols = backtrace_symbols(&g_stackFrames[info->offset], (int)info->depth);
+    }
+#endif
+    for (unsigned i = 0; i < info->depth; i++) {
+        if (info->symbols) {
+            fprintf(out, "        #%-2u %s\n", i, info->symbols[i]);
+        } else {
+            fprintf(out, "        #%-2u %p\n", i, g_stackFrames[info->offset + i]);
+        }
+    }
+    UNLOCK_STACKS();
+}
+
+/* ---- Histograms ---- */
+
+static unsigned long long now_ns(void) {
+    struct timespec t;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#else
+    timespec_get(&t, TIME_UTC);
+#endif
+    return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+}
+
+/* Cheap timestamp: the TSC where there is one, nanoseconds otherwise */
+static unsigned long long now_ticks(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void clock_init(void) {
+    g_clockStartTicks = now_ticks();
+    g_clockStartNs    = now_ns() | 1; /* non-zero: initialised */
+}
+
+/* Ticks per second, measured against the clock since init (0 if too early to tell) */
+static double ticks_per_second(void) {
+#ifdef HAVE_RDTSC
+    unsigned long long ns    = now_ns() - g_clockStartNs;
+    unsigned long long ticks = now_ticks() - g_clockStartTicks;
+    return ns < 1000000 ? 0.0 : (double)ticks * 1e9 / (double)ns;
+#else
+    return 1e9;
+#endif
+}
+
+static unsigned log2_floor(unsigned long long v) {
+#if defined(__GNUC__)
+    return 63u - (unsigned)__builtin_clzll(v);
+#else
+    unsigned e = 0;
+    while (v >>= 1) e++;
+    return e;
+#endif
+}
+
+/* Zero bits below the lowest set one (v != 0), e.g. log2 of an alignment */
+static unsigned trailing_zeros(unsigned long long v) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(v);
+#else
+    unsigned e = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        e++;
+    }
+    return e;
+#endif
+}
+
+/*
+ * HdrHistogram-style bins: values below 4 have a bin each, then every power
+ * of two is split into 4 equal sub-bins (at most 25% relative error).
+ */
+static unsigned hist_bin(unsigned long long v) {
+    if (v < (1u << HIST_SUB_BITS)) return (unsigned)v;
+    unsigned e   = log2_floor(v);
+    unsigned sub = (unsigned)(v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/* Smallest value falling in a bin */
+static unsigned long long hist_bin_low(unsigned bin) {
+    if (bin < (1u << HIST_SUB_BITS)) return bin;
+    unsigned e   = (bin >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned sub = bin & ((1u << HIST_SUB_BITS) - 1);
+    return (unsigned long long)((1u << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+}
+
+static void hist_add(ThreadState *ts, int kind, unsigned long long v) {
+    unsigned bin = hist_bin(v);
+    if (ts) {
+        COUNTER_ADD(ts->hist[kind][bin], 1);
+    } else {
+        atomic_fetch_add_explicit(&g_hist[kind][bin], 1, memory_order_relaxed);
+    }
+}
+
+/* ---- Quarantine ---- */
+
+/*
+ * With the sampling filter on, quarantined pointers stay counted in it like
+ * live blocks, so a second free still takes the locked path and is caught.
+ */
+static void filter_add(const void *ptr);
+static void filter_remove(const void *ptr);
+
+/* Find the quarantine set slot holding ptr, or NULL */
+static unsigned* quarantine_find(const Quarantine *q, const void *ptr) {
+    if (!q->length) return NULL;
+    size_t mask = q->setCapacity - 1;
+    size_t i    = hash_pointer(ptr) & mask;
+    while (q->set[i]) {
+        if (q->ring[q->set[i] - 1].ptr == ptr) return &q->set[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Backward-shift delete from the quarantine set (see table_remove_slot) */
+static void quarantine_set_remove(Quarantine *q, unsigned *slot) {
+    size_t mask = q->setCapacity - 1;
+    size_t hole = (size_t)(slot - q->set);
+    size_t i    = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!q->set[i]) break;
+        size_t home = hash_pointer(q->ring[q->set[i] - 1].ptr) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            q->set[hole] = q->set[i];
+            hole = i;
+        }
+    }
+    q->set[hole] = 0;
+}
+
+/* Drop the oldest quarantine entry, releasing its block if we held it */
+static void quarantine_evict(Quarantine *q) {
+    QuarantineEntry *e = &q->ring[q->head];
+    if (e->ptr) {
+        quarantine_set_remove(q, quarantine_find(q, e->ptr));
+        if (g_filterOn) filter_remove(e->ptr);
+        if (e->realPtr) free(e->realPtr);
+        q->bytes -= e->size;
+    }
+    q->head = (q->head + 1) % q->capacity;
+    q->length--;
+}
+
+/* Lazily allocate the ring and set. Returns 0 if quarantine is unavailable. */
+static int quarantine_init(Shard *s) {
+    Quarantine *q = &s->quarantine;
+    if (q->ring) return 1;
+    if (!g_qMaxEntries) return 0;
+    size_t cap = g_qMaxEntries / SHARD_COUNT;
+    if (!cap) cap = 1;
+    size_t setCap = 1;
+    while (setCap < cap * 2) setCap <<= 1;
+    q->ring = (QuarantineEntry*)tracker_alloc(&s->trackerBytes, cap * sizeof(QuarantineEntry));
+    q->set  = (unsigned*)tracker_calloc(&s->trackerBytes, setCap, sizeof(unsigned));
+    if (!q->ring || !q->set) {
+        tracker_free(&s->trackerBytes, q->ring, q->ring ? cap * sizeof(QuarantineEntry) : 0);
+        tracker_free(&s->trackerBytes, q->set, q->set ? setCap * sizeof(unsigned) : 0);
+        q->ring = NULL;
+        q->set  = NULL;
+        return 0;
+    }
+    q->capacity    = cap;
+    q->setCapacity = setCap;
+    q->head   = 0;
+    q->length = 0;
+    q->bytes  = 0;
+    return 1;
+}
+
+static int was_pointer_freed(const Shard *s, void *ptr) {
+    return quarantine_find(&s->quarantine, ptr) != NULL;
+}
+
+/* Order pointers by address (qsort, bsearch) */
+static int ptr_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const*)a, y = (uintptr_t)*(void *const*)b;
+    return (x > y) - (x < y);
+}
+
+/* Whether ptr is a block a FORGET teardown dropped. Shard locked. */
+static int was_forgotten(const Shard *s, void *ptr) {
+    if (s->forgetAll) return 1;
+    return s->forgottenCount &&
+           bsearch(&ptr, s->forgotten, s->forgottenCount, sizeof(void*), ptr_cmp) != NULL;
+}
+
+/* Forget a quarantined pointer (it is about to be quarantined again) */
+static void remove_from_freed(Shard *s, void *ptr) {
+    Quarantine *q = &s->quarantine;
+    unsigned *slot = quarantine_find(q, ptr);
+    if (!slot) return;
+    QuarantineEntry *e = &q->ring[*slot - 1];
+    quarantine_set_remove(q, slot);
+    if (g_filterOn) filter_remove(ptr);
+    q->bytes -= e->size;
+    e->ptr  = NULL; /* the ring position is reclaimed when it reaches the head */
+    e->size = 0;
+}
+
+/*
+ * Record a freed pointer. With delayed reuse the real block is kept until
+ * the entry is evicted, so the address cannot be handed out again meanwhile.
+ *
+ * The live table is always consulted before the quarantine, so an entry
+ * left behind when the system reused an address is harmless; it is simply
+ * replaced here when that block is freed again.
+ */
+static void add_to_freed(Shard *s, void *ptr, void *realPtr, size_t size) {
+    Quarantine *q = &s->quarantine;
+    size_t maxBytes = g_qMaxBytes / SHARD_COUNT;
+    if (!quarantine_init(s)) {
+        free(realPtr);
+        return;
+    }
+    if (!g_qDelayReuse) {
+        free(realPtr);
+        realPtr = NULL;
+    }
+    remove_from_freed(s, ptr);
+    while (q->length && (q->length == q->capacity || q->bytes + size > maxBytes)) {
+        quarantine_evict(q);
+    }
+    if (size > maxBytes) {
+        /* Too large to ever fit the byte budget. */
+        free(realPtr);
+        return;
+    }
+    size_t idx = (q->head + q->length) % q->capacity;
+    q->ring[idx].ptr     = ptr;
+    q->ring[idx].realPtr = realPtr;
+    q->ring[idx].size    = size;
+    q->length++;
+    q->bytes += size;
+    if (g_filterOn) filter_add(ptr);
+
+    size_t mask = q->setCapacity - 1;
+    size_t i    = hash_pointer(ptr) & mask;
+    while (q->set[i]) {
+        i = (i + 1) & mask;
+    }
+    q->set[i] = (unsigned)idx + 1;
+}
+
+/* Release every quarantined block and the quarantine itself */
+static void quarantine_clear(Shard *s) {
+    Quarantine *q = &s->quarantine;
+    while (q->length) {
+        quarantine_evict(q);
+    }
+    tracker_free(&s->trackerBytes, q->ring, q->capacity * sizeof(QuarantineEntry));
+    tracker_free(&s->trackerBytes, q->set, q->setCapacity * sizeof(unsigned));
+    memset(q, 0, sizeof(*q));
+}
+
+/* ---- Live table ---- */
+
+/* Return the slot holding key, or NULL */
+static AllocSlot* table_find_slot(const AllocTable *t, const void *key) {
+    if (!t->count) return NULL;
+    size_t mask = t->capacity - 1;
+    size_t i    = hash_pointer(key) & mask;
+    while (t->slots[i].key) {
+        if (t->slots[i].key == key) return &t->slots[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Place a record into a table that is known to have a free slot */
+static void table_place(AllocTable *t, void *key, Allocation *alloc) {
+    size_t mask = t->capacity - 1;
+    size_t i    = hash_pointer(key) & mask;
+    while (t->slots[i].key) {
+        i = (i + 1) & mask;
+    }
+    t->slots[i].key   = key;
+    t->slots[i].alloc = alloc;
+    t->count++;
+}
+
+/*
+ * Remove the entry in slot and close the gap with backward-shift deletion,
+ * so lookups stay correct without tombstones.
+ */
+static void table_remove_slot(AllocTable *t, AllocSlot *slot) {
+    size_t mask = t->capacity - 1;
+    size_t hole = (size_t)(slot - t->slots);
+    size_t i    = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!t->slots[i].key) break;
+        size_t home = hash_pointer(t->slots[i].key) & mask;
+        /* Move the entry into the hole unless its home lies in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].key   = NULL;
+    t->slots[hole].alloc = NULL;
+    t->count--;
+}
+
+/* Move up to 'budget' occupied slots from the old table into the current one */
+static void table_migrate(Shard *s, size_t budget) {
+    AllocTable *old = &s->oldTable;
+    while (old->slots && budget) {
+        if (s->migrateCursor >= old->capacity && old->count) {
+            /* A free shifted an entry back past the cursor: sweep again. */
+            s->migrateCursor = 0;
+            continue;
+        }
+        if (s->migrateCursor >= old->capacity) {
+            tracker_free(&s->trackerBytes, old->slots, old->capacity * sizeof(AllocSlot));
+            old->slots       = NULL;
+            old->capacity    = 0;
+            old->count       = 0;
+            s->migrateCursor = 0;
+            break;
+        }
+        AllocSlot *slot = &old->slots[s->migrateCursor];
+        if (!slot->key) {
+            s->migrateCursor++; /* empty slots are cheap, don't charge budget */
+            continue;
+        }
+        /* Removing may shift a later entry into this slot, so stay put. */
+        table_place(&s->table, slot->key, slot->alloc);
+        table_remove_slot(old, slot);
+        budget--;
+    }
+}
+
+/* Start a resize if the current table is too full. Returns 0 on OOM. */
+static int table_reserve(Shard *s) {
+    AllocTable *t = &s->table;
+    size_t cap = t->capacity;
+    if (cap && (t->count + 1) * 4 <= cap * 3) return 1;
+
+    /* A resize is still draining: finish it before starting another. */
+    if (s->oldTable.slots) table_migrate(s, (size_t)-1);
+
+    size_t newCap = cap ? cap * 2 : TABLE_MIN_CAPACITY;
+    AllocSlot *slots = (AllocSlot*)tracker_calloc(&s->trackerBytes, newCap, sizeof(AllocSlot));
+    if (!slots) {
+        /* Keep going at a higher load factor as long as a slot is left. */
+        return cap && t->count + 1 < cap;
+    }
+    s->oldTable      = *t;
+    s->migrateCursor = 0;
+    s->resizes++;
+    t->slots    = slots;
+    t->capacity = newCap;
+    t->count    = 0;
+    return 1;
+}
+
+/* Insert a record keyed by its userPtr. Returns 0 on OOM. */
+static int insert_allocation(Shard *s, Allocation *alloc) {
+    if (!table_reserve(s)) return 0;
+    table_place(&s->table, alloc->userPtr, alloc);
+    table_migrate(s, TABLE_MIGRATE_STEP);
+    return 1;
+}
+
+/* Find an allocation record by user pointer */
+static AllocSlot* find_allocation_slot(Shard *s, void *userPtr, AllocTable **tableOut) {
+    AllocSlot *slot = table_find_slot(&s->table, userPtr);
+    if (slot) {
+        *tableOut = &s->table;
+        return slot;
+    }
+    slot = table_find_slot(&s->oldTable, userPtr);
+    *tableOut = &s->oldTable;
+    return slot;
+}
+
+/* Find and unlink an allocation record by user pointer */
+static Allocation* remove_allocation(Shard *s, void *userPtr) {
+    AllocTable *t;
+    AllocSlot *slot = find_allocation_slot(s, userPtr, &t);
+    if (!slot) return NULL;
+    Allocation *alloc = slot->alloc;
+    table_remove_slot(t, slot);
+    return alloc;
+}
+
+/*
+ * Iterate every live record of a shard across both of its tables. Start
+ * with *cursor = 0; returns NULL when done. The shard must stay locked.
+ */
+static Allocation* next_allocation(const Shard *s, size_t *cursor) {
+    while (*cursor < s->table.capacity + s->oldTable.capacity) {
+        size_t i = (*cursor)++;
+        AllocSlot *slot = (i < s->table.capacity)
+                        ? &s->table.slots[i]
+                        : &s->oldTable.slots[i - s->table.capacity];
+        if (slot->key) return slot->alloc;
+    }
+    return NULL;
+}
+
+/* ---- Records ---- */
+
+
+/* Move up to 'count' free units from the depot into a magazine */
+static void depot_refill(ThreadState *ts, size_t count) {
+    LOCK_DEPOT();
+    while (count--) {
+        if (!g_depotRecords) {
+            /* Depot is empty: carve a new slab into units. */
+            Slab *slab = (Slab*)tracker_alloc(&g_depotBytes, SLAB_SIZE);
+            if (!slab) break;
+            slab->next = g_depotSlabs;
+            g_depotSlabs = slab;
+            unsigned char *rec = (unsigned char*)slab + SLAB_FIRST;
+            unsigned char *end = (unsigned char*)slab + SLAB_SIZE;
+            for (; rec + SLAB_UNIT <= end; rec += SLAB_UNIT) {
+                SlabRecord *r = (SlabRecord*)rec;
+                r->next = g_depotRecords;
+                g_depotRecords = r;
+            }
+        }
+        SlabRecord *r = g_depotRecords;
+        g_depotRecords = r->next;
+        r->next = ts->magazine;
+        ts->magazine = r;
+        ts->magazineCount++;
+    }
+    UNLOCK_DEPOT();
+}
+
+/* Give 'count' units from a magazine back to the depot */
+static void depot_return(ThreadState *ts, size_t count) {
+    LOCK_DEPOT();
+    while (count-- && ts->magazine) {
+        SlabRecord *r = ts->magazine;
+        ts->magazine = r->next;
+        ts->magazineCount--;
+        r->next = g_depotRecords;
+        g_depotRecords = r;
+    }
+    UNLOCK_DEPOT();
+}
+
+/* A free slab unit from the thread's magazine (NULL on OOM) */
+static void* slab_take(ThreadState *ts) {
+    if (!ts) {
+        /* No thread slot: go to the depot for a single unit. */
+        ThreadState tmp;
+        tmp.magazine      = NULL;
+        tmp.magazineCount = 0;
+        depot_refill(&tmp, 1);
+        return tmp.magazine;
+    }
+    if (!ts->magazine) {
+        depot_refill(ts, MAGAZINE_SIZE);
+        if (!ts->magazine) return NULL;
+    }
+    SlabRecord *r = ts->magazine;
+    ts->magazine = r->next;
+    ts->magazineCount--;
+    return r;
+}
+
+/* Put a unit back in the thread's magazine */
+static void slab_give(ThreadState *ts, void *unit) {
+    SlabRecord *r = (SlabRecord*)unit;
+    if (!ts) {
+        LOCK_DEPOT();
+        r->next = g_depotRecords;
+        g_depotRecords = r;
+        UNLOCK_DEPOT();
+        return;
+    }
+    r->next = ts->magazine;
+    ts->magazine = r;
+    if (++ts->magazineCount > 2 * MAGAZINE_SIZE) {
+        depot_return(ts, MAGAZINE_SIZE);
+    }
+}
+
+/* A record's RecordExtra, made zeroed if it has none yet (NULL on OOM) */
+static RecordExtra* rec_extra(ThreadState *ts, Allocation *a) {
+    if (!a->extra) {
+        a->extra = (RecordExtra*)slab_take(ts);
+        if (!a->extra) return NULL;
+        memset(a->extra, 0, sizeof(RecordExtra));
+    }
+    return a->extra;
+}
+
+static void rec_free_extra(ThreadState *ts, Allocation *a) {
+    if (!a->extra) return;
+    slab_give(ts, a->extra);
+    a->extra = NULL;
+}
+
+/* Get a record for a block about to be tracked (NULL on OOM) */
+static Allocation* new_record(ThreadState *ts, void *realPtr) {
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    (void)ts;
+    Allocation *alloc = (Allocation*)realPtr;
+    alloc->magic = HEADER_MAGIC;
+    return alloc;
+#else
+    (void)realPtr;
+    return (Allocation*)slab_take(ts);
+#endif
+}
+
+/* Release a record. Inline headers go away with their block. */
+static void free_record(ThreadState *ts, Allocation *alloc) {
+    rec_free_extra(ts, alloc);
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    alloc->magic = 0;
+#else
+    slab_give(ts, alloc);
+#endif
+}
+
+/* The slab holding record 'r', out of 'n' slabs sorted by address */
+static Slab* slab_of(Slab **slabs, size_t n, const void *r) {
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)slabs[mid] <= (uintptr_t)r) lo = mid; else hi = mid;
+    }
+    return slabs[lo];
+}
+
+/*
+ * Return the slabs all of whose records are back in the depot to the
+ * system. A record still in some thread's magazine, or taken by a thread
+ * that has yet to insert it, keeps its slab: magazines belong to their
+ * owners and are never touched here.
+ */
+static void release_free_slabs(void) {
+    LOCK_DEPOT();
+    size_t n = 0;
+    for (Slab *slab = g_depotSlabs; slab; slab = slab->next) n++;
+    Slab **slabs = n ? (Slab**)tracker_alloc(&g_depotBytes, n * sizeof(Slab*)) : NULL;
+    if (slabs) {
+        n = 0;
+        for (Slab *slab = g_depotSlabs; slab; slab = slab->next) {
+            slab->freeCount = 0;
+            slabs[n++] = slab;
+        }
+        qsort(slabs, n, sizeof(Slab*), ptr_cmp);
+        for (SlabRecord *r = g_depotRecords; r; r = r->next) slab_of(slabs, n, r)->freeCount++;
+        SlabRecord **rec = &g_depotRecords;
+        while (*rec) {
+            if (slab_of(slabs, n, *rec)->freeCount == SLAB_RECORDS) *rec = (*rec)->next;
+            else rec = &(*rec)->next;
+        }
+        Slab **link = &g_depotSlabs;
+        while (*link) {
+            Slab *slab = *link;
+            if (slab->freeCount == SLAB_RECORDS) {
+                *link = slab->next;
+                tracker_free(&g_depotBytes, slab, SLAB_SIZE);
+            } else {
+                link = &slab->next;
+            }
+        }
+        tracker_free(&g_depotBytes, slabs, n * sizeof(Slab*));
+    }
+    UNLOCK_DEPOT();
+}
+
+/* Check that a record found in the table still looks like ours */
+static int header_valid(const Allocation *alloc, const void *userPtr) {
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    return alloc->magic == HEADER_MAGIC && alloc->userPtr == userPtr;
+#else
+    (void)alloc;
+    (void)userPtr;
+    return 1;
+#endif
+}
+
+/* header_valid(), reporting a corrupted header */
+static int check_header(const Allocation *alloc, const void *userPtr) {
+    if (!header_valid(alloc, userPtr)) {
+        diag_report(DIAG_HEADER_CORRUPT, userPtr, NULL, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* Offset from realPtr to userPtr for a block aligned to 'align' */
+static size_t front_offset(const void *realPtr, size_t align, size_t guard) {
+    uintptr_t start = (uintptr_t)realPtr + HEADER_SIZE + guard;
+    return (size_t)(((start + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)realPtr);
+}
+
+/* Real bytes needed for 'size' user bytes at 'align', whatever malloc returns */
+static size_t block_size(size_t size, size_t align, size_t guard) {
+    size_t front = (HEADER_SIZE + guard + MALLOC_ALIGN - 1) & ~(MALLOC_ALIGN - 1);
+    if (align > MALLOC_ALIGN) front += align - MALLOC_ALIGN;
+    return front + size + guard;
+}
+
+/* Fill a guard zone of n bytes */
+static void fill_guard(unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; i += sizeof(SENTINEL_PATTERN)) {
+        size_t chunk = n - i < sizeof(SENTINEL_PATTERN) ? n - i : sizeof(SENTINEL_PATTERN);
+        memcpy(p + i, SENTINEL_PATTERN, chunk);
+    }
+}
+
+/*
+ * 1 if the n bytes at p still hold the pattern. The vector loop ORs the
+ * differences of whole registers and tests once at the end; what is left
+ * is done 8 bytes, then one byte, at a time.
+ */
+static int guard_intact(const unsigned char *p, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i pat  = _mm256_loadu_si256((const __m256i*)SENTINEL_PATTERN);
+    __m256i       diff = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32) {
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)), pat));
+    }
+    if (!_mm256_testz_si256(diff, diff)) return 0;
+#elif defined(__SSE2__)
+    const __m128i pat  = _mm_loadu_si128((const __m128i*)SENTINEL_PATTERN);
+    __m128i       diff = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i)), pat));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) return 0;
+#elif defined(__ARM_NEON)
+    const uint8x16_t pat  = vld1q_u8(SENTINEL_PATTERN);
+    uint8x16_t       diff = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(p + i), pat));
+    }
+    uint64x2_t d = vreinterpretq_u64_u8(diff);
+    if (vgetq_lane_u64(d, 0) | vgetq_lane_u64(d, 1)) return 0;
+#endif
+    uint64_t pat8, rest = 0;
+    memcpy(&pat8, SENTINEL_PATTERN, sizeof(pat8));
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        rest |= v ^ pat8;
+    }
+    for (; i < n; i++) {
+        rest |= p[i] ^ SENTINEL_PATTERN[i & 7];
+    }
+    return rest == 0;
+}
+
+/* Write the guard zones before and after userSize bytes at userPtr */
+static void write_sentinels(unsigned char *userPtr, size_t userSize, size_t front, size_t back) {
+    fill_guard(userPtr - front, front);
+    fill_guard(userPtr + userSize, back);
+}
+
+/* Bytes of back sentinel: the guard size, or up to the guard page */
+static size_t back_guard(const Allocation *alloc) {
+    size_t pages = rec_pages(alloc);
+    if (!pages) return rec_guard(alloc);
+    return pages * g_pageSize - alloc->front - alloc->requestedSize;
+}
+
+/* Check sentinel bytes in debug_free; log if corrupted */
+static int check_sentinels(const Allocation *alloc) {
+    unsigned char *user = (unsigned char*)alloc->userPtr;
+    /* Front check */
+    if (!guard_intact(user - rec_guard(alloc), rec_guard(alloc))) {
+        diag_report(DIAG_FRONT_SENTINEL, alloc->userPtr, g_siteStats[alloc->site].file,
+                    g_siteStats[alloc->site].line);
+        return 0;
+    }
+    /* Back check */
+    if (!guard_intact(user + alloc->requestedSize, back_guard(alloc))) {
+        diag_report(DIAG_BACK_SENTINEL, alloc->userPtr, g_siteStats[alloc->site].file,
+                    g_siteStats[alloc->site].line);
+        return 0;
+    }
+    return 1; /* OK */
+}
+
+/* ---- Sampling ---- */
+
+/*
+ * exp() and log() replacements accurate to ~1e-7, which is plenty for
+ * sampling, so the tracker doesn't need libm.
+ */
+static double exp_neg(double x) {
+    /* exp(-x) = exp(-x / 2^k)^(2^k) with a short Taylor series in the middle */
+    int k = 0;
+    while (x > 0.5) {
+        x *= 0.5;
+        k++;
+    }
+    double r = 1.0 - x * (1.0 - x / 2 * (1.0 - x / 3 * (1.0 - x / 4 * (1.0 - x / 5 * (1.0 - x / 6)))));
+    while (k--) r *= r;
+    return r;
+}
+
+static double log_pos(double x) {
+    /* x = m * 2^e with m in [1, 2), ln(m) = 2 atanh((m - 1) / (m + 1)) */
+    int e = 0;
+    while (x >= 2.0) { x *= 0.5; e++; }
+    while (x < 1.0)  { x *= 2.0; e--; }
+    double t  = (x - 1.0) / (x + 1.0);
+    double t2 = t * t;
+    double s  = t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 * (1.0 / 9)))));
+    return 2.0 * s + e * 0.69314718055994531;
+}
+
+/* xorshift64* */
+static unsigned long long next_random(ThreadState *ts) {
+    unsigned long long x = ts->rngState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ts->rngState = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Draw the next gap of the Poisson process: exponential with mean 'interval' */
+static size_t next_sample_gap(ThreadState *ts, size_t interval) {
+    if (!ts->rngState) {
+        ts->rngState = (unsigned long long)(size_t)ts ^ 0x9E3779B97F4A7C15ULL;
+    }
+    double u   = ((next_random(ts) >> 11) + 1) * (1.0 / 9007199254740992.0); /* (0, 1] */
+    double gap = -log_pos(u) * (double)interval;
+    return gap < 1.0 ? 1 : gap > (double)((size_t)-1 / 2) ? (size_t)-1 / 2 : (size_t)gap;
+}
+
+/* Decide whether this allocation is tracked. Owner thread only. */
+static int sample_this(ThreadState *ts, size_t size, size_t interval) {
+    if (ts->sampleGap != interval) {
+        /* First use, or the interval changed: start a fresh countdown. */
+        ts->sampleGap        = interval;
+        ts->bytesUntilSample = next_sample_gap(ts, interval);
+    }
+    if (size < ts->bytesUntilSample) {
+        ts->bytesUntilSample -= size;
+        return 0;
+    }
+    ts->bytesUntilSample = next_sample_gap(ts, interval);
+    return 1;
+}
+
+/* Horvitz-Thompson weight of a block of 'size' bytes: 1 / P(sampled) */
+static double sample_weight(size_t size, size_t interval) {
+    double p = 1.0 - exp_neg((double)size / (double)interval);
+    return p > 0.0 ? 1.0 / p : (double)interval;
+}
+
+/* Add (sign > 0) or remove a sampled block's share of the estimates */
+static void est_update(ThreadState *ts, double w, size_t requestedSize, int sign) {
+    if (w == 0.0) return;
+    double size = (double)requestedSize;
+    unsigned long long bytes  = (unsigned long long)(size * (w - 1.0) + 0.5);
+    unsigned long long blocks = (unsigned long long)((w - 1.0) * 65536.0 + 0.5);
+    unsigned long long var    = (unsigned long long)((w * w - w) * size * size + 0.5);
+    if (sign < 0) {
+        bytes  = 0 - bytes;
+        blocks = 0 - blocks;
+        var    = 0 - var;
+    }
+    if (!ts) {
+        atomic_fetch_add_explicit(&g_estExtraBytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_estExtraBlocks, blocks, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_estVariance, var, memory_order_relaxed);
+        return;
+    }
+    COUNTER_ADD(ts->estExtraBytes, bytes);
+    COUNTER_ADD(ts->estExtraBlocks, blocks);
+    COUNTER_ADD(ts->estVariance, var);
+}
+
+static unsigned long long isqrt(unsigned long long v) {
+    unsigned long long r = 0, bit = 1ULL << 62;
+    while (bit > v) bit >>= 2;
+    while (bit) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+static atomic_uint* filter_slot(const void *ptr) {
+    return &g_sampleFilter[(hash_pointer(ptr) >> 16) & (SAMPLE_FILTER_SIZE - 1)];
+}
+
+static void filter_add(const void *ptr) {
+    atomic_fetch_add_explicit(filter_slot(ptr), 1, memory_order_relaxed);
+}
+
+static void filter_remove(const void *ptr) {
+    atomic_fetch_sub_explicit(filter_slot(ptr), 1, memory_order_relaxed);
+}
+
+/* 0 = certainly not a tracked block */
+static int filter_maybe(const void *ptr) {
+    return atomic_load_explicit(filter_slot(ptr), memory_order_relaxed) != 0;
+}
+
+/* A tracked block was resized from (oldPtr, oldSize): move its sampling state */
+static void sample_resized(ThreadState *ts, const Allocation *cur, void *oldPtr, size_t oldSize) {
+    est_update(ts, rec_weight(cur), oldSize, -1);
+    est_update(ts, rec_weight(cur), cur->requestedSize, 1);
+    if (g_filterOn && cur->userPtr != oldPtr) {
+        filter_add(cur->userPtr);
+        filter_remove(oldPtr);
+    }
+}
+
+/* ---- Pending records (batched mode) ---- */
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+/* Insert a thread's pending records into their shards. Cache lock held. */
+static void publish_pending(ThreadState *ts) {
+    size_t n = ts->pendingCount;
+    Allocation **p = ts->pending;
+    unsigned char shardOf[PENDING_MAX];
+
+    /* Group by shard (insertion sort on a few dozen entries) ... */
+    for (size_t i = 0; i < n; i++) {
+        Allocation *a = p[i];
+        unsigned char k = (unsigned char)shard_index(a->userPtr);
+        size_t j = i;
+        for (; j > 0 && shardOf[j - 1] > k; j--) {
+            p[j]       = p[j - 1];
+            shardOf[j] = shardOf[j - 1];
+        }
+        p[j]       = a;
+        shardOf[j] = k;
+    }
+    /* ... so each shard lock is taken once per batch. */
+    for (size_t i = 0; i < n; ) {
+        Shard *s = &g_shards[shardOf[i]];
+        LOCK_SHARD(s);
+        for (; i < n && &g_shards[shardOf[i]] == s; i++) {
+            if (!insert_allocation(s, p[i])) {
+                /* The block stays valid for its owner, we just stop watching it. */
+                diag_report(DIAG_UNTRACKED, p[i]->userPtr, NULL, 0);
+                stats_update((size_t)0 - p[i]->requestedSize, (size_t)-1, 0);
+                est_update(NULL, rec_weight(p[i]), p[i]->requestedSize, -1);
+                site_free(p[i]);
+                epoch_detach(p[i]);
+                free_record(NULL, p[i]);
+            }
+        }
+        UNLOCK_SHARD(s);
+    }
+    ts->pendingCount = 0;
+}
+
+/* Find ptr among a thread's pending records. Cache lock held. */
+static Allocation** pending_find(ThreadState *ts, const void *ptr) {
+    /* Newest first: short-lived blocks are usually freed soon. */
+    for (size_t i = ts->pendingCount; i-- > 0; ) {
+        if (ts->pending[i]->userPtr == ptr) return &ts->pending[i];
+    }
+    return NULL;
+}
+#endif
+
+/* Publish one thread's pending records */
+static void flush_thread_cache(ThreadState *ts) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    LOCK_CACHE(ts);
+    publish_pending(ts);
+    UNLOCK_CACHE(ts);
+#else
+    (void)ts;
+#endif
+}
+
+/* Publish every thread's pending records, so the shards hold the whole live set */
+static void flush_all_caches(void) {
+    if (!BATCHING_ON()) return;
+    for (ThreadState *ts = g_threads; ts; ts = ts->next) {
+        flush_thread_cache(ts);
+    }
+}
+
+/* Lock every shard in index order (for whole-tracker operations) */
+static void lock_all_shards(void) {
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        LOCK_SHARD(&g_shards[i]);
+    }
+}
+
+static void unlock_all_shards(void) {
+    for (size_t i = SHARD_COUNT; i-- > 0; ) {
+        UNLOCK_SHARD(&g_shards[i]);
+    }
+}
+
+/* ---- Guard pages ---- */
+
+/* Whether a new block of this size gets a guard-page run (interval != 0: picked by sampling) */
+static int page_wanted(size_t size, size_t align, size_t interval) {
+    return g_pageMax && size >= g_pageMin && size <= g_pageMax && align <= g_pageSize &&
+           (!g_pageSampledOnly || interval);
+}
+
+/* Accessible pages for a block laid out at the end of its run */
+static size_t page_count(size_t size, size_t align, size_t guard) {
+    size_t need = HEADER_SIZE + guard + size + align - 1;
+    return (need + g_pageSize - 1) / g_pageSize;
+}
+
+/* Offset from the run to userPtr: as late as alignment allows */
+static size_t page_front(size_t pages, size_t size, size_t align) {
+    return (pages * g_pageSize - size) & ~(align - 1);
+}
+
+/* A run of 'pages' writable pages plus the guard page, NULL on failure */
+static void* page_alloc(size_t pages) {
+#ifdef HAVE_MMAP
+    void *run = NULL;
+    if (pages <= PAGE_POOL_CLASSES) {
+        PagePool *pool = &g_pagePools[pages - 1];
+        LOCK_PAGES();
+        if (pool->count) {
+            /* Oldest first, so freed runs stay inaccessible as long as possible. */
+            run = pool->runs[pool->head];
+            pool->head = (pool->head + 1) % PAGE_POOL_DEPTH;
+            pool->count--;
+        }
+        UNLOCK_PAGES();
+        if (run && mprotect(run, pages * g_pageSize, PROT_READ | PROT_WRITE) == 0) return run;
+        if (run) munmap(run, (pages + 1) * g_pageSize);
+    }
+    run = mmap(NULL, (pages + 1) * g_pageSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (run == MAP_FAILED) return NULL;
+    if (mprotect((unsigned char*)run + pages * g_pageSize, g_pageSize, PROT_NONE) != 0) {
+        munmap(run, (pages + 1) * g_pageSize);
+        return NULL;
+    }
+    return run;
+#else
+    (void)pages;
+    return NULL;
+#endif
+}
+
+/* Give a run back: made inaccessible and pooled, or unmapped */
+static void page_release(void *run, size_t pages) {
+#ifdef HAVE_MMAP
+    if (pages <= PAGE_POOL_CLASSES &&
+        mprotect(run, pages * g_pageSize, PROT_NONE) == 0) {
+        PagePool *pool = &g_pagePools[pages - 1];
+        void *evicted = NULL;
+        LOCK_PAGES();
+        if (pool->count == PAGE_POOL_DEPTH) {
+            evicted = pool->runs[pool->head];
+            pool->head = (pool->head + 1) % PAGE_POOL_DEPTH;
+            pool->count--;
+        }
+        pool->runs[(pool->head + pool->count) % PAGE_POOL_DEPTH] = run;
+        pool->count++;
+        UNLOCK_PAGES();
+        if (evicted) munmap(evicted, (pages + 1) * g_pageSize);
+        return;
+    }
+    munmap(run, (pages + 1) * g_pageSize);
+#else
+    (void)run;
+    (void)pages;
+#endif
+}
+
+/* Release the real memory of a block: malloc'd or a guard-page run */
+static void release_real(void *realPtr, size_t pages) {
+    if (pages) {
+        page_release(realPtr, pages);
+    } else {
+        free(realPtr);
+    }
+}
+
+/*
+ * Turn a block whose record is gone into a plain one of the system
+ * allocator holding the 'size' bytes at userPtr: moved to the start of
+ * the real block, or copied out of a guard-page run. NULL only if no
+ * block could be had for the copy; the run is kept then.
+ */
+static void* untrack_block(void *realPtr, size_t pages, void *userPtr, size_t size) {
+    if (!pages) {
+        memmove(realPtr, userPtr, size);
+        return realPtr;
+    }
+    void *p = malloc(size);
+    if (p) {
+        memcpy(p, userPtr, size);
+        page_release(realPtr, pages);
+    }
+    return p;
+}
+
+/*
+ * Move a guard-page block to a run sized for newSize; the record travels
+ * with it. NULL if no run could be had, leaving the block untouched.
+ */
+static Allocation* resize_page_block(Allocation *cur, size_t newSize) {
+    size_t keep  = cur->requestedSize < newSize ? cur->requestedSize : newSize;
+    size_t pages = page_count(newSize, rec_align(cur), rec_guard(cur));
+    unsigned char *run = (unsigned char*)page_alloc(pages);
+    if (!run) return NULL;
+    size_t front = page_front(pages, newSize, rec_align(cur));
+    memcpy(run + front, cur->userPtr, keep);
+
+    void  *oldRun   = rec_real(cur);
+    size_t oldPages = rec_pages(cur);
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    memcpy(run, cur, sizeof(Allocation));
+    cur = (Allocation*)run;
+#endif
+    page_release(oldRun, oldPages);
+
+    cur->userPtr       = run + front;
+    cur->front         = (unsigned)front;
+    cur->extra->pages  = pages; /* a page block always has its extra */
+    cur->requestedSize = newSize;
+    write_sentinels(run + front, newSize, rec_guard(cur), back_guard(cur));
+    return cur;
+}
+
+/*
+ * Resize a tracked block with the real realloc and update its record.
+ * Returns the (possibly moved) record, or NULL if realloc failed, in which
+ * case the old block and record are untouched.
+ */
+static Allocation* resize_record(Allocation *cur, size_t newSize) {
+    /* Check old sentinels before real realloc. */
+    check_sentinels(cur);
+    if (newSize >> REC_SIZE_BITS) return NULL;
+    if (rec_pages(cur)) return resize_page_block(cur, newSize);
+
+    /* Perform real realloc with room for the header, padding and sentinels. */
+    size_t oldFront     = cur->front;
+    size_t keep         = cur->requestedSize < newSize ? cur->requestedSize : newSize;
+    size_t newTotalSize = block_size(newSize, rec_align(cur), rec_guard(cur));
+    void *newRealPtr    = realloc(rec_real(cur), newTotalSize);
+    if (!newRealPtr) {
+        /* If real realloc fails, old pointer remains valid. */
+        return NULL;
+    }
+#ifdef LEAK_TRACKER_INLINE_HEADER
+    cur = (Allocation*)newRealPtr; /* the header moved with the block */
+#endif
+
+    /* An over-aligned block may need its data shifted to the new padding. */
+    size_t newFront = front_offset(newRealPtr, rec_align(cur), rec_guard(cur));
+    if (newFront != oldFront) {
+        memmove((unsigned char*)newRealPtr + newFront, (unsigned char*)newRealPtr + oldFront, keep);
+    }
+
+    /* Update allocation record. */
+    cur->userPtr       = (unsigned char*)newRealPtr + newFront;
+    cur->front         = (unsigned)newFront;
+    cur->requestedSize = newSize;  /* Now we overwrite with new size. */
+
+    /* Rewrite sentinels in front/back. */
+    write_sentinels((unsigned char*)cur->userPtr, newSize, rec_guard(cur), rec_guard(cur));
+    return cur;
+}
+
+/*
+ * Finish freeing a record already unlinked from the live set: checks,
+ * metadata release and quarantine. The pointer's shard must be locked.
+ * Returns the freed user size, or 0 if the block had to be leaked.
+ */
+static size_t release_block(ThreadState *ts, Shard *s, Allocation *cur, void *ptr) {
+    if (!check_header(cur, ptr)) {
+        /* Size and real pointer can't be trusted: leak the block. */
+        return 0;
+    }
+
+    /* Check if sentinels are intact. */
+    check_sentinels(cur);
+
+    est_update(ts, rec_weight(cur), cur->requestedSize, -1);
+    site_free(cur);
+    hist_add(ts, HIST_LIFETIMES, now_ticks() - cur->born);
+    if (g_filterOn) filter_remove(ptr);
+    epoch_detach(cur);
+
+    /* Free the metadata (an inline header stays readable until the block goes). */
+    void  *realPtr = rec_real(cur);
+    size_t size    = cur->requestedSize;
+    size_t pages   = rec_pages(cur);
+    free_record(ts, cur);
+    if (pages) {
+        /* Guard-page runs go back to their pool, never to the quarantine. */
+        page_release(realPtr, pages);
+        realPtr = NULL;
+    }
+
+    /*
+     * Mark pointer as freed to detect double-frees. The quarantine
+     * releases the real block, now or once it is evicted.
+     */
+    add_to_freed(s, ptr, realPtr, size);
+    return size;
+}
+
+/* ---- Export ----
+ *
+ * Records stream through a fixed buffer to the caller's sink, so an export
+ * takes constant memory however many blocks are live.
+ *
+ * Binary format: the 7 bytes "LEAKTRK" and a version byte (EXPORT_VERSION),
+ * then records of a tag byte followed by unsigned LEB128 varints:
+ *   EXPORT_STATS  the MemStats fields in declaration order (version 1 had
+ *                 no overheadBytes, slackBytes and usableBytes)
+ *   EXPORT_SITE   id, line, name length, name bytes (before its first block)
+ *   EXPORT_BLOCK  address, size, alignment, site id, weight (16.16, 0 = exact)
+ *   EXPORT_END    number of blocks
+ */
+#define EXPORT_BUF   16384
+#define EXPORT_MAGIC    "LEAKTRK"
+#define EXPORT_VERSION  2
+#define EXPORT_STATS_V1 9  /* MemStats fields in a version 1 export */
+#define EXPORT_STATS_N  12
+
+enum { EXPORT_STATS = 1, EXPORT_SITE, EXPORT_BLOCK, EXPORT_END };
+
+typedef struct {
+    int             format;
+    LeakTrackerSink sink;
+    void           *ctx;
+    int             error;           /* the sink failed: drop the rest */
+    size_t          len;
+    unsigned char   sent[SITE_MAX / 8]; /* sites already described (binary) */
+    unsigned char   buf[EXPORT_BUF];
+} ExportWriter;
+
+static void export_flush(ExportWriter *w) {
+    if (w->len && !w->error && w->sink(w->ctx, w->buf, w->len) != 0) {
+        w->error = 1;
+    }
+    w->len = 0;
+}
+
+static void export_bytes(ExportWriter *w, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char*)data;
+    while (n && !w->error) {
+        if (w->len == EXPORT_BUF) export_flush(w);
+        size_t chunk = EXPORT_BUF - w->len;
+        if (chunk > n) chunk = n;
+        memcpy(w->buf + w->len, p, chunk);
+        w->len += chunk;
+        p      += chunk;
+        n      -= chunk;
+    }
+}
+
+static void export_varint(ExportWriter *w, unsigned long long v) {
+    unsigned char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n++] = (unsigned char)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+    export_bytes(w, tmp, n);
+}
+
+static void export_text(ExportWriter *w, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > 0) export_bytes(w, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+/* A file name as a quoted JSON string */
+static void export_json_string(ExportWriter *w, const char *s, size_t len) {
+    export_bytes(w, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', (char)c };
+            export_bytes(w, esc, 2);
+        } else if (c < 0x20) {
+            export_text(w, "\\u%04x", c);
+        } else {
+            export_bytes(w, &c, 1);
+        }
+    }
+    export_bytes(w, "\"", 1);
+}
+
+static void export_stats(ExportWriter *w, const MemStats *st) {
+    if (w->format == LEAK_TRACKER_BINARY) {
+        const size_t f[EXPORT_STATS_N] = {
+            st->totalAllocated, st->currentAllocated, st->peakAllocated,
+            st->allocationCount, st->trackerOverhead, st->overheadBytes,
+            st->slackBytes, st->usableBytes, st->sampleInterval,
+            st->estimatedBytes, st->estimatedBlocks, st->estimatedError
+        };
+        const unsigned char version = EXPORT_VERSION;
+        export_bytes(w, EXPORT_MAGIC, 7);
+        export_bytes(w, &version, 1);
+        export_bytes(w, "\1", 1); /* EXPORT_STATS */
+        for (size_t i = 0; i < sizeof(f) / sizeof(f[0]); i++) export_varint(w, f[i]);
+        return;
+    }
+    export_text(w, "{\"type\":\"stats\",\"total\":%zu,\"current\":%zu,\"peak\":%zu,"
+                   "\"blocks\":%zu,\"overhead\":%zu,",
+                st->totalAllocated, st->currentAllocated, st->peakAllocated,
+                st->allocationCount, st->trackerOverhead);
+    export_text(w, "\"block_overhead\":%zu,\"slack\":%zu,\"usable\":%zu,",
+                st->overheadBytes, st->slackBytes, st->usableBytes);
+    export_text(w, "\"sample_interval\":%zu,\"est_bytes\":%zu,\"est_blocks\":%zu,"
+                   "\"est_error\":%zu}\n",
+                st->sampleInterval, st->estimatedBytes, st->estimatedBlocks,
+                st->estimatedError);
+}
+
+/* One live block; file/line describe 'site' */
+static void export_block(ExportWriter *w, unsigned long long addr, size_t size, size_t align,
+                         unsigned site, const char *file, int line, unsigned long long weight) {
+    if (w->format == LEAK_TRACKER_BINARY) {
+        if (!(w->sent[site / 8] & (1u << (site % 8)))) {
+            size_t len = strlen(file);
+            w->sent[site / 8] |= (unsigned char)(1u << (site % 8));
+            export_bytes(w, "\2", 1); /* EXPORT_SITE */
+            export_varint(w, site);
+            export_varint(w, (unsigned)line);
+            export_varint(w, len);
+            export_bytes(w, file, len);
+        }
+        export_bytes(w, "\3", 1); /* EXPORT_BLOCK */
+        export_varint(w, addr);
+        export_varint(w, size);
+        export_varint(w, align);
+        export_varint(w, site);
+        export_varint(w, weight);
+        return;
+    }
+    export_text(w, "{\"type\":\"block\",\"ptr\":\"0x%llx\",\"size\":%zu,\"align\":%zu,\"file\":",
+                addr, size, align);
+    export_json_string(w, file, strlen(file));
+    if (weight) {
+        export_text(w, ",\"line\":%d,\"weight\":%.4f}\n", line, (double)weight / 65536.0);
+    } else {
+        export_text(w, ",\"line\":%d}\n", line);
+    }
+}
+
+static void export_end(ExportWriter *w, size_t blocks) {
+    if (w->format == LEAK_TRACKER_BINARY) {
+        export_bytes(w, "\4", 1); /* EXPORT_END */
+        export_varint(w, blocks);
+    } else {
+        export_text(w, "{\"type\":\"end\",\"blocks\":%zu}\n", blocks);
+    }
+    export_flush(w);
+}
+
+/* Read one varint of a binary export; -1 at a truncated or overlong one */
+static int import_varint(FILE *in, unsigned long long *v) {
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(in);
+        if (c == EOF) return -1;
+        *v |= (unsigned long long)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+#ifdef HAVE_MMAP
+/* Sink writing to a file descriptor (ctx points at it) */
+static int export_fd_sink(void *ctx, const void *data, size_t len) {
+    int fd = *(int*)ctx;
+    const char *p = (const char*)data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p   += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+#endif
+
+/* ---- Trace ----
+ *
+ * File layout (native byte order): a TraceHeader padded to a page, then
+ * chunks of chunkSize bytes, each owned by one thread and starting with a
+ * TraceChunkHeader, then (once the trace was stopped) the site table.
+ *
+ * Each event is a tag byte (bits 0-2 op, 3-4 kind, bit 5 an alignment
+ * follows) and unsigned LEB128 varints, with times and pointers as deltas
+ * from the previous event in the chunk (pointers zigzag-encoded):
+ *   MALLOC, CALLOC  dt, site, size, [log2 alignment], ptr
+ *   REALLOC         dt, site, new size, old ptr, new ptr - old ptr
+ *   FREE            dt, ptr
+ * The site table is a count, then per site id its line, name length and
+ * name bytes.
+ */
+#define TRACE_MAGIC         "LEAKTRC\1"
+#define TRACE_CHUNK_MAGIC   0x4B43544CU /* "LTCK" */
+#define TRACE_CHUNK_DEFAULT ((size_t)1 << 20)
+#define TRACE_EVENT_MAX     64          /* longest encoded event */
+#define TRACE_ALIGNED       0x20
+
+typedef struct {
+    char               magic[8];
+    unsigned long long chunkSize;
+    unsigned long long dataOffset;      /* first chunk */
+    unsigned long long startTicks;
+    double             ticksPerSecond;  /* 0 = unknown (not stopped) */
+    unsigned long long sites;           /* offset of the site table, 0 = none */
+} TraceHeader;
+
+typedef struct {
+    unsigned           magic;
+    unsigned           thread;
+    unsigned long long used;            /* bytes including this header */
+    unsigned long long startTicks;
+} TraceChunkHeader;
+
+#ifdef HAVE_MMAP
+static unsigned char* trace_varint(unsigned char *p, unsigned long long v) {
+    while (v > 0x7F) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned long long zigzag(uintptr_t to, uintptr_t from) {
+    long long d = (long long)(to - from);
+    return ((unsigned long long)d << 1) ^ (unsigned long long)(d >> 63);
+}
+
+/* Map a fresh chunk of trace 'gen' for this thread; 0 if the trace is over */
+static int trace_new_chunk(ThreadState *ts, unsigned gen) {
+    LOCK_TRACE();
+    if (ts->traceChunk) {
+        munmap(ts->traceChunk, ts->traceCap);
+        ts->traceChunk = NULL;
+    }
+    if (gen != g_traceGen || atomic_load_explicit(&g_traceOn, memory_order_relaxed) != gen) {
+        UNLOCK_TRACE();
+        return 0;
+    }
+    size_t size = g_traceChunkSize;
+    off_t  off  = (off_t)(g_traceDataOffset + g_traceChunks * size);
+    void  *map  = MAP_FAILED;
+    /* Reserve the blocks first: writing to a hole on a full disk is a SIGBUS. */
+#if defined(__linux__)
+    if (posix_fallocate(g_traceFd, off, (off_t)size) == 0)
+#else
+    if (ftruncate(g_traceFd, off + (off_t)size) == 0)
+#endif
+    {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, g_traceFd, off);
+    }
+    if (map != MAP_FAILED) g_traceChunks++;
+    UNLOCK_TRACE();
+    if (map == MAP_FAILED) return 0;
+
+    if (!ts->traceThread) {
+        ts->traceThread = atomic_fetch_add_explicit(&g_traceThreads, 1, memory_order_relaxed) + 1;
+    }
+    TraceChunkHeader *h = (TraceChunkHeader*)map;
+    h->magic      = TRACE_CHUNK_MAGIC;
+    h->thread     = ts->traceThread - 1;
+    h->used       = sizeof(TraceChunkHeader);
+    h->startTicks = now_ticks();
+    ts->traceChunk = (unsigned char*)map;
+    ts->traceCap   = size;
+    ts->traceUsed  = sizeof(TraceChunkHeader);
+    ts->traceTicks = h->startTicks;
+    ts->tracePtr   = 0;
+    ts->traceGen   = gen;
+    return 1;
+}
+#endif
+
+/*
+ * Append one event to this thread's chunk. Callers check TRACE_ON() first,
+ * so this costs one relaxed load when no trace is running. Frees are
+ * recorded before the block is released and allocations after, so a reused
+ * address always appears in the right order.
+ */
+#define TRACE_ON() atomic_load_explicit(&g_traceOn, memory_order_relaxed)
+
+static NEVER_INLINE void trace_event(int op, int kind, unsigned site, size_t size, size_t align,
+                                     const void *ptr, const void *oldPtr) {
+#ifdef HAVE_MMAP
+    ENSURE_INIT();
+    ThreadState *ts  = thread_state();
+    unsigned     gen = atomic_load_explicit(&g_traceOn, memory_order_acquire);
+    if (!ts || !gen) return;
+    if ((ts->traceGen != gen || !ts->traceChunk ||
+         ts->traceUsed + TRACE_EVENT_MAX > ts->traceCap) && !trace_new_chunk(ts, gen)) {
+        return;
+    }
+    unsigned char *p   = ts->traceChunk + ts->traceUsed;
+    unsigned long long now = now_ticks();
+    if (now < ts->traceTicks) now = ts->traceTicks; /* TSC skew between cores */
+    int aligned = align > MIN_ALIGN;
+    *p++ = (unsigned char)(op | (kind << 3) | (aligned ? TRACE_ALIGNED : 0));
+    p = trace_varint(p, now - ts->traceTicks);
+    if (op == LEAK_TRACKER_TRACE_FREE) {
+        p = trace_varint(p, zigzag((uintptr_t)ptr, ts->tracePtr));
+    } else if (op == LEAK_TRACKER_TRACE_REALLOC) {
+        p = trace_varint(p, site);
+        p = trace_varint(p, size);
+        p = trace_varint(p, zigzag((uintptr_t)oldPtr, ts->tracePtr));
+        p = trace_varint(p, zigzag((uintptr_t)ptr, (uintptr_t)oldPtr));
+    } else {
+        p = trace_varint(p, site);
+        p = trace_varint(p, size);
+        if (aligned) p = trace_varint(p, trailing_zeros(align));
+        p = trace_varint(p, zigzag((uintptr_t)ptr, ts->tracePtr));
+    }
+    ts->traceTicks = now;
+    ts->tracePtr   = (uintptr_t)ptr;
+    ts->traceUsed  = (size_t)(p - ts->traceChunk);
+    ((TraceChunkHeader*)ts->traceChunk)->used = ts->traceUsed;
+#else
+    (void)op; (void)kind; (void)site; (void)size; (void)align; (void)ptr; (void)oldPtr;
+#endif
+}
+
+#ifdef HAVE_MMAP
+/* Reading side: a varint at *p, bounded by end; -1 if cut off */
+static int trace_read_varint(const unsigned char **p, const unsigned char *end,
+                             unsigned long long *v) {
+    *v = 0;
+    for (unsigned shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char c = *(*p)++;
+        *v |= (unsigned long long)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static uintptr_t unzigzag(uintptr_t from, unsigned long long v) {
+    return from + (uintptr_t)(long long)((v >> 1) ^ (0 - (v & 1)));
+}
+
+/* One chunk being merged; 'ev' is its next event, decoded ahead */
+typedef struct {
+    const unsigned char *p, *end;
+    unsigned long long   ticks;
+    uintptr_t            ptr;
+    unsigned             thread;
+    LeakTraceEvent       ev;
+} TraceCursor;
+
+typedef struct {
+    char  **names;
+    int    *lines;
+    size_t  count;
+} TraceSites;
+
+/* Decode the cursor's next event; 0 at the end of its chunk (or garbage) */
+static int trace_next(TraceCursor *c, const TraceSites *sites) {
+    unsigned long long v[5] = { 0 };
+    if (c->p >= c->end) return 0;
+    unsigned tag = *c->p++;
+    int op = (int)(tag & 7);
+    if (op < LEAK_TRACKER_TRACE_MALLOC || op > LEAK_TRACKER_TRACE_FREE) return 0;
+    size_t n = op == LEAK_TRACKER_TRACE_FREE ? 2 : op == LEAK_TRACKER_TRACE_REALLOC ? 5
+             : (tag & TRACE_ALIGNED) ? 5 : 4;
+    for (size_t i = 0; i < n; i++) {
+        if (trace_read_varint(&c->p, c->end, &v[i])) return 0;
+    }
+    LeakTraceEvent *e = &c->ev;
+    memset(e, 0, sizeof(*e));
+    e->op     = op;
+    e->kind   = (int)((tag >> 3) & 3);
+    e->thread = c->thread;
+    c->ticks += v[0];
+    if (op == LEAK_TRACKER_TRACE_FREE) {
+        c->ptr = unzigzag(c->ptr, v[1]);
+    } else {
+        e->site = (unsigned)v[1];
+        e->size = (size_t)v[2];
+        if (op == LEAK_TRACKER_TRACE_REALLOC) {
+            uintptr_t old = unzigzag(c->ptr, v[3]);
+            e->oldPtr = old;
+            c->ptr    = unzigzag(old, v[4]);
+        } else {
+            if (tag & TRACE_ALIGNED) {
+                if (v[3] >= 64) return 0;
+                e->alignment = (size_t)1 << v[3];
+            }
+            c->ptr = unzigzag(c->ptr, v[n - 1]);
+        }
+        if (e->site < sites->count && sites->names[e->site]) {
+            e->file = sites->names[e->site];
+            e->line = sites->lines[e->site];
+        }
+    }
+    e->ptr = c->ptr;
+    return 1;
+}
+
+/* Heap order: earlier event first, and by chunk on ties for a stable merge */
+static int trace_before(const TraceCursor *cs, size_t a, size_t b) {
+    return cs[a].ticks != cs[b].ticks ? cs[a].ticks < cs[b].ticks : a < b;
+}
+
+static void trace_sift(const TraceCursor *cs, size_t *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, m = i;
+        if (l < n && trace_before(cs, heap[l], heap[m])) m = l;
+        if (l + 1 < n && trace_before(cs, heap[l + 1], heap[m])) m = l + 1;
+        if (m == i) return;
+        size_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+static int trace_load_sites(const unsigned char *p, const unsigned char *end, TraceSites *out) {
+    unsigned long long count, line, len;
+    if (trace_read_varint(&p, end, &count) || count > SITE_MAX) return -1;
+    out->names = (char**)calloc((size_t)count ? (size_t)count : 1, sizeof(char*));
+    out->lines = (int*)calloc((size_t)count ? (size_t)count : 1, sizeof(int));
+    if (!out->names || !out->lines) return -1;
+    out->count = (size_t)count;
+    for (size_t i = 0; i < out->count; i++) {
+        if (trace_read_varint(&p, end, &line) || trace_read_varint(&p, end, &len) ||
+            len > (unsigned long long)(end - p)) return -1;
+        out->names[i] = (char*)malloc((size_t)len + 1);
+        if (!out->names[i]) return -1;
+        memcpy(out->names[i], p, (size_t)len);
+        out->names[i][len] = '\0';
+        out->lines[i] = (int)line;
+        p += len;
+    }
+    return 0;
+}
+#endif
+
+/* ========== Public Functions ========== */
+
+/*
+ * Allocate and track a block whose user data is aligned to 'align' (a
+ * power of two >= MIN_ALIGN). Always inlined so stack_capture() sees the
+ * public entry point as its caller.
+ */
+static ALWAYS_INLINE void* track_block(size_t size, size_t align, int kind, unsigned site) {
+    /* Minimal check for 0-size. Some code does malloc(0). */
+    if (size == 0) size = 1;
+
+    /* Beyond what a record can describe (no allocator gets there anyway). */
+    if ((size >> REC_SIZE_BITS) || align > REC_FRONT_MAX / 4) return NULL;
+
+    ENSURE_INIT();
+    ThreadState *ts = thread_state();
+    if (POLICY_REFUSES(site, site, size, ts)) return NULL;
+
+    /* Sites switched off are left alone like sampled-out blocks. */
+    if (align == MIN_ALIGN &&
+        atomic_load_explicit(&g_siteStats[site].disabled, memory_order_relaxed)) {
+        return malloc(size);
+    }
+
+    /*
+     * Sampling: blocks that aren't picked are not tracked at all. Over-aligned
+     * blocks always are, since free() must be able to take them back.
+     */
+    size_t interval = align == MIN_ALIGN ? g_sampleInterval : 0;
+    if (interval && ts && !sample_this(ts, size, interval)) {
+        return malloc(size);
+    }
+
+    /* We allocate extra space for front+back sentinels (and the header). */
+    size_t guard     = g_guardSize;
+    size_t pages     = page_wanted(size, align, interval) ? page_count(size, align, guard) : 0;
+    size_t totalSize = pages ? (pages + 1) * g_pageSize : block_size(size, align, guard);
+    /* Real memory from the system */
+    void *realPtr = pages ? page_alloc(pages) : malloc(totalSize);
+    if (!realPtr) return NULL; /* out of memory */
+
+    Allocation *node = new_record(ts, realPtr);
+    if (!node) {
+        release_real(realPtr, pages);
+        return NULL;
+    }
+
+    /* userPtr is after the padding and front sentinel (or against the guard page) */
+    size_t front  = pages ? page_front(pages, size, align) : front_offset(realPtr, align, guard);
+    void *userPtr = (unsigned char*)realPtr + front;
+
+    /* Write sentinel patterns */
+    write_sentinels((unsigned char*)userPtr, size, guard,
+                    pages ? pages * g_pageSize - front - size : guard);
+
+    /* Fill out allocation info */
+    node->userPtr       = userPtr;
+    node->requestedSize = size;
+    node->guardUnits    = guard / SENTINEL_SIZE - 1;
+    node->alignShift    = trailing_zeros(align);
+    node->kind          = (unsigned)kind;
+    node->reach         = LEAK_TRACKER_REACH_UNKNOWN;
+    node->born          = now_ticks();
+    node->extra         = NULL;
+    node->site          = site;
+    node->reallocs      = 0;
+    node->front         = (unsigned)front;
+    unsigned stack      = g_stackDepth ? stack_capture() : 0;
+    double   weight     = (interval && ts) ? sample_weight(size, interval) : 0.0;
+    if (pages || stack || weight != 0.0 || (ts && ts->epoch)) {
+        RecordExtra *x = rec_extra(ts, node);
+        if (!x) {
+            free_record(ts, node);
+            release_real(realPtr, pages);
+            return NULL;
+        }
+        x->pages        = pages;
+        x->stack        = stack;
+        x->sampleWeight = weight;
+        if (ts && ts->epoch) epoch_attach(node, ts->epoch);
+    }
+    if (g_filterOn) filter_add(userPtr);
+
+    /* Read the record while it is still ours; once published it may be freed or scanned. */
+    site_alloc(node);
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (BATCHING_ON() && ts) {
+        /* Park it; the shard tables see it with the next batch. */
+        LOCK_CACHE(ts);
+        ts->pending[ts->pendingCount++] = node;
+        if (ts->pendingCount == PENDING_MAX) {
+            publish_pending(ts);
+        }
+        UNLOCK_CACHE(ts);
+        est_update(ts, weight, size, 1);
+        hist_add(ts, HIST_SIZES, size);
+        stats_update(size, 1, size);
+        return userPtr;
+    }
+#endif
+
+    /* Insert into the live table */
+    Shard *s = shard_for(userPtr);
+    LOCK_SHARD(s);
+    if (!insert_allocation(s, node)) {
+        UNLOCK_SHARD(s);
+        site_free(node);
+        if (g_filterOn) filter_remove(userPtr);
+        epoch_detach(node);
+        free_record(ts, node);
+        release_real(realPtr, pages);
+        return NULL;
+    }
+    UNLOCK_SHARD(s);
+
+    /* Update stats */
+    est_update(ts, weight, size, 1);
+    hist_add(ts, HIST_SIZES, size);
+    stats_update(size, 1, size);
+    return userPtr;
+}
+
+void* debug_malloc(size_t size, const char *file, int line) {
+    unsigned site = site_index(file, line);
+    void *ptr = track_block(size, MIN_ALIGN, LEAK_TRACKER_KIND_MALLOC, site);
+    if (ptr && TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_MALLOC, LEAK_TRACKER_KIND_MALLOC, site, size, 0, ptr, NULL);
+    }
+    return ptr;
+}
+
+void* debug_malloc_site(size_t size, LeakTrackerSite *site) {
+    unsigned id = site_of(site);
+    void *ptr = track_block(size, MIN_ALIGN, LEAK_TRACKER_KIND_MALLOC, id);
+    if (ptr && TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_MALLOC, LEAK_TRACKER_KIND_MALLOC, id, size, 0, ptr, NULL);
+    }
+    return ptr;
+}
+
+static void* aligned_block(size_t alignment, size_t size, unsigned site) {
+    /* Any power of two works; smaller ones get malloc's alignment anyway. */
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    void *ptr = track_block(size, alignment < MIN_ALIGN ? MIN_ALIGN : alignment,
+                            LEAK_TRACKER_KIND_MALLOC, site);
+    if (ptr && TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_MALLOC, LEAK_TRACKER_KIND_MALLOC, site, size, alignment,
+                    ptr, NULL);
+    }
+    return ptr;
+}
+
+void* debug_aligned_alloc(size_t alignment, size_t size, const char *file, int line) {
+    return aligned_block(alignment, size, site_index(file, line));
+}
+
+void* debug_aligned_alloc_site(size_t alignment, size_t size, LeakTrackerSite *site) {
+    return aligned_block(alignment, size, site_of(site));
+}
+
+static int memalign_block(void **out, size_t alignment, size_t size, unsigned site) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *ptr = track_block(size, alignment < MIN_ALIGN ? MIN_ALIGN : alignment,
+                            LEAK_TRACKER_KIND_MALLOC, site);
+    if (!ptr) return ENOMEM;
+    if (TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_MALLOC, LEAK_TRACKER_KIND_MALLOC, site, size, alignment,
+                    ptr, NULL);
+    }
+    *out = ptr;
+    return 0;
+}
+
+int debug_posix_memalign(void **out, size_t alignment, size_t size, const char *file, int line) {
+    return memalign_block(out, alignment, size, site_index(file, line));
+}
+
+int debug_posix_memalign_site(void **out, size_t alignment, size_t size, LeakTrackerSite *site) {
+    return memalign_block(out, alignment, size, site_of(site));
+}
+
+void* debug_new(size_t size, size_t alignment, int kind, const char *file, int line) {
+    if (alignment & (alignment - 1)) return NULL;
+    unsigned site = site_index(file, line);
+    void *ptr = track_block(size, alignment < MIN_ALIGN ? MIN_ALIGN : alignment, kind, site);
+    if (ptr && TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_MALLOC, kind, site, size, alignment, ptr, NULL);
+    }
+    return ptr;
+}
+
+/* calloc at 'site'; file and line are only for the overflow report */
+static void* calloc_block(size_t count, size_t size, unsigned site, const char *file, int line) {
+    /* Check for overflow in multiplication: count * size */
+    if (count && size > (size_t)(-1) / count) {
+        diag_report(DIAG_CALLOC_OVERFLOW, NULL, file, line);
+        return NULL;
+    }
+    size_t total = count * size;
+    /* relies on track_block's boundary checks */
+    void *ptr = track_block(total, MIN_ALIGN, LEAK_TRACKER_KIND_MALLOC, site);
+    if (ptr) {
+        memset(ptr, 0, total);
+        if (TRACE_ON()) {
+            trace_event(LEAK_TRACKER_TRACE_CALLOC, LEAK_TRACKER_KIND_MALLOC, site, total, 0,
+                        ptr, NULL);
+        }
+    }
+    return ptr;
+}
+
+void* debug_calloc(size_t count, size_t size, const char *file, int line) {
+    return calloc_block(count, size, site_index(file, line), file, line);
+}
+
+void* debug_calloc_site(size_t count, size_t size, LeakTrackerSite *site) {
+    return calloc_block(count, size, site_of(site), site->file, site->line);
+}
+
+static void free_block(void *ptr, size_t size, int kind, const char *file, int line);
+
+/* realloc from call site 'site' (file and line are for reports) */
+static void* realloc_block(void *oldPtr, size_t newSize, unsigned site, const char *file, int line) {
+    /* If oldPtr is NULL, this is basically malloc. */
+    if (!oldPtr) {
+        return track_block(newSize, MIN_ALIGN, LEAK_TRACKER_KIND_MALLOC, site);
+    }
+    /* If newSize == 0, this is basically free. */
+    if (newSize == 0) {
+        free_block(oldPtr, 0, LEAK_TRACKER_KIND_MALLOC, file, line);
+        return NULL;
+    }
+    /* Sampled out: never tracked, so no lock and no lookup. */
+    if (g_filterOn && !filter_maybe(oldPtr)) {
+        return realloc(oldPtr, newSize);
+    }
+
+    ENSURE_INIT();
+    ThreadState *ts = thread_state();
+    size_t oldSize;
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (BATCHING_ON() && ts) {
+        /* Still pending on this thread: resize it without touching a shard. */
+        LOCK_CACHE(ts);
+        Allocation **pp = pending_find(ts, oldPtr);
+        if (pp) {
+            Allocation *cur = *pp;
+            if (!check_header(cur, oldPtr)) {
+                UNLOCK_CACHE(ts);
+                return NULL;
+            }
+            if (cur->kind != LEAK_TRACKER_KIND_MALLOC) {
+                diag_report(DIAG_MISMATCHED_FREE, oldPtr, file, line);
+            }
+            oldSize = cur->requestedSize;
+            if (POLICY_REFUSES(site, cur->site, newSize > oldSize ? newSize - oldSize : 0, ts)) {
+                UNLOCK_CACHE(ts);
+                return NULL;
+            }
+            void *oldRealPtr = rec_real(cur);
+            size_t oldOverhead, oldSlack;
+            rec_cost(cur, &oldOverhead, &oldSlack);
+            Allocation *old   = cur;
+            unsigned    epoch = epoch_detach(cur);
+            cur = resize_record(cur, newSize);
+            if (epoch) epoch_attach(cur ? cur : old, epoch);
+            if (!cur) {
+                UNLOCK_CACHE(ts);
+                return NULL;
+            }
+            site_realloc(site, cur, oldSize, oldRealPtr);
+            *pp = cur;
+            sample_resized(ts, cur, oldPtr, oldSize);
+            site_resize(cur, oldSize, oldOverhead, oldSlack);
+            if (newSize > oldSize) hist_add(ts, HIST_GROWTH, newSize - oldSize);
+            UNLOCK_CACHE(ts);
+            stats_update(newSize - oldSize, 0, newSize > oldSize ? newSize - oldSize : 0);
+            return cur->userPtr;
+        }
+        UNLOCK_CACHE(ts);
+    }
+#endif
+
+    Shard *s = shard_for(oldPtr);
+    LOCK_SHARD(s);
+    AllocTable *table;
+    AllocSlot  *slot = find_allocation_slot(s, oldPtr, &table);
+    if (!slot && BATCHING_ON()) {
+        /* Maybe still pending on another thread. */
+        UNLOCK_SHARD(s);
+        flush_all_caches();
+        LOCK_SHARD(s);
+        slot = find_allocation_slot(s, oldPtr, &table);
+    }
+    if (!slot && was_pointer_freed(s, oldPtr)) {
+        /* Its real block starts before oldPtr, or is gone: don't hand it on. */
+        diag_report(DIAG_REALLOC_FREED, oldPtr, file, line);
+        UNLOCK_SHARD(s);
+        return NULL;
+    }
+    if (!slot && was_forgotten(s, oldPtr)) {
+        /* Dropped by a teardown: its real pointer is lost. */
+        UNLOCK_SHARD(s);
+        return NULL;
+    }
+    if (!slot) {
+        /* Not an allocation we know about -> real realloc fallback. */
+        if (!g_filterOn) diag_report(DIAG_REALLOC_UNKNOWN, oldPtr, file, line);
+        UNLOCK_SHARD(s);
+        return realloc(oldPtr, newSize);
+    }
+
+    Allocation *cur = slot->alloc;
+    if (!check_header(cur, oldPtr)) {
+        /* Size and bounds are unknown: refuse rather than corrupt more. */
+        UNLOCK_SHARD(s);
+        return NULL;
+    }
+    if (cur->kind != LEAK_TRACKER_KIND_MALLOC) {
+        diag_report(DIAG_MISMATCHED_FREE, oldPtr, file, line);
+    }
+
+    /* Store the old requested size BEFORE we overwrite it. */
+    oldSize = cur->requestedSize;
+    if (POLICY_REFUSES(site, cur->site, newSize > oldSize ? newSize - oldSize : 0, ts)) {
+        UNLOCK_SHARD(s);
+        return NULL;
+    }
+    void *oldRealPtr = rec_real(cur);
+    size_t oldOverhead, oldSlack;
+    rec_cost(cur, &oldOverhead, &oldSlack);
+
+    /* Unlinked meanwhile: an inline header moves with the block. */
+    Allocation *old   = cur;
+    unsigned    epoch = epoch_detach(cur);
+    cur = resize_record(cur, newSize);
+    if (epoch) epoch_attach(cur ? cur : old, epoch);
+    if (!cur) {
+        UNLOCK_SHARD(s);
+        return NULL;
+    }
+    site_realloc(site, cur, oldSize, oldRealPtr);
+
+    /* The block may have moved, so re-key the record. */
+    table_remove_slot(table, slot);
+    sample_resized(ts, cur, oldPtr, oldSize);
+    site_resize(cur, oldSize, oldOverhead, oldSlack);
+    if (newSize > oldSize) hist_add(ts, HIST_GROWTH, newSize - oldSize);
+
+    /* A moved block may belong to another shard now. */
+    void  *newPtr = cur->userPtr;
+    Shard *dest   = shard_for(newPtr);
+    if (dest != s) {
+        UNLOCK_SHARD(s);
+        LOCK_SHARD(dest);
+    }
+    if (!insert_allocation(dest, cur)) {
+        /*
+         * No room to keep tracking it, and the old block is gone already:
+         * hand the data back in a plain block of the system allocator.
+         */
+        UNLOCK_SHARD(dest);
+        est_update(ts, rec_weight(cur), newSize, -1);
+        site_free(cur);
+        if (g_filterOn) filter_remove(newPtr);
+        epoch_detach(cur);
+        void  *realPtr = rec_real(cur);
+        size_t pages   = rec_pages(cur);
+        free_record(ts, cur);
+        stats_update((size_t)0 - oldSize, (size_t)-1, 0);
+        newPtr = untrack_block(realPtr, pages, newPtr, newSize);
+        diag_report(DIAG_REALLOC_UNTRACKED, newPtr, file, line);
+        return newPtr;
+    }
+    UNLOCK_SHARD(dest);
+
+    /*
+     * Correctly update usage stats:
+     *   1) Subtract the old requested size
+     *   2) Add the new size
+     * and the cumulative total if we expanded.
+     */
+    stats_update(newSize - oldSize, 0, newSize > oldSize ? newSize - oldSize : 0);
+
+    return newPtr;
+}
+
+/*
+ * Free a block that must have been allocated as 'kind'; size is what a
+ * sized delete passed (0 = unknown)
+ */
+static void free_block(void *ptr, size_t size, int kind, const char *file, int line) {
+    if (!ptr) return; /* free(NULL) no-op */
+    if (TRACE_ON()) trace_event(LEAK_TRACKER_TRACE_FREE, kind, 0, 0, 0, ptr, NULL);
+
+    /* Sampled out: never tracked, so no lock and no lookup. */
+    if (g_filterOn && !filter_maybe(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    ENSURE_INIT();
+    ThreadState *ts = thread_state();
+    Shard       *s  = shard_for(ptr);
+    Allocation  *cur = NULL;
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (BATCHING_ON() && ts) {
+        /* Freed before it was ever published: just drop it from the batch. */
+        LOCK_CACHE(ts);
+        Allocation **pp = pending_find(ts, ptr);
+        if (pp) {
+            cur = *pp;
+            *pp = ts->pending[--ts->pendingCount];
+        }
+        UNLOCK_CACHE(ts);
+    }
+#endif
+
+    LOCK_SHARD(s);
+    if (!cur) {
+        cur = remove_allocation(s, ptr);
+    }
+    if (!cur && BATCHING_ON()) {
+        /* Maybe still pending on another thread. */
+        UNLOCK_SHARD(s);
+        flush_all_caches();
+        LOCK_SHARD(s);
+        cur = remove_allocation(s, ptr);
+    }
+    if (!cur) {
+        if (was_pointer_freed(s, ptr)) {
+            /* Double-free check */
+            diag_report(DIAG_DOUBLE_FREE, ptr, file, line);
+            UNLOCK_SHARD(s);
+            return;
+        }
+        if (was_forgotten(s, ptr)) {
+            /* Dropped by a teardown: its real pointer is lost. */
+            UNLOCK_SHARD(s);
+            return;
+        }
+        /* Unknown pointer -> free it anyway, but can't track stats. */
+        if (!g_filterOn) diag_report(DIAG_FREE_UNKNOWN, ptr, file, line);
+        UNLOCK_SHARD(s);
+        free(ptr);
+        return;
+    }
+
+    if (header_valid(cur, ptr)) {
+        if (cur->kind != kind) {
+            diag_report(DIAG_MISMATCHED_FREE, ptr, file, line);
+        } else if (size && size != cur->requestedSize) {
+            diag_report(DIAG_SIZE_MISMATCH, ptr, file, line);
+        }
+    }
+    size = release_block(ts, s, cur, ptr);
+    UNLOCK_SHARD(s);
+
+    /* Update usage stats. */
+    stats_update((size_t)0 - size, (size_t)-1, 0);
+}
+
+/* realloc(p, 0) frees, and free_block() traces that itself */
+static void* traced_realloc(void *oldPtr, size_t newSize, unsigned site, const char *file, int line) {
+    void *ptr = realloc_block(oldPtr, newSize, site, file, line);
+    if (ptr && TRACE_ON()) {
+        trace_event(LEAK_TRACKER_TRACE_REALLOC, LEAK_TRACKER_KIND_MALLOC, site, newSize, 0,
+                    ptr, oldPtr);
+    }
+    return ptr;
+}
+
+void* debug_realloc(void *oldPtr, size_t newSize, const char *file, int line) {
+    return traced_realloc(oldPtr, newSize, site_index(file, line), file, line);
+}
+
+void* debug_realloc_site(void *oldPtr, size_t newSize, LeakTrackerSite *site) {
+    return traced_realloc(oldPtr, newSize, site_of(site), site->file, site->line);
+}
+
+void debug_free(void *ptr, const char *file, int line) {
+    free_block(ptr, 0, LEAK_TRACKER_KIND_MALLOC, file, line);
+}
+
+void debug_free_site(void *ptr, LeakTrackerSite *site) {
+    free_block(ptr, 0, LEAK_TRACKER_KIND_MALLOC, site->file, site->line);
+}
+
+void debug_delete(void *ptr, size_t size, int kind, const char *file, int line) {
+    free_block(ptr, size, kind, file, line);
+}
+
+/* Labels of LEAK_TRACKER_REACH_* in reports */
+static const char *const REACH_NAMES[] = {
+    "", "still reachable", "indirectly lost", "definitely lost"
+};
+
+void log_memory_leaks(FILE *out) {
+    ENSURE_INIT();
+    /* Diagnostics first, so the report reads in order. */
+    leak_tracker_drain(stderr);
+    flush_all_caches();
+    size_t live = 0;
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        LOCK_SHARD(&g_shards[i]);
+        live += g_shards[i].table.count + g_shards[i].oldTable.count;
+        UNLOCK_SHARD(&g_shards[i]);
+    }
+    if (!live) {
+        fprintf(out, "\n==== Memory Leak Check ====\nNo memory leaks detected.\n");
+        return;
+    }
+    fprintf(out, "\n==== Memory Leak Check ====\nPotential leaks:\n");
+    fprintf(out, "----------------------------------------------------\n");
+    fprintf(out, "  Pointer            Size     Location\n");
+    fprintf(out, "----------------------------------------------------\n");
+
+    /* One shard at a time, so other threads keep allocating meanwhile. */
+    double estBytes = 0.0, estBlocks = 0.0, estVar = 0.0;
+    int sampled = 0;
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        Shard *s = &g_shards[i];
+        LOCK_SHARD(s);
+        size_t cursor = 0;
+        Allocation *cur;
+        while ((cur = next_allocation(s, &cursor)) != NULL) {
+            if (cur->reach) {
+                fprintf(out, "  %p   %6zu   %s:%d  (%s)\n",
+                        cur->userPtr, (size_t)cur->requestedSize, g_siteStats[cur->site].file,
+                        g_siteStats[cur->site].line, REACH_NAMES[cur->reach]);
+            } else {
+                fprintf(out,
+                    "  %p   %6zu   %s:%d\n",
+                    cur->userPtr, (size_t)cur->requestedSize, g_siteStats[cur->site].file,
+                    g_siteStats[cur->site].line);
+            }
+            stack_print(out, rec_stack(cur));
+            double w    = rec_weight(cur) != 0.0 ? rec_weight(cur) : 1.0;
+            double size = (double)cur->requestedSize;
+            estBytes  += w * size;
+            estBlocks += w;
+            estVar    += (w * w - w) * size * size;
+            sampled   |= rec_weight(cur) != 0.0;
+        }
+        UNLOCK_SHARD(s);
+    }
+    if (sampled) {
+        /* Each sampled entry stands for 1/p similar blocks. */
+        fprintf(out, "----------------------------------------------------\n");
+        fprintf(out, "  Sampled: ~%.0f bytes in ~%.0f blocks estimated (+/- %llu bytes)\n",
+                estBytes, estBlocks, 2 * isqrt((unsigned long long)estVar));
+    }
+}
+
+void log_memory_stats(FILE *out) {
+    MemStats st;
+    ENSURE_INIT();
+    collect_stats(&st);
+    fprintf(out, "\n==== Memory Statistics ====\n");
+    fprintf(out, "  Current In-Use:  %zu bytes\n", st.currentAllocated);
+    fprintf(out, "  Total Allocated: %zu bytes (cumulative)\n", st.totalAllocated);
+    fprintf(out, "  Peak In-Use:     %zu bytes\n", st.peakAllocated);
+    fprintf(out, "  Active Blocks:   %zu\n", st.allocationCount);
+    fprintf(out, "  Tracker Memory:  %zu bytes (metadata)\n", st.trackerOverhead);
+    fprintf(out, "  Block Footprint: %zu bytes (%zu guards and padding, %zu allocator slack)\n",
+            st.usableBytes, st.overheadBytes, st.slackBytes);
+    if (st.sampleInterval || st.estimatedBytes != st.currentAllocated) {
+        fprintf(out, "  Sampling:        1 per %zu bytes\n", st.sampleInterval);
+        fprintf(out, "  Est. In-Use:     %zu bytes +/- %zu (%zu blocks)\n",
+                st.estimatedBytes, st.estimatedError, st.estimatedBlocks);
+    }
+}
+
+void get_memory_stats(MemStats *statsOut) {
+    if (!statsOut) return;
+    ENSURE_INIT();
+    collect_stats(statsOut);
+}
+
+int leak_tracker_export(int format, LeakTrackerSink sink, void *ctx) {
+    ExportWriter w;
+    MemStats st;
+    if (!sink || (format != LEAK_TRACKER_JSON && format != LEAK_TRACKER_BINARY)) return -1;
+    ENSURE_INIT();
+    flush_all_caches();
+    w.format = format;
+    w.sink   = sink;
+    w.ctx    = ctx;
+    w.error  = 0;
+    w.len    = 0;
+    memset(w.sent, 0, sizeof(w.sent));
+
+    collect_stats(&st);
+    export_stats(&w, &st);
+
+    /* One shard at a time, like log_memory_leaks. */
+    size_t blocks = 0;
+    for (size_t i = 0; i < SHARD_COUNT && !w.error; i++) {
+        Shard *s = &g_shards[i];
+        LOCK_SHARD(s);
+        size_t cursor = 0;
+        Allocation *cur;
+        while (!w.error && (cur = next_allocation(s, &cursor)) != NULL) {
+            unsigned long long weight = (unsigned long long)(rec_weight(cur) * 65536.0 + 0.5);
+            export_block(&w, (unsigned long long)(uintptr_t)cur->userPtr, cur->requestedSize,
+                         rec_align(cur), cur->site, g_siteStats[cur->site].file,
+                         g_siteStats[cur->site].line, weight);
+            blocks++;
+        }
+        UNLOCK_SHARD(s);
+    }
+    export_end(&w, blocks);
+    return w.error ? -1 : 0;
+}
+
+int leak_tracker_export_fd(int format, int fd) {
+#ifdef HAVE_MMAP
+    return leak_tracker_export(format, export_fd_sink, &fd);
+#else
+    (void)format;
+    (void)fd;
+    return -1;
+#endif
+}
+
+int leak_tracker_decode(FILE *in, LeakTrackerSink sink, void *ctx) {
+    ExportWriter w;
+    char   magic[8];
+    char **names = NULL;
+    int   *lines = NULL;
+    size_t siteCap = 0;
+    int    rc = -1;
+    if (!in || !sink) return -1;
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, EXPORT_MAGIC, 7) != 0) return -1;
+    unsigned char version = (unsigned char)magic[7];
+    if (version < 1 || version > EXPORT_VERSION) return -1;
+    size_t nstats = version == 1 ? EXPORT_STATS_V1 : EXPORT_STATS_N;
+    w.format = LEAK_TRACKER_JSON;
+    w.sink   = sink;
+    w.ctx    = ctx;
+    w.error  = 0;
+    w.len    = 0;
+
+    int tag;
+    while (!w.error && (tag = fgetc(in)) != EOF) {
+        unsigned long long v[EXPORT_STATS_N];
+        if (tag == EXPORT_STATS) {
+            MemStats st;
+            for (size_t i = 0; i < nstats; i++) {
+                if (import_varint(in, &v[i])) goto done;
+            }
+            if (nstats == EXPORT_STATS_V1) {
+                /* No footprint fields yet: they read as 0. */
+                memmove(&v[8], &v[5], 4 * sizeof(v[0]));
+                v[5] = v[6] = v[7] = 0;
+            }
+            st.totalAllocated   = (size_t)v[0];
+            st.currentAllocated = (size_t)v[1];
+            st.peakAllocated    = (size_t)v[2];
+            st.allocationCount  = (size_t)v[3];
+            st.trackerOverhead  = (size_t)v[4];
+            st.overheadBytes    = (size_t)v[5];
+            st.slackBytes       = (size_t)v[6];
+            st.usableBytes      = (size_t)v[7];
+            st.sampleInterval   = (size_t)v[8];
+            st.estimatedBytes   = (size_t)v[9];
+            st.estimatedBlocks  = (size_t)v[10];
+            st.estimatedError   = (size_t)v[11];
+            export_stats(&w, &st);
+        } else if (tag == EXPORT_SITE) {
+            if (import_varint(in, &v[0]) || import_varint(in, &v[1]) ||
+                import_varint(in, &v[2]) || v[0] >= (1u << 24) || v[2] > 65536) goto done;
+            if (v[0] >= siteCap) {
+                size_t cap = siteCap ? siteCap : 64;
+                while (cap <= v[0]) cap *= 2;
+                char **n = (char**)realloc(names, cap * sizeof(char*));
+                if (!n) goto done;
+                names = n;
+                int *l = (int*)realloc(lines, cap * sizeof(int));
+                if (!l) goto done;
+                lines = l;
+                memset(names + siteCap, 0, (cap - siteCap) * sizeof(char*));
+                siteCap = cap;
+            }
+            char *name = (char*)malloc((size_t)v[2] + 1);
+            if (!name) goto done;
+            if (fread(name, 1, (size_t)v[2], in) != (size_t)v[2]) {
+                free(name);
+                goto done;
+            }
+            name[v[2]] = '\0';
+            free(names[v[0]]);
+            names[v[0]] = name;
+            lines[v[0]] = (int)v[1];
+        } else if (tag == EXPORT_BLOCK) {
+            for (size_t i = 0; i < 5; i++) {
+                if (import_varint(in, &v[i])) goto done;
+            }
+            if (v[3] >= siteCap || !names[v[3]]) goto done; /* site never described */
+            export_block(&w, v[0], (size_t)v[1], (size_t)v[2], (unsigned)v[3],
+                         names[v[3]], lines[v[3]], v[4]);
+        } else if (tag == EXPORT_END) {
+            if (import_varint(in, &v[0])) goto done;
+            export_end(&w, (size_t)v[0]);
+            rc = w.error ? -1 : 0;
+            break;
+        } else {
+            goto done; /* unknown record */
+        }
+    }
+
+done:
+    export_flush(&w);
+    for (size_t i = 0; i < siteCap; i++) free(names[i]);
+    free(names);
+    free(lines);
+    return rc;
+}
+
+int leak_tracker_trace_start(const char *path, size_t chunkBytes) {
+#ifdef HAVE_MMAP
+    if (!path) return -1;
+    ENSURE_INIT();
+    if (!g_pageSize) g_pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = chunkBytes ? chunkBytes : TRACE_CHUNK_DEFAULT;
+    if (size < 4 * g_pageSize) size = 4 * g_pageSize;
+    size = (size + g_pageSize - 1) & ~(g_pageSize - 1);
+
+    LOCK_TRACE();
+    if (atomic_load_explicit(&g_traceOn, memory_order_relaxed)) {
+        UNLOCK_TRACE();
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        UNLOCK_TRACE();
+        return -1;
+    }
+    TraceHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, 8);
+    h.chunkSize      = size;
+    h.dataOffset     = g_pageSize;
+    h.startTicks     = now_ticks();
+    h.ticksPerSecond = 0.0;
+    if (pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        close(fd);
+        UNLOCK_TRACE();
+        return -1;
+    }
+    g_traceFd         = fd;
+    g_traceChunkSize  = size;
+    g_traceDataOffset = g_pageSize;
+    g_traceChunks     = 0;
+    if (++g_traceGen == 0) g_traceGen = 1;
+    atomic_store_explicit(&g_traceOn, g_traceGen, memory_order_release);
+    UNLOCK_TRACE();
+    return 0;
+#else
+    (void)path;
+    (void)chunkBytes;
+    return -1;
+#endif
+}
+
+void leak_tracker_trace_stop(void) {
+#ifdef HAVE_MMAP
+    LOCK_TRACE();
+    if (!atomic_load_explicit(&g_traceOn, memory_order_relaxed)) {
+        UNLOCK_TRACE();
+        return;
+    }
+    /*
+     * New chunks are refused from here on. Threads still writing to the one
+     * they have keep a valid mapping; each unmaps it on its next event.
+     */
+    atomic_store_explicit(&g_traceOn, 0, memory_order_relaxed);
+
+    /* The site table goes after the last chunk. */
+    TraceHeader h;
+    int fd = g_traceFd;
+    off_t sites = (off_t)(g_traceDataOffset + g_traceChunks * g_traceChunkSize);
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+        lseek(fd, sites, SEEK_SET) == sites) {
+        ExportWriter w;
+        w.format = LEAK_TRACKER_BINARY;
+        w.sink   = export_fd_sink;
+        w.ctx    = &fd;
+        w.error  = 0;
+        w.len    = 0;
+        unsigned count = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+        export_varint(&w, count);
+        for (unsigned i = 0; i < count; i++) {
+            size_t len = strlen(g_siteStats[i].file);
+            export_varint(&w, (unsigned)g_siteStats[i].line);
+            export_varint(&w, len);
+            export_bytes(&w, g_siteStats[i].file, len);
+        }
+        export_flush(&w);
+        if (!w.error) {
+            h.ticksPerSecond = ticks_per_second();
+            h.sites          = (unsigned long long)sites;
+            (void)!pwrite(fd, &h, sizeof(h), 0);
+        }
+    }
+    close(fd);
+    g_traceFd = -1;
+    UNLOCK_TRACE();
+#endif
+}
+
+int leak_tracker_trace_read(const char *path, LeakTraceCallback cb, void *ctx) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    TraceSites  sites = { NULL, NULL, 0 };
+    TraceCursor *cs   = NULL;
+    size_t     *heap  = NULL;
+    int rc = -1;
+    if (!path || !cb) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t fileSize = (size_t)st.st_size;
+    const unsigned char *map = (const unsigned char*)mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    TraceHeader h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, TRACE_MAGIC, 8) != 0 || h.chunkSize < sizeof(TraceChunkHeader) ||
+        h.dataOffset < sizeof(h) || h.dataOffset > fileSize) goto done;
+    size_t dataEnd = h.sites && h.sites >= h.dataOffset && h.sites <= fileSize
+                   ? (size_t)h.sites : fileSize;
+    if (h.sites && dataEnd == (size_t)h.sites &&
+        trace_load_sites(map + dataEnd, map + fileSize, &sites) != 0) {
+        /* Damaged table: go on without names. */
+        for (size_t i = 0; i < sites.count; i++) free(sites.names[i]);
+        free(sites.names);
+        free(sites.lines);
+        memset(&sites, 0, sizeof(sites));
+    }
+
+    /* One cursor per chunk that has events, merged through a binary heap. */
+    size_t chunks = (dataEnd - (size_t)h.dataOffset) / (size_t)h.chunkSize;
+    cs   = (TraceCursor*)calloc(chunks ? chunks : 1, sizeof(TraceCursor));
+    heap = (size_t*)malloc((chunks ? chunks : 1) * sizeof(size_t));
+    if (!cs || !heap) goto done;
+    size_t n = 0;
+    for (size_t i = 0; i < chunks; i++) {
+        const unsigned char *base = map + h.dataOffset + i * h.chunkSize;
+        TraceChunkHeader ch;
+        memcpy(&ch, base, sizeof(ch));
+        if (ch.magic != TRACE_CHUNK_MAGIC || ch.used < sizeof(ch) || ch.used > h.chunkSize) continue;
+        TraceCursor *c = &cs[i];
+        c->p      = base + sizeof(ch);
+        c->end    = base + ch.used;
+        c->ticks  = ch.startTicks;
+        c->thread = ch.thread;
+        if (trace_next(c, &sites)) heap[n++] = i;
+    }
+    for (size_t i = n / 2; i-- > 0;) trace_sift(cs, heap, n, i);
+
+    double nsPerTick = h.ticksPerSecond > 0 ? 1e9 / h.ticksPerSecond : 1.0;
+    rc = 0;
+    while (n) {
+        TraceCursor *c = &cs[heap[0]];
+        c->ev.ns = c->ticks > h.startTicks
+                 ? (unsigned long long)((double)(c->ticks - h.startTicks) * nsPerTick) : 0;
+        rc = cb(ctx, &c->ev);
+        if (rc) break;
+        if (!trace_next(c, &sites)) heap[0] = heap[--n];
+        trace_sift(cs, heap, n, 0);
+    }
+
+done:
+    munmap((void*)map, fileSize);
+    for (size_t i = 0; i < sites.count; i++) free(sites.names[i]);
+    free(sites.names);
+    free(sites.lines);
+    free(cs);
+    free(heap);
+    return rc;
+#else
+    (void)path;
+    (void)cb;
+    (void)ctx;
+    return -1;
+#endif
+}
+
+/*
+ * Helper threads for the parallel walks over the shards. Threads are
+ * created by workers_start() and joined by workers_stop(), both with no
+ * tracker lock held: creating or reaping a thread allocates and frees (in
+ * the preload build through us). workers_start() returns how many jobs
+ * will run at once (the caller counts as one; fewer than asked if threads
+ * are unavailable), and the caller splits the work into that many. In
+ * between, workers_run() may be called under the shard locks: it runs fn
+ * on each of jobs[0..n) (jobSize bytes apart), job 0 on the calling
+ * thread, and waits for all of them.
+ */
+#define WORKERS_MAX 256
+
+typedef struct Workers Workers;
+
+typedef struct {
+    Workers *pool;
+    unsigned index;
+} WorkerSlot;
+
+struct Workers {
+    void          *(*fn)(void*);
+    unsigned char *jobs;
+    size_t         jobSize;
+    unsigned       threads;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    unsigned        round;   /* bumped by each workers_run() */
+    unsigned        running; /* helpers still in the current round */
+    int             quit;
+    pthread_t       ids[WORKERS_MAX];
+    WorkerSlot      slots[WORKERS_MAX];
+#endif
+};
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+static void* worker_main(void *arg) {
+    WorkerSlot *slot = (WorkerSlot*)arg;
+    Workers    *w    = slot->pool;
+    unsigned    seen = 0;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->round == seen && !w->quit) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if (w->quit) break;
+        seen = w->round;
+        pthread_mutex_unlock(&w->lock);
+        w->fn(w->jobs + slot->index * w->jobSize);
+        pthread_mutex_lock(&w->lock);
+        if (--w->running == 0) pthread_cond_broadcast(&w->wake);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+#endif
+
+static unsigned workers_start(Workers *w, void *jobs, size_t jobSize, unsigned threads) {
+    w->fn      = NULL;
+    w->jobs    = (unsigned char*)jobs;
+    w->jobSize = jobSize;
+    w->threads = 1;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    w->round   = 0;
+    w->running = 0;
+    w->quit    = 0;
+    if (!LOCKING_ON()) return 1; /* single-threaded mode: no helpers */
+    UNTRACKED_BEGIN();
+    for (unsigned t = 1; t < threads && t < WORKERS_MAX; t++) {
+        w->slots[t].pool  = w;
+        w->slots[t].index = t;
+        if (pthread_create(&w->ids[t], NULL, worker_main, &w->slots[t]) != 0) break;
+        w->threads++;
+    }
+    UNTRACKED_END();
+#else
+    (void)threads;
+#endif
+    return w->threads;
+}
+
+static void workers_run(Workers *w, void *(*fn)(void*)) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_lock(&w->lock);
+    w->fn      = fn;
+    w->running = w->threads - 1;
+    w->round++;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    fn(w->jobs);
+    pthread_mutex_lock(&w->lock);
+    while (w->running) {
+        pthread_cond_wait(&w->wake, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+#else
+    fn(w->jobs);
+#endif
+}
+
+static void workers_stop(Workers *w) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    UNTRACKED_BEGIN();
+    for (unsigned t = 1; t < w->threads; t++) {
+        pthread_join(w->ids[t], NULL);
+    }
+    UNTRACKED_END();
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+#else
+    (void)w;
+#endif
+}
+
+#define TEARDOWN_BATCH 32 /* records fetched ahead by a teardown worker */
+
+/* Shards first, first + step, ... torn down by one teardown worker */
+typedef struct {
+    size_t first;
+    size_t step;
+    int    mode;
+} TeardownJob;
+
+/* Add a slab unit to a chain that goes back to the depot in one go */
+static void chain_unit(SlabRecord **head, SlabRecord **tail, void *unit) {
+    SlabRecord *r = (SlabRecord*)unit;
+    r->next = *head;
+    *head   = r;
+    if (!*tail) *tail = r;
+}
+
+/* Release what the shards hold; all of them are locked by the caller */
+static void* teardown_worker(void *arg) {
+    TeardownJob *job   = (TeardownJob*)arg;
+    SlabRecord  *units = NULL, *last = NULL;
+    for (size_t i = job->first; i < SHARD_COUNT; i += job->step) {
+        Shard *s = &g_shards[i];
+        /* Forgotten blocks join the shard's list, so their frees are known. */
+        void **forgotten = NULL;
+        size_t kept      = s->table.count + s->oldTable.count;
+        if (job->mode == LEAK_TRACKER_TEARDOWN_FORGET && kept && !s->forgetAll) {
+            kept += s->forgottenCount;
+            forgotten = (void**)tracker_alloc(&s->trackerBytes, kept * sizeof(void*));
+            if (forgotten) {
+                if (s->forgottenCount) {
+                    memcpy(forgotten, s->forgotten, s->forgottenCount * sizeof(void*));
+                }
+                kept = s->forgottenCount;
+            } else {
+                s->forgetAll = 1;
+            }
+        }
+        /*
+         * Records and blocks come in hash order, i.e. scattered: fetch a
+         * batch of records, then their blocks, before touching any of them.
+         */
+        size_t cursor = 0;
+        size_t n;
+        do {
+            Allocation *batch[TEARDOWN_BATCH];
+            void       *real[TEARDOWN_BATCH];
+            for (n = 0; n < TEARDOWN_BATCH; n++) {
+                if ((batch[n] = next_allocation(s, &cursor)) == NULL) break;
+                PREFETCH(batch[n]);
+            }
+            for (size_t j = 0; j < n; j++) {
+                real[j] = rec_real(batch[j]);
+                PREFETCH(real[j]);
+            }
+            for (size_t j = 0; j < n; j++) {
+                size_t pages = rec_pages(batch[j]);
+                if (forgotten) forgotten[kept++] = batch[j]->userPtr;
+                if (batch[j]->extra) chain_unit(&units, &last, batch[j]->extra);
+                if (job->mode == LEAK_TRACKER_TEARDOWN_FREE) release_real(real[j], pages);
+#ifndef LEAK_TRACKER_INLINE_HEADER
+                chain_unit(&units, &last, batch[j]);
+#endif
+            }
+        } while (n == TEARDOWN_BATCH);
+        if (forgotten) {
+            qsort(forgotten, kept, sizeof(void*), ptr_cmp);
+            tracker_free(&s->trackerBytes, s->forgotten, s->forgottenCount * sizeof(void*));
+            s->forgotten      = forgotten;
+            s->forgottenCount = kept;
+        }
+        tracker_free(&s->trackerBytes, s->table.slots, s->table.capacity * sizeof(AllocSlot));
+        tracker_free(&s->trackerBytes, s->oldTable.slots, s->oldTable.capacity * sizeof(AllocSlot));
+        memset(&s->table, 0, sizeof(s->table));
+        s->oldTable       = s->table;
+        s->migrateCursor  = 0;
+        s->teardownCursor = 0;
+        /* Quarantine can be cleared as well */
+        quarantine_clear(s);
+    }
+    if (units) {
+        LOCK_DEPOT();
+        last->next = g_depotRecords;
+        g_depotRecords = units;
+        UNLOCK_DEPOT();
+    }
+    return NULL;
+}
+
+void leak_tracker_teardown(int mode, unsigned threads) {
+    TeardownJob jobs[SHARD_COUNT];
+    ENSURE_INIT();
+    Workers     workers;
+    if (mode != LEAK_TRACKER_TEARDOWN_FORGET) mode = LEAK_TRACKER_TEARDOWN_FREE;
+    if (threads == 0 || threads > SHARD_COUNT) threads = SHARD_COUNT;
+    flush_all_caches();
+    threads = workers_start(&workers, jobs, sizeof(jobs[0]), threads);
+    for (unsigned t = 0; t < threads; t++) {
+        jobs[t].first = t;
+        jobs[t].step  = threads;
+        jobs[t].mode  = mode;
+    }
+    lock_all_shards();
+    /* The shard locks stay with us; each worker owns its shards for the round. */
+    workers_run(&workers, teardown_worker);
+    for (size_t i = 0; i < EPOCH_MAX; i++) {
+        /* Their records are gone with the blocks: just empty the lists. */
+        Epoch *e = &g_epochs[i];
+        LOCK_EPOCH(e);
+        e->head      = NULL;
+        e->liveCount = 0;
+        e->liveBytes = 0;
+        UNLOCK_EPOCH(e);
+    }
+    /* The records are back in the depot: drop the slabs that are all free. */
+    release_free_slabs();
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        atomic_store_explicit(&g_siteStats[i].liveCount, 0, memory_order_relaxed);
+        atomic_store_explicit(&g_siteStats[i].liveBytes, 0, memory_order_relaxed);
+        atomic_store_explicit(&g_siteStats[i].liveOverhead, 0, memory_order_relaxed);
+        atomic_store_explicit(&g_siteStats[i].liveSlack, 0, memory_order_relaxed);
+    }
+    /* After FORGET keep the filter: frees of forgotten blocks must reach a shard. */
+    if (mode == LEAK_TRACKER_TEARDOWN_FREE && g_filterOn) {
+        for (size_t i = 0; i < SAMPLE_FILTER_SIZE; i++) {
+            atomic_store_explicit(&g_sampleFilter[i], 0, memory_order_relaxed);
+        }
+    }
+
+    /*
+     * Zero the in-use counters without writing other threads' slots:
+     * offset the shared counters by whatever the slots currently hold.
+     */
+    MemStats st;
+    collect_stats(&st);
+    atomic_fetch_sub_explicit(&g_allocationCount, st.allocationCount, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&g_currentAllocated, st.currentAllocated, memory_order_relaxed);
+    unsigned long long est[3];
+    collect_estimates(est);
+    atomic_fetch_sub_explicit(&g_estExtraBytes, est[0], memory_order_relaxed);
+    atomic_fetch_sub_explicit(&g_estExtraBlocks, est[1], memory_order_relaxed);
+    atomic_fetch_sub_explicit(&g_estVariance, est[2], memory_order_relaxed);
+    unlock_all_shards();
+    workers_stop(&workers);
+}
+
+void free_all_tracked(void) {
+    leak_tracker_teardown(LEAK_TRACKER_TEARDOWN_FREE, 1);
+}
+
+/*
+ * Slots a teardown step may look at per block it is allowed to free, so
+ * a sparse table can't stretch the pause either
+ */
+#define TEARDOWN_SCAN_FACTOR 4
+
+size_t leak_tracker_teardown_step(size_t maxBlocks) {
+    ENSURE_INIT();
+    ThreadState *ts = thread_state();
+    if (BATCHING_ON()) flush_all_caches();
+    if (!maxBlocks) maxBlocks = 1;
+    size_t scan   = maxBlocks * TEARDOWN_SCAN_FACTOR + TABLE_MIN_CAPACITY;
+    size_t freed  = 0, bytes = 0;
+    unsigned first = atomic_load_explicit(&g_teardownShard, memory_order_relaxed);
+    for (unsigned n = 0; n < SHARD_COUNT && freed < maxBlocks && scan; n++) {
+        unsigned k = (first + n) % SHARD_COUNT;
+        Shard   *s = &g_shards[k];
+        LOCK_SHARD(s);
+        /* Finish a pending resize first (bounded too), then sweep the table. */
+        table_migrate(s, maxBlocks - freed);
+        AllocTable *t = &s->table;
+        while (freed < maxBlocks && scan && s->teardownCursor < t->capacity) {
+            AllocSlot *slot = &t->slots[s->teardownCursor];
+            scan--;
+            if (!slot->key) {
+                s->teardownCursor++;
+                continue;
+            }
+            /* Removing may shift a later entry into this slot, so stay put. */
+            Allocation *cur = slot->alloc;
+            table_remove_slot(t, slot);
+            /* The rest is what free() does: checks, quarantine, histogram. */
+            bytes += release_block(ts, s, cur, cur->userPtr);
+            freed++;
+        }
+        if (s->teardownCursor >= t->capacity) {
+            /* Swept; blocks added behind the cursor meanwhile wait for the next round. */
+            s->teardownCursor = 0;
+            atomic_store_explicit(&g_teardownShard, (k + 1) % SHARD_COUNT, memory_order_relaxed);
+        }
+        UNLOCK_SHARD(s);
+    }
+    if (freed) stats_update((size_t)0 - bytes, (size_t)0 - freed, 0);
+
+    size_t left = 0;
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        Shard *s = &g_shards[i];
+        LOCK_SHARD(s);
+        left += s->table.count + s->oldTable.count;
+        UNLOCK_SHARD(s);
+    }
+    return left;
+}
+
+void leak_tracker_set_guard_pages(size_t minSize, size_t maxSize, int sampledOnly) {
+#ifdef HAVE_MMAP
+    if (!g_pageSize) g_pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    g_pageMin         = minSize;
+    g_pageMax         = maxSize;
+    g_pageSampledOnly = sampledOnly;
+#else
+    (void)minSize;
+    (void)maxSize;
+    (void)sampledOnly;
+#endif
+}
+
+void leak_tracker_set_guard_size(size_t bytes) {
+    if (bytes < SENTINEL_SIZE) bytes = SENTINEL_SIZE;
+    if (bytes > SENTINEL_MAX)  bytes = SENTINEL_MAX;
+    g_guardSize = (bytes + SENTINEL_SIZE - 1) & ~(size_t)(SENTINEL_SIZE - 1);
+}
+
+/* Shards first, first + step, ... checked by one verify_heap worker */
+typedef struct {
+    size_t first;
+    size_t step;
+    size_t bad;
+} VerifyJob;
+
+static void* verify_worker(void *arg) {
+    VerifyJob *job = (VerifyJob*)arg;
+    for (size_t i = job->first; i < SHARD_COUNT; i += job->step) {
+        Shard *s = &g_shards[i];
+        LOCK_SHARD(s);
+        size_t cursor = 0;
+        Allocation *cur;
+        while ((cur = next_allocation(s, &cursor)) != NULL) {
+            if (!check_header(cur, cur->userPtr) || !check_sentinels(cur)) job->bad++;
+        }
+        UNLOCK_SHARD(s);
+    }
+    return NULL;
+}
+
+size_t leak_tracker_verify_heap(unsigned threads) {
+    VerifyJob jobs[SHARD_COUNT];
+    Workers   workers;
+    ENSURE_INIT();
+    flush_all_caches();
+    if (threads == 0 || threads > SHARD_COUNT) threads = SHARD_COUNT;
+    threads = workers_start(&workers, jobs, sizeof(jobs[0]), threads);
+    for (unsigned t = 0; t < threads; t++) {
+        jobs[t].first = t;
+        jobs[t].step  = threads;
+        jobs[t].bad   = 0;
+    }
+    /* Each shard is locked only while its own blocks are checked. */
+    workers_run(&workers, verify_worker);
+    workers_stop(&workers);
+    size_t bad = 0;
+    for (unsigned t = 0; t < threads; t++) {
+        bad += jobs[t].bad;
+    }
+    return bad;
+}
+
+/* ---- Reachability scan ---- */
+
+#ifdef HAVE_REACH_SCAN
+#define REACH_CHUNK ((size_t)256 * 1024) /* bytes of roots handed out at a time */
+#define REACH_SHARE 256                  /* records moved to the shared pool at once */
+#define REACH_ORIGIN 4                   /* mark of a lost block being scanned */
+
+typedef struct {
+    const uintptr_t *lo;
+    const uintptr_t *hi;
+} ReachRange;
+
+typedef struct {
+    Allocation **items;
+    size_t       count;
+    size_t       cap;
+} ReachStack;
+
+/*
+ * State of one scan. It lives on the heap, not on the scanning stack, so
+ * the user pointers it holds aren't taken for roots.
+ */
+typedef struct {
+    ReachRange     *roots;     /* chunks of at most REACH_CHUNK bytes */
+    size_t          rootCount;
+    size_t          rootCap;
+    _Atomic size_t  nextRoot;  /* next chunk to hand out */
+    atomic_uchar   *marks[SHARD_COUNT]; /* per slot of each table, 0 = not reached */
+    uintptr_t       lo;        /* lowest user pointer */
+    uintptr_t       span;      /* highest minus lowest */
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_t poolLock;  /* guards pool and idle */
+#endif
+    ReachStack      pool;      /* work shared between the markers */
+    _Atomic size_t  poolSize;  /* pool.count, for a look without the lock */
+    unsigned        idle;      /* markers waiting for work */
+    unsigned        workers;
+    atomic_int      failed;    /* out of memory: the labels would be wrong */
+} ReachScan;
+
+/* One scan worker: marks roots and blocks, then (first, first + step...) shards' lost blocks */
+typedef struct {
+    ReachScan  *scan;
+    ReachStack  stack;
+    size_t      first;
+    size_t      step;
+} ReachJob;
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+#define LOCK_POOL(sc)   pthread_mutex_lock(&(sc)->poolLock)
+#define UNLOCK_POOL(sc) pthread_mutex_unlock(&(sc)->poolLock)
+#else
+#define LOCK_POOL(sc)   ((void)(sc))
+#define UNLOCK_POOL(sc) ((void)(sc))
+#endif
+
+static int reach_push(ReachStack *st, Allocation *a) {
+    if (st->count == st->cap) {
+        size_t cap = st->cap ? 2 * st->cap : 1024;
+        Allocation **items = (Allocation**)realloc(st->items, cap * sizeof(Allocation*));
+        if (!items) return 0;
+        st->items = items;
+        st->cap   = cap;
+    }
+    st->items[st->count++] = a;
+    return 1;
+}
+
+/* If v is the start of a tracked block not reached yet, label it 'tag' and queue it */
+static inline void reach_visit(ReachJob *job, uintptr_t v, unsigned char tag) {
+    ReachScan *sc = job->scan;
+    if (v - sc->lo > sc->span || (v & (MIN_ALIGN - 1))) return;
+    Shard     *s    = shard_for((const void*)v);
+    AllocSlot *slot = table_find_slot(&s->table, (const void*)v);
+    if (!slot) return;
+    atomic_uchar *mark = &sc->marks[s - g_shards][slot - s->table.slots];
+    unsigned char expected = 0;
+    if (atomic_load_explicit(mark, memory_order_relaxed) ||
+        !atomic_compare_exchange_strong_explicit(mark, &expected, tag,
+             memory_order_relaxed, memory_order_relaxed)) {
+        return;
+    }
+    if (!reach_push(&job->stack, slot->alloc)) atomic_store(&sc->failed, 1);
+}
+
+/* Visit every word of [lo, hi); roots include memory that isn't ours to read */
+static NO_SANITIZE void reach_words(ReachJob *job, const uintptr_t *lo, const uintptr_t *hi,
+                                    unsigned char tag) {
+    for (const uintptr_t *p = lo; p < hi; p++) {
+        reach_visit(job, *p, tag);
+    }
+}
+
+static void reach_block(ReachJob *job, const Allocation *a, unsigned char tag) {
+    const uintptr_t *data = (const uintptr_t*)a->userPtr;
+    reach_words(job, data, data + a->requestedSize / sizeof(uintptr_t), tag);
+}
+
+/* Hand the older half of a long stack to the pool for idle markers */
+static void reach_share(ReachScan *sc, ReachStack *st) {
+    LOCK_POOL(sc);
+    size_t n = 0;
+    while (n < st->count / 2 && reach_push(&sc->pool, st->items[n])) {
+        n++;
+    }
+    memmove(st->items, st->items + n, (st->count - n) * sizeof(Allocation*));
+    st->count -= n;
+    atomic_store_explicit(&sc->poolSize, sc->pool.count, memory_order_relaxed);
+    UNLOCK_POOL(sc);
+}
+
+/* Scan what is queued (and what that reaches) */
+static void reach_drain(ReachJob *job, unsigned char tag, int share) {
+    ReachScan  *sc = job->scan;
+    ReachStack *st = &job->stack;
+    while (st->count && !atomic_load_explicit(&sc->failed, memory_order_relaxed)) {
+        reach_block(job, st->items[--st->count], tag);
+        if (share && st->count >= 2 * REACH_SHARE &&
+            atomic_load_explicit(&sc->poolSize, memory_order_relaxed) < REACH_SHARE) {
+            reach_share(sc, st);
+        }
+    }
+}
+
+/* Take work from the pool; 0 once every marker is out of work */
+static int reach_refill(ReachJob *job) {
+    ReachScan *sc   = job->scan;
+    int        idle = 0;
+    for (;;) {
+        LOCK_POOL(sc);
+        if (sc->pool.count && !atomic_load(&sc->failed)) {
+            size_t n = sc->pool.count < REACH_SHARE ? sc->pool.count : REACH_SHARE;
+            for (; n && reach_push(&job->stack, sc->pool.items[sc->pool.count - 1]); n--) {
+                sc->pool.count--;
+            }
+            if (n) atomic_store(&sc->failed, 1);
+            atomic_store_explicit(&sc->poolSize, sc->pool.count, memory_order_relaxed);
+            if (idle) sc->idle--;
+            UNLOCK_POOL(sc);
+            return 1;
+        }
+        if (!idle) {
+            idle = 1;
+            sc->idle++;
+        }
+        /* Only a busy marker can still add work. */
+        int done = sc->idle == sc->workers || atomic_load(&sc->failed);
+        UNLOCK_POOL(sc);
+        if (done) return 0;
+        sched_yield();
+    }
+}
+
+/* Mark everything the roots reach */
+static void* reach_mark_worker(void *arg) {
+    ReachJob  *job = (ReachJob*)arg;
+    ReachScan *sc  = job->scan;
+    do {
+        size_t i;
+        while ((i = atomic_fetch_add_explicit(&sc->nextRoot, 1, memory_order_relaxed)) < sc->rootCount) {
+            reach_words(job, sc->roots[i].lo, sc->roots[i].hi, LEAK_TRACKER_REACH_REACHABLE);
+            reach_drain(job, LEAK_TRACKER_REACH_REACHABLE, 1);
+        }
+        reach_drain(job, LEAK_TRACKER_REACH_REACHABLE, 1);
+    } while (reach_refill(job));
+    return NULL;
+}
+
+/*
+ * Every block still unmarked is lost; what it reaches is lost indirectly.
+ * Unmarked blocks are scanned as origins in any order, so an origin goes
+ * back to unmarked after its scan and a later origin that reaches it
+ * makes it indirect. What stays unmarked at the end is definitely lost. A
+ * claimed origin can't be marked, so each lost cycle keeps one member.
+ */
+static void* reach_lost_worker(void *arg) {
+    ReachJob  *job = (ReachJob*)arg;
+    ReachScan *sc  = job->scan;
+    for (size_t i = job->first; i < SHARD_COUNT; i += job->step) {
+        AllocTable *t = &g_shards[i].table;
+        for (size_t k = 0; k < t->capacity && !atomic_load(&sc->failed); k++) {
+            unsigned char expected = 0;
+            if (!t->slots[k].key ||
+                !atomic_compare_exchange_strong_explicit(&sc->marks[i][k], &expected,
+                     REACH_ORIGIN, memory_order_relaxed, memory_order_relaxed)) {
+                continue;
+            }
+            reach_block(job, t->slots[k].alloc, LEAK_TRACKER_REACH_INDIRECT);
+            reach_drain(job, LEAK_TRACKER_REACH_INDIRECT, 0);
+            atomic_store_explicit(&sc->marks[i][k], 0, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+/* Memory of ours that holds user pointers and must not count as a root */
+static const struct {
+    const void *start;
+    size_t      size;
+} g_reachSkip[] = {
+    { g_diagRing,  sizeof(g_diagRing) },
+    { g_pagePools, sizeof(g_pagePools) },
+};
+#define REACH_SKIPS (sizeof(g_reachSkip) / sizeof(g_reachSkip[0]))
+
+/* Add [lo, hi) to the roots, less the skipped ranges from 'skip' on; 0 on OOM */
+static int reach_add(ReachScan *sc, uintptr_t lo, uintptr_t hi, size_t skip) {
+    for (; skip < REACH_SKIPS; skip++) {
+        uintptr_t a = (uintptr_t)g_reachSkip[skip].start;
+        uintptr_t b = a + g_reachSkip[skip].size;
+        if (a < hi && b > lo) {
+            return reach_add(sc, lo, a, skip + 1) && reach_add(sc, b, hi, skip + 1);
+        }
+    }
+    lo = (lo + sizeof(uintptr_t) - 1) & ~(uintptr_t)(sizeof(uintptr_t) - 1);
+    hi &= ~(uintptr_t)(sizeof(uintptr_t) - 1);
+    while (lo < hi) {
+        size_t n = hi - lo < REACH_CHUNK ? hi - lo : REACH_CHUNK;
+        if (sc->rootCount == sc->rootCap) {
+            size_t cap = sc->rootCap ? 2 * sc->rootCap : 256;
+            ReachRange *roots = (ReachRange*)realloc(sc->roots, cap * sizeof(ReachRange));
+            if (!roots) return 0;
+            sc->roots   = roots;
+            sc->rootCap = cap;
+        }
+        sc->roots[sc->rootCount].lo   = (const uintptr_t*)lo;
+        sc->roots[sc->rootCount++].hi = (const uintptr_t*)(lo + n);
+        lo += n;
+    }
+    return 1;
+}
+
+/* Writable segments of a loaded object, and this thread's thread-locals of it */
+static int reach_phdr(struct dl_phdr_info *info, size_t size, void *arg) {
+    ReachScan *sc = (ReachScan*)arg;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start = (uintptr_t)(info->dlpi_addr + ph->p_vaddr);
+        if (ph->p_type == PT_LOAD && (ph->p_flags & PF_W)) {
+            if (!reach_add(sc, start, start + ph->p_memsz, 0)) return 1;
+        }
+#ifdef __GLIBC__
+        if (ph->p_type == PT_TLS &&
+            size >= offsetof(struct dl_phdr_info, dlpi_tls_data) + sizeof(void*) &&
+            info->dlpi_tls_data) {
+            uintptr_t tls = (uintptr_t)info->dlpi_tls_data;
+            if (!reach_add(sc, tls, tls + ph->p_memsz, 0)) return 1;
+        }
+#else
+        (void)size;
+#endif
+    }
+    return 0;
+}
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+/* Add a thread's stack, from 'sp' up if sp lies in it; 0 on OOM */
+static int reach_add_stack(ReachScan *sc, pthread_t thread, const void *sp) {
+    pthread_attr_t attr;
+    void  *addr;
+    size_t size;
+    if (pthread_getattr_np(thread, &attr) != 0) return 1;
+    int ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) return 1;
+    uintptr_t lo = (uintptr_t)addr, hi = lo + size;
+    if ((uintptr_t)sp > lo && (uintptr_t)sp < hi) lo = (uintptr_t)sp;
+    return reach_add(sc, lo, hi, 0);
+}
+#endif
+
+/* Stacks: ours from 'sp' up, and all of every other thread using the tracker; 0 on OOM */
+static NO_SANITIZE int reach_add_stacks(ReachScan *sc, const void *sp) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_t self = pthread_self();
+    if (!reach_add_stack(sc, self, sp)) return 0;
+    for (ThreadState *ts = atomic_load_explicit(&g_threads, memory_order_acquire); ts; ts = ts->next) {
+        if (!atomic_load_explicit(&ts->inUse, memory_order_acquire) ||
+            pthread_equal(ts->thread, self)) {
+            continue;
+        }
+        if (!reach_add_stack(sc, ts->thread, NULL)) return 0;
+    }
+    return 1;
+#else
+    /* Only this thread: its stack is the mapping around 'sp'. */
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (!maps) return 1;
+    char line[512];
+    int  ok = 1;
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long lo, hi;
+        if (sscanf(line, "%lx-%lx", &lo, &hi) == 2 && (uintptr_t)sp >= lo && (uintptr_t)sp < hi) {
+            ok = reach_add(sc, (uintptr_t)sp, hi, 0);
+            break;
+        }
+    }
+    fclose(maps);
+    return ok;
+#endif
+}
+
+/* Mark phase over the locked shards, labels and totals; 0 on OOM */
+static int reach_run(ReachScan *sc, Workers *workers, LeakReachability *res) {
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+    memset(res, 0, sizeof(*res));
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        Shard *s = &g_shards[i];
+        /* One table per shard, so a slot index finds its mark. */
+        if (s->oldTable.slots) table_migrate(s, (size_t)-1);
+        if (s->table.capacity) {
+            sc->marks[i] = (atomic_uchar*)calloc(s->table.capacity, sizeof(atomic_uchar));
+            if (!sc->marks[i]) return 0;
+        }
+        for (size_t k = 0; k < s->table.capacity; k++) {
+            uintptr_t key = (uintptr_t)s->table.slots[k].key;
+            if (!key) continue;
+            if (key < lo) lo = key;
+            if (key > hi) hi = key;
+        }
+    }
+    if (!hi) return 1; /* nothing tracked */
+    sc->lo   = lo;
+    sc->span = hi - lo;
+
+    workers_run(workers, reach_mark_worker);
+    if (!atomic_load(&sc->failed)) {
+        workers_run(workers, reach_lost_worker);
+    }
+    if (atomic_load(&sc->failed)) return 0;
+
+    /* Labels go into the records only now, by one thread. */
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        AllocTable *t = &g_shards[i].table;
+        for (size_t k = 0; k < t->capacity; k++) {
+            if (!t->slots[k].key) continue;
+            Allocation *a = t->slots[k].alloc;
+            unsigned char mark = atomic_load_explicit(&sc->marks[i][k], memory_order_relaxed);
+            a->reach = mark ? mark : LEAK_TRACKER_REACH_LOST;
+            if (a->reach == LEAK_TRACKER_REACH_REACHABLE) {
+                res->reachableBlocks++;
+                res->reachableBytes += a->requestedSize;
+            } else if (a->reach == LEAK_TRACKER_REACH_INDIRECT) {
+                res->indirectBlocks++;
+                res->indirectBytes += a->requestedSize;
+            } else {
+                res->lostBlocks++;
+                res->lostBytes += a->requestedSize;
+            }
+        }
+    }
+    return 1;
+}
+/* The scan proper; 'sp' is where the caller's saved registers start its stack roots */
+static NEVER_INLINE int reach_scan(unsigned threads, LeakReachability *out, const void *sp) {
+    LeakReachability res;
+    ENSURE_INIT();
+    flush_all_caches();
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (threads == 0) threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads == 0) threads = 1;
+    if (threads > WORKERS_MAX) threads = WORKERS_MAX;
+#else
+    threads = 1;
+#endif
+    ReachScan *sc = (ReachScan*)calloc(1, sizeof(ReachScan));
+    if (!sc) return -1;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_init(&sc->poolLock, NULL);
+#endif
+    /* Roots and threads are set up before locking: both may allocate. */
+    ReachJob *jobs = (ReachJob*)calloc(threads, sizeof(ReachJob));
+    int ok = jobs && dl_iterate_phdr(reach_phdr, sc) == 0 && reach_add_stacks(sc, sp);
+    if (ok) {
+        Workers workers;
+        threads = workers_start(&workers, jobs, sizeof(ReachJob), threads);
+        for (unsigned t = 0; t < threads; t++) {
+            jobs[t].scan  = sc;
+            jobs[t].first = t;
+            jobs[t].step  = threads;
+        }
+        sc->workers = threads;
+        lock_all_shards();
+        ok = reach_run(sc, &workers, &res);
+        unlock_all_shards();
+        workers_stop(&workers);
+        for (unsigned t = 0; t < threads; t++) {
+            free(jobs[t].stack.items);
+        }
+    }
+    free(jobs);
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        free(sc->marks[i]);
+    }
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_destroy(&sc->poolLock);
+#endif
+    free(sc->pool.items);
+    free(sc->roots);
+    free(sc);
+    if (!ok) return -1;
+    if (out) *out = res;
+    return 0;
+}
+#endif /* HAVE_REACH_SCAN */
+
+int leak_tracker_scan(unsigned threads, LeakReachability *out) {
+#ifdef HAVE_REACH_SCAN
+    /* Spill the registers onto the stack, where the scan will see them. */
+    jmp_buf regs;
+    setjmp(regs);
+    return reach_scan(threads, out, &regs);
+#else
+    (void)threads;
+    (void)out;
+    return -1;
+#endif
+}
+
+void log_lost_blocks(FILE *out, unsigned threads) {
+    LeakReachability r;
+    if (leak_tracker_scan(threads, &r) != 0) {
+        fprintf(out, "\n==== Lost Blocks ====\nReachability scan unavailable.\n");
+        return;
+    }
+    fprintf(out, "\n==== Lost Blocks ====\n");
+    fprintf(out, "  Definitely lost: %zu bytes in %zu blocks\n", r.lostBytes, r.lostBlocks);
+    fprintf(out, "  Indirectly lost: %zu bytes in %zu blocks\n", r.indirectBytes, r.indirectBlocks);
+    fprintf(out, "  Still reachable: %zu bytes in %zu blocks\n", r.reachableBytes, r.reachableBlocks);
+    if (!r.lostBlocks && !r.indirectBlocks) return;
+    fprintf(out, "----------------------------------------------------\n");
+    fprintf(out, "  Pointer            Size     Location\n");
+    fprintf(out, "----------------------------------------------------\n");
+    for (int label = LEAK_TRACKER_REACH_LOST; label >= LEAK_TRACKER_REACH_INDIRECT; label--) {
+        for (size_t i = 0; i < SHARD_COUNT; i++) {
+            Shard *s = &g_shards[i];
+            LOCK_SHARD(s);
+            size_t cursor = 0;
+            Allocation *cur;
+            while ((cur = next_allocation(s, &cursor)) != NULL) {
+                if (cur->reach != (unsigned)label) continue;
+                fprintf(out, "  %p   %6zu   %s:%d  (%s)\n",
+                        cur->userPtr, (size_t)cur->requestedSize, g_siteStats[cur->site].file,
+                        g_siteStats[cur->site].line, REACH_NAMES[label]);
+                stack_print(out, rec_stack(cur));
+            }
+            UNLOCK_SHARD(s);
+        }
+    }
+}
+
+void leak_tracker_set_quarantine(size_t maxEntries, size_t maxBytes, int delayReuse) {
+    ENSURE_INIT();
+    lock_all_shards();
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        quarantine_clear(&g_shards[i]);
+    }
+    if (maxEntries > QUARANTINE_MAX_ENTRIES) maxEntries = QUARANTINE_MAX_ENTRIES;
+    g_qMaxEntries = maxEntries;
+    g_qMaxBytes   = maxBytes;
+    g_qDelayReuse = delayReuse;
+    unlock_all_shards();
+}
+
+void leak_tracker_set_thread_mode(int mode) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    ENSURE_INIT();
+    flush_all_caches();
+    if (mode == LEAK_TRACKER_THREADS_LOCKED ||
+        mode == LEAK_TRACKER_THREADS_BATCHED ||
+        mode == LEAK_TRACKER_THREADS_SINGLE) {
+        g_threadMode = mode;
+    }
+#else
+    (void)mode; /* built single-threaded */
+#endif
+}
+
+void get_memory_histograms(MemHistograms *out) {
+    if (!out) return;
+    ENSURE_INIT();
+    memset(out, 0, sizeof(*out));
+    for (unsigned b = 0; b < LEAK_TRACKER_HIST_BINS; b++) {
+        out->sizes[b]     = COUNTER_GET(g_hist[HIST_SIZES][b]);
+        out->growth[b]    = COUNTER_GET(g_hist[HIST_GROWTH][b]);
+        out->lifetimes[b] = COUNTER_GET(g_hist[HIST_LIFETIMES][b]);
+    }
+    for (ThreadState *ts = g_threads; ts; ts = ts->next) {
+        for (unsigned b = 0; b < LEAK_TRACKER_HIST_BINS; b++) {
+            out->sizes[b]     += COUNTER_GET(ts->hist[HIST_SIZES][b]);
+            out->growth[b]    += COUNTER_GET(ts->hist[HIST_GROWTH][b]);
+            out->lifetimes[b] += COUNTER_GET(ts->hist[HIST_LIFETIMES][b]);
+        }
+    }
+    out->ticksPerSecond = ticks_per_second();
+}
+
+unsigned long long leak_tracker_hist_bin_low(unsigned bin) {
+    return bin < LEAK_TRACKER_HIST_BINS ? hist_bin_low(bin) : 0;
+}
+
+/* Non-empty bins of one histogram; scale != 0 prints values as microseconds */
+static void print_histogram(FILE *out, const char *title, const size_t *bins, double scale) {
+    size_t total = 0;
+    for (unsigned b = 0; b < LEAK_TRACKER_HIST_BINS; b++) total += bins[b];
+    fprintf(out, "  %s (%zu):\n", title, total);
+    for (unsigned b = 0; b < LEAK_TRACKER_HIST_BINS; b++) {
+        if (!bins[b]) continue;
+        double pct = 100.0 * (double)bins[b] / (double)total;
+        if (scale) {
+            fprintf(out, "    >= %12.3f us  %10zu  %5.1f%%\n",
+                    (double)hist_bin_low(b) * scale, bins[b], pct);
+        } else {
+            fprintf(out, "    >= %12llu     %10zu  %5.1f%%\n", hist_bin_low(b), bins[b], pct);
+        }
+    }
+}
+
+void log_memory_histograms(FILE *out) {
+    MemHistograms *h = (MemHistograms*)malloc(sizeof(MemHistograms));
+    if (!h) return;
+    get_memory_histograms(h);
+    fprintf(out, "\n==== Memory Histograms ====\n");
+    print_histogram(out, "Requested sizes, bytes", h->sizes, 0.0);
+    print_histogram(out, "Realloc growth steps, bytes", h->growth, 0.0);
+    if (h->ticksPerSecond) {
+        print_histogram(out, "Lifetimes of freed blocks", h->lifetimes, 1e6 / h->ticksPerSecond);
+    } else {
+        print_histogram(out, "Lifetimes of freed blocks, clock ticks", h->lifetimes, 0.0);
+    }
+    free(h);
+}
+
+size_t get_leak_sites(LeakSite *out, size_t maxSites) {
+    size_t n = 0;
+    if (!out || !maxSites) return 0;
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        SiteStats *st = &g_siteStats[i];
+        LeakSite site;
+        site.liveCount  = atomic_load_explicit(&st->liveCount, memory_order_relaxed);
+        site.liveBytes  = atomic_load_explicit(&st->liveBytes, memory_order_relaxed);
+        if (!site.liveCount) continue;
+        site.file       = st->file;
+        site.line       = st->line;
+        site.peakBytes  = atomic_load_explicit(&st->peakBytes, memory_order_relaxed);
+        site.totalCount = atomic_load_explicit(&st->totalCount, memory_order_relaxed);
+        site.totalBytes = atomic_load_explicit(&st->totalBytes, memory_order_relaxed);
+        site.id         = i;
+
+        /* Keep out[] sorted by live bytes, biggest first. */
+        if (n == maxSites && site.liveBytes <= out[n - 1].liveBytes) continue;
+        size_t j = (n < maxSites) ? n++ : n - 1;
+        for (; j > 0 && out[j - 1].liveBytes < site.liveBytes; j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = site;
+    }
+    return n;
+}
+
+void log_leak_sites(FILE *out, size_t topN) {
+    if (!topN || topN > SITE_MAX) topN = SITE_MAX;
+    LeakSite *sites = (LeakSite*)malloc(topN * sizeof(LeakSite));
+    if (!sites) return;
+    size_t n = get_leak_sites(sites, topN);
+
+    fprintf(out, "\n==== Leak Sites (by live bytes) ====\n");
+    if (n == 0) {
+        fprintf(out, "No live allocations.\n");
+        free(sites);
+        return;
+    }
+    fprintf(out, "  Live Bytes   Blocks   Peak Bytes     Allocs  Location\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "  %10zu %8zu   %10zu %10zu  %s:%d\n",
+                sites[i].liveBytes, sites[i].liveCount, sites[i].peakBytes,
+                sites[i].totalCount, sites[i].file, sites[i].line);
+    }
+    free(sites);
+}
+
+LeakSnapshot leak_tracker_snapshot(void) {
+    ENSURE_INIT();
+    /* Just a point in time: blocks carry their allocation tick already. */
+    unsigned long long t = now_ticks();
+    return t ? t : 1;
+}
+
+/* Slots a diff looks at before it lets other threads at the shard again */
+#define DIFF_LOCK_SLOTS 1024
+
+size_t leak_tracker_diff(LeakSnapshot a, LeakSnapshot b, LeakSite *out, size_t maxSites) {
+    size_t n = 0;
+    /* Blocks don't record when they were freed: a diff is always up to now. */
+    if (!out || !maxSites || b) return 0;
+    ENSURE_INIT();
+    /* Totals, and the current shard's own until it has been walked whole */
+    size_t   *counts  = (size_t*)calloc(4 * SITE_MAX, sizeof(size_t));
+    unsigned *touched = (unsigned*)malloc(SITE_MAX * sizeof(unsigned));
+    if (!counts || !touched) {
+        free(counts);
+        free(touched);
+        return 0;
+    }
+    size_t *bytes       = counts + SITE_MAX;
+    size_t *shardCounts = counts + 2 * SITE_MAX;
+    size_t *shardBytes  = counts + 3 * SITE_MAX;
+    unsigned long long until = now_ticks(); /* blocks made meanwhile don't count */
+    flush_all_caches();
+
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        Shard   *s = &g_shards[i];
+        size_t   cursor = 0, pausedAt = 0, nTouched = 0;
+        LOCK_SHARD(s);
+        unsigned resizes = s->resizes;
+        while (cursor < s->table.capacity + s->oldTable.capacity) {
+            if (cursor % DIFF_LOCK_SLOTS == 0 && cursor != pausedAt) {
+                /* Let other threads at the shard, like a teardown step. */
+                pausedAt = cursor;
+                UNLOCK_SHARD(s);
+                LOCK_SHARD(s);
+                if (s->resizes != resizes) {
+                    /* The slots moved meanwhile: walk the shard again from scratch. */
+                    for (size_t t = 0; t < nTouched; t++) {
+                        shardCounts[touched[t]] = 0;
+                        shardBytes[touched[t]]  = 0;
+                    }
+                    nTouched = 0;
+                    cursor   = 0;
+                    pausedAt = 0;
+                    resizes  = s->resizes;
+                }
+                continue; /* the old table may be gone: check the bound again */
+            }
+            size_t k = cursor++;
+            AllocSlot *slot = (k < s->table.capacity)
+                            ? &s->table.slots[k]
+                            : &s->oldTable.slots[k - s->table.capacity];
+            if (!slot->key) continue;
+            Allocation *cur = slot->alloc;
+            if (cur->born < a || cur->born >= until) continue;
+            if (!shardCounts[cur->site]) touched[nTouched++] = cur->site;
+            shardCounts[cur->site]++;
+            shardBytes[cur->site] += cur->requestedSize;
+        }
+        UNLOCK_SHARD(s);
+        for (size_t t = 0; t < nTouched; t++) {
+            counts[touched[t]] += shardCounts[touched[t]];
+            bytes[touched[t]]  += shardBytes[touched[t]];
+            shardCounts[touched[t]] = 0;
+            shardBytes[touched[t]]  = 0;
+        }
+    }
+
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        if (!counts[i]) continue;
+        SiteStats *st = &g_siteStats[i];
+        LeakSite site;
+        site.file       = st->file;
+        site.line       = st->line;
+        site.liveCount  = counts[i];
+        site.liveBytes  = bytes[i];
+        site.peakBytes  = atomic_load_explicit(&st->peakBytes, memory_order_relaxed);
+        site.totalCount = atomic_load_explicit(&st->totalCount, memory_order_relaxed);
+        site.totalBytes = atomic_load_explicit(&st->totalBytes, memory_order_relaxed);
+        site.id         = i;
+
+        /* Keep out[] sorted by live bytes, biggest first. */
+        if (n == maxSites && site.liveBytes <= out[n - 1].liveBytes) continue;
+        size_t j = (n < maxSites) ? n++ : n - 1;
+        for (; j > 0 && out[j - 1].liveBytes < site.liveBytes; j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = site;
+    }
+    free(counts);
+    free(touched);
+    return n;
+}
+
+void log_snapshot_diff(FILE *out, LeakSnapshot a, LeakSnapshot b, size_t topN) {
+    if (b) {
+        fprintf(out, "\nSnapshot diffs are always against now: pass b = 0.\n");
+        return;
+    }
+    if (!topN || topN > SITE_MAX) topN = SITE_MAX;
+    LeakSite *sites = (LeakSite*)malloc(topN * sizeof(LeakSite));
+    if (!sites) return;
+    size_t n = leak_tracker_diff(a, b, sites, topN);
+
+    fprintf(out, "\n==== Snapshot Diff (new blocks still live) ====\n");
+    if (n == 0) {
+        fprintf(out, "No new live allocations.\n");
+        free(sites);
+        return;
+    }
+    size_t totalBytes = 0, totalBlocks = 0;
+    fprintf(out, "   New Bytes   Blocks  Location\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "  %10zu %8zu  %s:%d\n",
+                sites[i].liveBytes, sites[i].liveCount, sites[i].file, sites[i].line);
+        totalBytes  += sites[i].liveBytes;
+        totalBlocks += sites[i].liveCount;
+    }
+    fprintf(out, "  %10zu %8zu  total\n", totalBytes, totalBlocks);
+    free(sites);
+}
+
+unsigned leak_tracker_epoch_begin(void) {
+    ENSURE_INIT();
+    ThreadState *ts = thread_state();
+    if (!ts) return 0;
+    for (size_t n = 0; n < EPOCH_MAX; n++) {
+        unsigned slot = atomic_fetch_add_explicit(&g_epochCursor, 1, memory_order_relaxed)
+                      & (EPOCH_MAX - 1);
+        Epoch *e = &g_epochs[slot];
+        LOCK_EPOCH(e);
+        if (e->active) {
+            UNLOCK_EPOCH(e);
+            continue;
+        }
+        epoch_clear(e);
+        e->id += e->id ? EPOCH_MAX : slot + EPOCH_MAX;
+        if (!e->id) e->id = slot + EPOCH_MAX; /* wrapped around */
+        e->parent = ts->epoch;
+        e->active = 1;
+        ts->epoch = e->id;
+        UNLOCK_EPOCH(e);
+        return ts->epoch;
+    }
+    return 0; /* every slot is in an active epoch */
+}
+
+int leak_tracker_epoch_end(unsigned epoch, size_t *blocks, size_t *bytes) {
+    ThreadState *ts = thread_state();
+    if (!ts || !epoch) return -1;
+    Epoch *e = epoch_slot(epoch);
+    LOCK_EPOCH(e);
+    int ok = e->id == epoch && e->active;
+    if (ok) {
+        e->active = 0;
+        if (ts->epoch == epoch) ts->epoch = e->parent;
+    }
+    if (blocks) *blocks = ok ? e->liveCount : 0;
+    if (bytes)  *bytes  = ok ? e->liveBytes : 0;
+    UNLOCK_EPOCH(e);
+    return ok ? 0 : -1;
+}
+
+int leak_tracker_epoch_live(unsigned epoch, size_t *blocks, size_t *bytes) {
+    if (!epoch) return -1;
+    ENSURE_INIT();
+    Epoch *e = epoch_slot(epoch);
+    LOCK_EPOCH(e);
+    int ok = e->id == epoch;
+    if (blocks) *blocks = ok ? e->liveCount : 0;
+    if (bytes)  *bytes  = ok ? e->liveBytes : 0;
+    UNLOCK_EPOCH(e);
+    return ok ? 0 : -1;
+}
+
+void log_epoch_leaks(FILE *out, unsigned epoch) {
+    ENSURE_INIT();
+    Epoch *e = epoch_slot(epoch);
+    LOCK_EPOCH(e);
+    if (!epoch || e->id != epoch) {
+        UNLOCK_EPOCH(e);
+        fprintf(out, "\n==== Epoch %u ====\nEpoch no longer tracked.\n", epoch);
+        return;
+    }
+    fprintf(out, "\n==== Epoch %u ====\n", epoch);
+    if (!e->head) {
+        UNLOCK_EPOCH(e);
+        fprintf(out, "No live allocations from this epoch.\n");
+        return;
+    }
+    fprintf(out, "  %zu blocks, %zu bytes still live:\n", e->liveCount, e->liveBytes);
+    fprintf(out, "  Pointer            Size     Location\n");
+    for (Allocation *a = e->head; a; a = a->extra->epochNext) {
+        fprintf(out, "  %p   %6zu   %s:%d\n", a->userPtr, (size_t)a->requestedSize,
+                g_siteStats[a->site].file, g_siteStats[a->site].line);
+    }
+    UNLOCK_EPOCH(e);
+}
+
+void leak_tracker_set_stack_depth(int depth) {
+#ifdef HAVE_BACKTRACE
+    if (depth < 0) depth = 0;
+    if (depth > STACK_MAX_DEPTH) depth = STACK_MAX_DEPTH;
+    if (depth) {
+        /* The first backtrace() may load the unwinder; do it here, not mid-allocation. */
+        void *frame;
+        backtrace(&frame, 1);
+    }
+    g_stackDepth = depth;
+#else
+    (void)depth;
+#endif
+}
+
+/*
+ * From now on untracked blocks exist: enter every live block and every
+ * quarantined pointer in the filter (all shards locked)
+ */
+static void filter_enable(void) {
+    if (g_filterOn) return;
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        size_t cursor = 0;
+        Allocation *cur;
+        while ((cur = next_allocation(&g_shards[i], &cursor)) != NULL) {
+            filter_add(cur->userPtr);
+        }
+        const Quarantine *q = &g_shards[i].quarantine;
+        for (size_t k = 0; k < q->length; k++) {
+            const void *ptr = q->ring[(q->head + k) % q->capacity].ptr;
+            if (ptr) filter_add(ptr);
+        }
+    }
+    g_filterOn = 1;
+}
+
+size_t get_realloc_sites(ReallocSite *out, size_t maxSites) {
+    size_t n = 0;
+    if (!out || !maxSites) return 0;
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        SiteStats *st = &g_siteStats[i];
+        ReallocSite site;
+        site.reallocs = atomic_load_explicit(&st->reallocs, memory_order_relaxed);
+        if (!site.reallocs) continue;
+        size_t grows      = atomic_load_explicit(&st->grows, memory_order_relaxed);
+        site.file         = st->file;
+        site.line         = st->line;
+        site.moved        = atomic_load_explicit(&st->moves, memory_order_relaxed);
+        site.bytesCopied  = atomic_load_explicit(&st->bytesCopied, memory_order_relaxed);
+        site.bytesGrown   = atomic_load_explicit(&st->bytesGrown, memory_order_relaxed);
+        site.avgGrowth    = grows ? (double)atomic_load_explicit(&st->growthSum, memory_order_relaxed)
+                                    / 65536.0 / (double)grows : 0.0;
+        site.longestChain = atomic_load_explicit(&st->longestChain, memory_order_relaxed);
+        /*
+         * Growing by a constant step copies ~n^2/2 bytes for n grown; geometric
+         * growth copies about as much as it grows.
+         */
+        site.quadratic    = site.moved >= 8 && site.avgGrowth < 1.5 &&
+                            site.bytesCopied > 4 * site.bytesGrown;
+
+        /* Keep out[] sorted by bytes copied, biggest first. */
+        if (n == maxSites && site.bytesCopied <= out[n - 1].bytesCopied) continue;
+        size_t j = (n < maxSites) ? n++ : n - 1;
+        for (; j > 0 && out[j - 1].bytesCopied < site.bytesCopied; j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = site;
+    }
+    return n;
+}
+
+void log_realloc_sites(FILE *out, size_t topN) {
+    if (!topN || topN > SITE_MAX) topN = SITE_MAX;
+    ReallocSite *sites = (ReallocSite*)malloc(topN * sizeof(ReallocSite));
+    if (!sites) return;
+    size_t n = get_realloc_sites(sites, topN);
+
+    fprintf(out, "\n==== Realloc Sites (by bytes copied) ====\n");
+    if (n == 0) {
+        fprintf(out, "No reallocs recorded.\n");
+        free(sites);
+        return;
+    }
+    fprintf(out, "    Reallocs      Moved   Bytes Copied    Bytes Grown  Growth  Chain  Location\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "  %10zu %10zu %14zu %14zu  %5.2fx %6zu  %s:%d%s\n",
+                sites[i].reallocs, sites[i].moved, sites[i].bytesCopied, sites[i].bytesGrown,
+                sites[i].avgGrowth, sites[i].longestChain, sites[i].file, sites[i].line,
+                sites[i].quadratic ? "  <- O(n^2) copying, reserve capacity" : "");
+    }
+    free(sites);
+}
+
+size_t get_slack_sites(SlackSite *out, size_t maxSites) {
+    size_t n = 0;
+    if (!out || !maxSites) return 0;
+    unsigned sites = atomic_load_explicit(&g_siteCount, memory_order_acquire);
+    for (unsigned i = 0; i < sites; i++) {
+        SiteStats *st = &g_siteStats[i];
+        SlackSite site;
+        site.liveCount     = atomic_load_explicit(&st->liveCount, memory_order_relaxed);
+        if (!site.liveCount) continue;
+        site.file          = st->file;
+        site.line          = st->line;
+        site.liveBytes     = atomic_load_explicit(&st->liveBytes, memory_order_relaxed);
+        site.overheadBytes = atomic_load_explicit(&st->liveOverhead, memory_order_relaxed);
+        site.slackBytes    = atomic_load_explicit(&st->liveSlack, memory_order_relaxed);
+        site.id            = i;
+
+        /* Keep out[] sorted by slack bytes, biggest first. */
+        if (n == maxSites && site.slackBytes <= out[n - 1].slackBytes) continue;
+        size_t j = (n < maxSites) ? n++ : n - 1;
+        for (; j > 0 && out[j - 1].slackBytes < site.slackBytes; j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = site;
+    }
+    return n;
+}
+
+void log_slack_sites(FILE *out, size_t topN) {
+    if (!topN || topN > SITE_MAX) topN = SITE_MAX;
+    SlackSite *sites = (SlackSite*)malloc(topN * sizeof(SlackSite));
+    if (!sites) return;
+    size_t n = get_slack_sites(sites, topN);
+
+    fprintf(out, "\n==== Slack Sites (by allocator slack) ====\n");
+    if (n == 0) {
+        fprintf(out, "No live allocations.\n");
+        free(sites);
+        return;
+    }
+#ifndef HAVE_USABLE_SIZE
+    fprintf(out, "(the system allocator doesn't report usable sizes: slack is 0)\n");
+#endif
+    fprintf(out, "  Live Bytes   Blocks  Avg Size   Overhead      Slack  Slack/Block  Location\n");
+    for (size_t i = 0; i < n; i++) {
+        size_t count = sites[i].liveCount;
+        fprintf(out, "  %10zu %8zu %9zu %10zu %10zu %12.1f  %s:%d\n",
+                sites[i].liveBytes, count, sites[i].liveBytes / count,
+                sites[i].overheadBytes, sites[i].slackBytes,
+                (double)sites[i].slackBytes / (double)count, sites[i].file, sites[i].line);
+    }
+    free(sites);
+}
+
+void leak_tracker_set_sample_interval(size_t bytes) {
+    ENSURE_INIT();
+    flush_all_caches();
+    lock_all_shards();
+    if (bytes) filter_enable();
+    g_sampleInterval = bytes;
+    unlock_all_shards();
+}
+
+void leak_tracker_enable_site(unsigned site, int enabled) {
+    if (site >= SITE_MAX) return;
+    ENSURE_INIT();
+    if (!enabled) {
+        /* Untracked blocks are told apart on free by the sampling filter. */
+        flush_all_caches();
+        lock_all_shards();
+        filter_enable();
+        unlock_all_shards();
+    }
+    atomic_store_explicit(&g_siteStats[site].disabled, !enabled, memory_order_relaxed);
+}
+
+/* Count st's settings in g_policySites / g_policyOn after a change; g_siteMutex held */
+static void policy_changed(SiteStats *st, int wasSet) {
+    int isSet = policy_set(st);
+    if (st != &g_allSites && isSet != wasSet) {
+        if (isSet) atomic_fetch_add_explicit(&g_policySites, 1, memory_order_relaxed);
+        else       atomic_fetch_sub_explicit(&g_policySites, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&g_policyOn,
+                          policy_set(&g_allSites) ||
+                          atomic_load_explicit(&g_policySites, memory_order_relaxed) != 0,
+                          memory_order_relaxed);
+}
+
+static SiteStats* policy_target(unsigned site) {
+    if (site == LEAK_TRACKER_ALL_SITES) return &g_allSites;
+    return site < SITE_MAX ? &g_siteStats[site] : NULL;
+}
+
+void leak_tracker_set_budget(unsigned site, size_t bytes) {
+    SiteStats *st = policy_target(site);
+    if (!st) return;
+    ENSURE_INIT();
+    LOCK_SITES();
+    int wasSet = policy_set(st);
+    atomic_store_explicit(&st->budget, bytes, memory_order_relaxed);
+    policy_changed(st, wasSet);
+    UNLOCK_SITES();
+}
+
+void leak_tracker_set_budget_handler(LeakBudgetHandler handler, void *ctx) {
+    atomic_store_explicit(&g_budgetCtx, ctx, memory_order_relaxed);
+    atomic_store_explicit(&g_budgetHandler, handler, memory_order_release);
+}
+
+void leak_tracker_inject_failures(unsigned site, unsigned long long everyN, double probability) {
+    SiteStats *st = policy_target(site);
+    if (!st) return;
+    ENSURE_INIT();
+    unsigned rate = probability <= 0.0 ? 0
+                  : probability >= 1.0 ? 0xFFFFFFFFu
+                  : (unsigned)(probability * 4294967296.0);
+    LOCK_SITES();
+    int wasSet = policy_set(st);
+    atomic_store_explicit(&st->failEvery, everyN, memory_order_relaxed);
+    atomic_store_explicit(&st->failRate, rate, memory_order_relaxed);
+    atomic_store_explicit(&st->failCalls, 0, memory_order_relaxed);
+    policy_changed(st, wasSet);
+    UNLOCK_SITES();
+}
+
+void leak_tracker_set_failure_seed(unsigned long long seed) {
+    atomic_store_explicit(&g_failSeed, seed, memory_order_relaxed);
+}
+
+void leak_tracker_get_failures(size_t *injected, size_t *overBudget) {
+    if (injected)   *injected   = atomic_load_explicit(&g_injected, memory_order_relaxed);
+    if (overBudget) *overBudget = atomic_load_explicit(&g_overBudget, memory_order_relaxed);
+}
+
+size_t leak_tracker_drain(FILE *out) {
+    size_t written;
+    if (!out) out = stderr;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_lock(&g_drainMutex);
+    written = diag_drain(out);
+    pthread_mutex_unlock(&g_drainMutex);
+#else
+    written = diag_drain(out);
+#endif
+    return written;
+}
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+static FILE    *g_reporterOut;
+static unsigned g_reporterIntervalMs;
+
+/* Background reporter: drain every interval until stopped */
+static void* reporter_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_reporterMutex);
+    while (g_reporterRunning) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += g_reporterIntervalMs / 1000;
+        deadline.tv_nsec += (long)(g_reporterIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&g_reporterWake, &g_reporterMutex, &deadline);
+        pthread_mutex_unlock(&g_reporterMutex);
+        leak_tracker_drain(g_reporterOut);
+        pthread_mutex_lock(&g_reporterMutex);
+    }
+    pthread_mutex_unlock(&g_reporterMutex);
+    return NULL;
+}
+#endif
+
+int leak_tracker_start_reporter(FILE *out, unsigned intervalMs) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    int rc = 0;
+    pthread_mutex_lock(&g_reporterMutex);
+    if (g_reporterRunning) {
+        rc = -1;
+    } else {
+        g_reporterOut        = out ? out : stderr;
+        g_reporterIntervalMs = intervalMs ? intervalMs : 1;
+        g_reporterRunning    = 1;
+        if (pthread_create(&g_reporter, NULL, reporter_main, NULL) != 0) {
+            g_reporterRunning = 0;
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&g_reporterMutex);
+    return rc;
+#else
+    (void)out;
+    (void)intervalMs;
+    return -1; /* no threads in this build */
+#endif
+}
+
+void leak_tracker_stop_reporter(void) {
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    pthread_mutex_lock(&g_reporterMutex);
+    if (!g_reporterRunning) {
+        pthread_mutex_unlock(&g_reporterMutex);
+        return;
+    }
+    g_reporterRunning = 0;
+    pthread_cond_signal(&g_reporterWake);
+    pthread_mutex_unlock(&g_reporterMutex);
+    pthread_join(g_reporter, NULL); /* drains once more on the way out */
+#endif
+}
+
+/*
+ * Introspection agent. Updates are staged in g_agentStage first, so the
+ * seqlock's write window is a single memcpy and readers rarely retry.
+ */
+static LeakAgentSegment *g_agentSeg      = NULL;
+static LeakAgentSegment  g_agentStage;
+static LeakSite          g_agentSites[LEAK_TRACKER_AGENT_SITES];
+static unsigned          g_agentIntervalMs;
+static int               g_agentRunning  = 0;
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+#define LOCK_AGENT()   pthread_mutex_lock(&g_agentMutex)
+#define UNLOCK_AGENT() pthread_mutex_unlock(&g_agentMutex)
+#else
+#define LOCK_AGENT()   ((void)0)
+#define UNLOCK_AGENT() ((void)0)
+#endif
+
+/* Collect and publish one update; g_agentMutex held */
+static void agent_publish(void) {
+    LeakAgentSegment *st = &g_agentStage;
+    struct timespec now;
+    if (!g_agentSeg) return;
+    timespec_get(&now, TIME_UTC);
+    st->updates++;
+    st->timeNs = (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
+    collect_stats(&st->stats);
+    st->siteCount = (unsigned)get_leak_sites(g_agentSites, LEAK_TRACKER_AGENT_SITES);
+    for (unsigned i = 0; i < st->siteCount; i++) {
+        const LeakSite *src = &g_agentSites[i];
+        LeakAgentSite  *dst = &st->sites[i];
+        size_t len  = strlen(src->file);
+        size_t skip = len >= LEAK_TRACKER_AGENT_FILE ? len - (LEAK_TRACKER_AGENT_FILE - 1) : 0;
+        memcpy(dst->file, src->file + skip, len - skip + 1);
+        dst->line       = src->line;
+        dst->id         = src->id;
+        dst->liveCount  = src->liveCount;
+        dst->liveBytes  = src->liveBytes;
+        dst->peakBytes  = src->peakBytes;
+        dst->totalCount = src->totalCount;
+        dst->totalBytes = src->totalBytes;
+    }
+    get_memory_histograms(&st->hist);
+
+    atomic_uint *seq = (atomic_uint*)&g_agentSeg->seq;
+    unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&g_agentSeg->updates, &st->updates,
+           sizeof(LeakAgentSegment) - offsetof(LeakAgentSegment, updates));
+    atomic_store_explicit(seq, s + 2, memory_order_release);
+    atomic_store_explicit((atomic_uint*)&g_agentSeg->magic, LEAK_TRACKER_AGENT_MAGIC,
+                          memory_order_release);
+}
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+/* Agent thread: publish every interval until stopped */
+static void* agent_main(void *arg) {
+    (void)arg;
+    LOCK_AGENT();
+    while (g_agentRunning) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += g_agentIntervalMs / 1000;
+        deadline.tv_nsec += (long)(g_agentIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&g_agentWake, &g_agentMutex, &deadline);
+        if (g_agentRunning) agent_publish();
+    }
+    UNLOCK_AGENT();
+    return NULL;
+}
+#endif
+
+int leak_tracker_start_agent(const char *path, unsigned intervalMs) {
+#ifdef HAVE_MMAP
+    int rc = -1;
+    if (!path) return -1;
+    ENSURE_INIT();
+    LOCK_AGENT();
+    if (!g_agentRunning && !g_agentSeg) { /* not running, nor still stopping */
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        void *map = MAP_FAILED;
+        if (fd >= 0) {
+            if (ftruncate(fd, (off_t)sizeof(LeakAgentSegment)) == 0) {
+                map = mmap(NULL, sizeof(LeakAgentSegment), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+            }
+            close(fd);
+        }
+        if (map != MAP_FAILED) {
+            g_agentSeg = (LeakAgentSegment*)map;
+            memset(&g_agentStage, 0, sizeof(g_agentStage));
+            g_agentSeg->size  = (unsigned)sizeof(LeakAgentSegment);
+            g_agentSeg->pid   = (unsigned)getpid();
+            g_agentIntervalMs = intervalMs;
+            g_agentRunning    = 1;
+            agent_publish();
+            rc = 0;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+            g_agentThread = intervalMs && pthread_create(&g_agent, NULL, agent_main, NULL) == 0;
+            if (intervalMs && !g_agentThread) {
+                munmap(map, sizeof(LeakAgentSegment));
+                g_agentSeg     = NULL;
+                g_agentRunning = 0;
+                rc = -1;
+            }
+#endif
+        }
+    }
+    UNLOCK_AGENT();
+    return rc;
+#else
+    (void)path;
+    (void)intervalMs;
+    return -1;
+#endif
+}
+
+void leak_tracker_stop_agent(void) {
+#ifdef HAVE_MMAP
+    LOCK_AGENT();
+    if (!g_agentRunning) {
+        UNLOCK_AGENT();
+        return;
+    }
+    g_agentRunning = 0;
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    if (g_agentThread) {
+        pthread_cond_signal(&g_agentWake);
+        UNLOCK_AGENT();
+        pthread_join(g_agent, NULL);
+        LOCK_AGENT();
+        g_agentThread = 0;
+    }
+#endif
+    agent_publish(); /* a last update, so readers see the final numbers */
+    munmap(g_agentSeg, sizeof(LeakAgentSegment));
+    g_agentSeg = NULL;
+    UNLOCK_AGENT();
+#endif
+}
+
+void leak_tracker_agent_publish(void) {
+    LOCK_AGENT();
+    if (g_agentRunning) agent_publish();
+    UNLOCK_AGENT();
+}
+
+int leak_tracker_agent_read(const char *path, LeakAgentSegment *out) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    int rc = -1;
+    if (!path || !out) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LeakAgentSegment)) {
+        close(fd);
+        return -1;
+    }
+    const LeakAgentSegment *seg = (const LeakAgentSegment*)mmap(NULL, sizeof(LeakAgentSegment),
+                                                                PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) return -1;
+    atomic_uint *seq   = (atomic_uint*)&seg->seq;
+    atomic_uint *magic = (atomic_uint*)&seg->magic;
+    /* A writer that died halfway leaves seq odd, so give up eventually. */
+    for (unsigned tries = 0; tries < 100000; tries++) {
+        if (atomic_load_explicit(magic, memory_order_acquire) != LEAK_TRACKER_AGENT_MAGIC ||
+            seg->size != sizeof(LeakAgentSegment)) break;
+        unsigned before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, seg, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before) {
+            rc = 0;
+            break;
+        }
+    }
+    munmap((void*)seg, sizeof(LeakAgentSegment));
+    return rc;
+#else
+    (void)path;
+    (void)out;
+    return -1;
+#endif
+}
+
+/* ========== Preload Mode ========== */
+
+#ifdef LEAK_TRACKER_PRELOAD
+/*
+ * Built with -DLEAK_TRACKER_PRELOAD -shared, this file interposes the C
+ * allocator so an unmodified binary can be tracked via LD_PRELOAD:
+ *
+ *   - the real functions are looked up with dlsym(RTLD_NEXT); dlsym may
+ *     itself allocate, which is served from a small static bootstrap arena
+ *     (never freed, recognised by address);
+ *   - t_inTracker is a per-thread reentrancy guard: whatever the C library
+ *     allocates on behalf of the tracker (stdio, backtrace, thread keys...)
+ *     goes straight to the real allocator;
+ *   - blocks allocated that way, or before the tracker was ready, are
+ *     untracked, so the sampling filter is switched on from the start and
+ *     frees of unknown pointers pass through silently.
+ *
+ * Configured from the environment: LEAK_TRACKER_STACK_DEPTH (frames per
+ * allocation, default 8), LEAK_TRACKER_SAMPLE_INTERVAL (bytes, default 0),
+ * LEAK_TRACKER_TRACE (record an allocation trace to this file),
+ * LEAK_TRACKER_AGENT (publish live stats to this file, "%p" = pid, every
+ * LEAK_TRACKER_AGENT_MS, default 1000) and LEAK_TRACKER_QUIET (no report
+ * at exit).
+ */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+#include <malloc.h>
+
+#define PRELOAD_FILE      "(preload)"
+#define BOOTSTRAP_SIZE    ((size_t)64 * 1024)
+#define BOOTSTRAP_ALIGN   16
+
+static void *(*g_realMalloc)(size_t);
+static void *(*g_realCalloc)(size_t, size_t);
+static void *(*g_realRealloc)(void*, size_t);
+static void  (*g_realFree)(void*);
+static int   (*g_realPosixMemalign)(void**, size_t, size_t);
+static void *(*g_realAlignedAlloc)(size_t, size_t);
+static size_t (*g_realUsableSize)(void*);
+
+static _Alignas(BOOTSTRAP_ALIGN) unsigned char g_bootstrap[BOOTSTRAP_SIZE];
+static _Atomic size_t g_bootstrapUsed = 0;
+
+static atomic_int g_preloadState = 0; /* 0 = not started, 1 = starting, 2 = ready */
+
+/* Allocation while the real functions are being looked up; zeroed, never reused */
+static void *bootstrap_alloc(size_t size) {
+    size_t need = BOOTSTRAP_ALIGN + ((size + BOOTSTRAP_ALIGN - 1) & ~(size_t)(BOOTSTRAP_ALIGN - 1));
+    size_t off  = atomic_fetch_add_explicit(&g_bootstrapUsed, need, memory_order_relaxed);
+    if (off + need > BOOTSTRAP_SIZE) return NULL;
+    memcpy(&g_bootstrap[off], &size, sizeof(size)); /* size kept in front for realloc */
+    return &g_bootstrap[off + BOOTSTRAP_ALIGN];
+}
+
+static int in_bootstrap(const void *ptr) {
+    return (const unsigned char*)ptr >= g_bootstrap &&
+           (const unsigned char*)ptr <  g_bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrap_size(const void *ptr) {
+    size_t size;
+    memcpy(&size, (const unsigned char*)ptr - BOOTSTRAP_ALIGN, sizeof(size));
+    return size;
+}
+
+static void resolve_real(void) {
+    static atomic_int resolving = 0;
+    if (atomic_exchange(&resolving, 1)) return; /* nested call from dlsym */
+    g_realCalloc        = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+    g_realMalloc        = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+    g_realRealloc       = (void *(*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+    g_realFree          = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+    g_realPosixMemalign = (int (*)(void**, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+    g_realAlignedAlloc  = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+    g_realUsableSize    = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+}
+
+static void *real_malloc(size_t size) {
+    if (!g_realMalloc) resolve_real();
+    return g_realMalloc ? g_realMalloc(size) : bootstrap_alloc(size);
+}
+
+static void *real_calloc(size_t count, size_t size) {
+    if (!g_realCalloc) resolve_real();
+    if (g_realCalloc) return g_realCalloc(count, size);
+    if (count && size > (size_t)(-1) / count) return NULL;
+    return bootstrap_alloc(count * size);
+}
+
+static void *real_realloc(void *ptr, size_t size) {
+    if (!g_realRealloc) resolve_real();
+    if (ptr && in_bootstrap(ptr)) {
+        size_t old = bootstrap_size(ptr);
+        void *p = real_malloc(size);
+        if (p) memcpy(p, ptr, old < size ? old : size);
+        return p;
+    }
+    return g_realRealloc ? g_realRealloc(ptr, size) : NULL;
+}
+
+static void real_free(void *ptr) {
+    if (!ptr || in_bootstrap(ptr)) return;
+    if (!g_realFree) resolve_real();
+    if (g_realFree) g_realFree(ptr);
+}
+
+static void preload_report(void) {
+    t_inTracker++;
+    if (getenv("LEAK_TRACKER_SCAN")) leak_tracker_scan(0, NULL);
+    log_memory_leaks(stderr);
+    log_memory_stats(stderr);
+    t_inTracker--;
+}
+
+static long env_number(const char *name, long fallback) {
+    const char *v = getenv(name);
+    return (v && *v) ? strtol(v, NULL, 10) : fallback;
+}
+
+/* 1 once the tracker may be used from this call, 0 to go to the real allocator */
+static int preload_ready(void) {
+    int state = atomic_load_explicit(&g_preloadState, memory_order_acquire);
+    if (state == 2) return 1;
+    int expected = 0;
+    if (state != 0 || !atomic_compare_exchange_strong(&g_preloadState, &expected, 1)) return 0;
+
+    t_inTracker++;
+    resolve_real();
+    ENSURE_INIT();
+    lock_all_shards();
+    filter_enable();
+    unlock_all_shards();
+    leak_tracker_set_stack_depth((int)env_number("LEAK_TRACKER_STACK_DEPTH", 8));
+    leak_tracker_set_sample_interval((size_t)env_number("LEAK_TRACKER_SAMPLE_INTERVAL", 0));
+    const char *agent = getenv("LEAK_TRACKER_AGENT");
+    if (agent && *agent) {
+        /* "%p" becomes the pid, so each process of a pipeline gets its own */
+        char path[4096];
+        const char *pid = strstr(agent, "%p");
+        if (pid && snprintf(path, sizeof(path), "%.*s%u%s", (int)(pid - agent), agent,
+                            (unsigned)getpid(), pid + 2) < (int)sizeof(path)) {
+            agent = path;
+        }
+        leak_tracker_start_agent(agent, (unsigned)env_number("LEAK_TRACKER_AGENT_MS", 1000));
+    }
+    const char *trace = getenv("LEAK_TRACKER_TRACE");
+    if (trace && *trace && leak_tracker_trace_start(trace, 0) == 0) atexit(leak_tracker_trace_stop);
+    if (!getenv("LEAK_TRACKER_QUIET")) atexit(preload_report);
+    t_inTracker--;
+
+    atomic_store_explicit(&g_preloadState, 2, memory_order_release);
+    return 1;
+}
+
+#define PRELOAD_BYPASS() (t_inTracker || !preload_ready())
+
+/* Requested size of a tracked block into *size; 0 if ptr is not one */
+static int tracked_size(void *ptr, size_t *size) {
+    if (g_filterOn && !filter_maybe(ptr)) return 0;
+    ThreadState *ts = thread_state();
+    if (BATCHING_ON() && ts) {
+        LOCK_CACHE(ts);
+        Allocation **pp = pending_find(ts, ptr);
+        if (pp) *size = (*pp)->requestedSize;
+        UNLOCK_CACHE(ts);
+        if (pp) return 1;
+    }
+    Shard *s = shard_for(ptr);
+    AllocTable *table;
+    LOCK_SHARD(s);
+    AllocSlot *slot = find_allocation_slot(s, ptr, &table);
+    if (!slot && BATCHING_ON()) {
+        UNLOCK_SHARD(s);
+        flush_all_caches();
+        LOCK_SHARD(s);
+        slot = find_allocation_slot(s, ptr, &table);
+    }
+    if (slot) *size = slot->alloc->requestedSize;
+    UNLOCK_SHARD(s);
+    return slot != NULL;
+}
+
+void *malloc(size_t size) {
+    if (PRELOAD_BYPASS()) return real_malloc(size);
+    t_inTracker++;
+    void *p = debug_malloc(size, PRELOAD_FILE, 0);
+    t_inTracker--;
+    return p;
+}
+
+void *calloc(size_t count, size_t size) {
+    if (PRELOAD_BYPASS()) return real_calloc(count, size);
+    t_inTracker++;
+    void *p = debug_calloc(count, size, PRELOAD_FILE, 0);
+    t_inTracker--;
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if ((ptr && in_bootstrap(ptr)) || PRELOAD_BYPASS()) return real_realloc(ptr, size);
+    t_inTracker++;
+    void *p = debug_realloc(ptr, size, PRELOAD_FILE, 0);
+    t_inTracker--;
+    return p;
+}
+
+void free(void *ptr) {
+    if (!ptr || in_bootstrap(ptr)) return;
+    if (PRELOAD_BYPASS()) {
+        real_free(ptr);
+        return;
+    }
+    t_inTracker++;
+    debug_free(ptr, PRELOAD_FILE, 0);
+    t_inTracker--;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (PRELOAD_BYPASS()) {
+        if (!g_realPosixMemalign) resolve_real();
+        return g_realPosixMemalign ? g_realPosixMemalign(out, alignment, size) : ENOMEM;
+    }
+    t_inTracker++;
+    int rc = debug_posix_memalign(out, alignment, size, PRELOAD_FILE, 0);
+    t_inTracker--;
+    return rc;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (PRELOAD_BYPASS()) {
+        if (!g_realAlignedAlloc) resolve_real();
+        return g_realAlignedAlloc ? g_realAlignedAlloc(alignment, size) : NULL;
+    }
+    t_inTracker++;
+    void *p = debug_aligned_alloc(alignment, size, PRELOAD_FILE, 0);
+    t_inTracker--;
+    return p;
+}
+
+static size_t real_usable_size(void *ptr) {
+    if (in_bootstrap(ptr)) return bootstrap_size(ptr);
+    if (!g_realUsableSize) resolve_real();
+    return g_realUsableSize ? g_realUsableSize(ptr) : 0;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (!ptr || in_bootstrap(ptr)) return ptr ? bootstrap_size(ptr) : 0;
+    if (!PRELOAD_BYPASS()) {
+        size_t size;
+        t_inTracker++;
+        int found = tracked_size(ptr, &size);
+        t_inTracker--;
+        if (found) return size;
+    }
+    return real_usable_size(ptr);
 }
+#endif /* LEAK_TRACKER_PRELOAD */
@@ -5,24 +5,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-/* 
- * If you don't want thread safety, define NO_THREAD_SAFE_LEAK_TRACKER 
- * before including this header. 
+/*
+ * If you don't want thread safety, define NO_THREAD_SAFE_LEAK_TRACKER
+ * before including this header (and when compiling leak_tracker.c).
+ * Otherwise link with -pthread.
  */
-#define NO_THREAD_SAFE_LEAK_TRACKER
 #ifndef NO_THREAD_SAFE_LEAK_TRACKER
   #include <pthread.h>
 #endif
 
+/*
+ * Define LEAK_TRACKER_INLINE_HEADER when compiling leak_tracker.c to store
+ * each allocation record in a header in front of the block instead of in a
+ * separately malloc'd node (one real malloc/free per call instead of two).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A call site. With GCC and Clang each macro call below gets its own static
+ * descriptor, so the tracker looks the site up once and then only keeps
+ * its 32-bit id in every record. 'id' belongs to the tracker.
+ */
+typedef struct {
+    const char *file;
+    int         line;
+    unsigned    id;   /* site id + 1 once registered, 0 before */
+} LeakTrackerSite;
+
 /* 
  * Macros to override standard allocation calls with debug versions.
  * Ensure this header is included AFTER system headers, 
  * so we don't collide with system prototypes.
+ * (LEAK_TRACKER_NO_MACROS leaves them out; leak_tracker.hpp does.
+ * LEAK_TRACKER_NO_SITE_IDS passes __FILE__ and __LINE__ on every call
+ * instead, e.g. for calls inside extern inline functions.)
  */
+#ifndef LEAK_TRACKER_NO_MACROS
+#if defined(__GNUC__) && !defined(LEAK_TRACKER_NO_SITE_IDS)
+#define LEAK_TRACKER_SITE() \
+    (__extension__ ({ static LeakTrackerSite lt_site_ = { __FILE__, __LINE__, 0 }; &lt_site_; }))
+#define malloc(size)              debug_malloc_site((size), LEAK_TRACKER_SITE())
+#define realloc(ptr, size)        debug_realloc_site((ptr), (size), LEAK_TRACKER_SITE())
+#define calloc(count, size)       debug_calloc_site((count), (size), LEAK_TRACKER_SITE())
+#define free(ptr)                 debug_free_site((ptr), LEAK_TRACKER_SITE())
+#define aligned_alloc(al, size)   debug_aligned_alloc_site((al), (size), LEAK_TRACKER_SITE())
+#define posix_memalign(out, al, size) debug_posix_memalign_site((out), (al), (size), LEAK_TRACKER_SITE())
+#else
 #define malloc(size)              debug_malloc((size), __FILE__, __LINE__)
 #define realloc(ptr, size)        debug_realloc((ptr), (size), __FILE__, __LINE__)
 #define calloc(count, size)       debug_calloc((count), (size), __FILE__, __LINE__)
 #define free(ptr)                 debug_free((ptr), __FILE__, __LINE__)
+#define aligned_alloc(al, size)   debug_aligned_alloc((al), (size), __FILE__, __LINE__)
+#define posix_memalign(out, al, size) debug_posix_memalign((out), (al), (size), __FILE__, __LINE__)
+#endif
+#endif
 
 /* Memory usage statistics. */
 typedef struct {
@@ -30,6 +69,25 @@ typedef struct {
     size_t currentAllocated;  /* Currently in-use bytes */
     size_t peakAllocated;     /* Peak in-use bytes observed */
     size_t allocationCount;   /* Number of active (not yet freed) allocations */
+    size_t trackerOverhead;   /* Bytes held by the tracker itself (records, tables, quarantine) */
+    /*
+     * What the live blocks really take from the system allocator: the
+     * requested bytes, plus the tracker's header, padding and guards
+     * around them, plus the allocator's rounding up to its size classes
+     * (malloc_usable_size() and the like; 0 where there is none).
+     */
+    size_t overheadBytes;     /* Header, alignment padding and guard zones or pages */
+    size_t slackBytes;        /* Usable bytes beyond what the tracker asked for */
+    size_t usableBytes;       /* currentAllocated + overheadBytes + slackBytes */
+    /*
+     * With sampling on, the fields above only cover the sampled blocks;
+     * these scale them up to the whole program (equal to the exact values
+     * when sampling is off).
+     */
+    size_t sampleInterval;    /* Average bytes between samples, 0 = every block tracked */
+    size_t estimatedBytes;    /* Estimated in-use bytes */
+    size_t estimatedBlocks;   /* Estimated active allocations */
+    size_t estimatedError;    /* ~95% error bound on estimatedBytes (2 standard deviations) */
 } MemStats;
 
 /* Debug allocation function declarations */
@@ -38,12 +96,457 @@ void* debug_realloc(void *ptr, size_t size, const char *file, int line);
 void* debug_calloc (size_t count, size_t size, const char *file, int line);
 void  debug_free   (void *ptr, const char *file, int line);
 
+/*
+ * Every tracked block is aligned like malloc's (max_align_t); these give
+ * more, with the same guards. Freed with free(), resized with realloc()
+ * (which keeps the alignment).
+ */
+void* debug_aligned_alloc (size_t alignment, size_t size, const char *file, int line);
+int   debug_posix_memalign(void **out, size_t alignment, size_t size, const char *file, int line);
+
+/* The same, taking a call site descriptor (what the macros use) */
+void* debug_malloc_site (size_t size, LeakTrackerSite *site);
+void* debug_realloc_site(void *ptr, size_t size, LeakTrackerSite *site);
+void* debug_calloc_site (size_t count, size_t size, LeakTrackerSite *site);
+void  debug_free_site   (void *ptr, LeakTrackerSite *site);
+void* debug_aligned_alloc_site (size_t alignment, size_t size, LeakTrackerSite *site);
+int   debug_posix_memalign_site(void **out, size_t alignment, size_t size, LeakTrackerSite *site);
+
+/*
+ * Entry points for the C++ front end (leak_tracker.hpp). 'kind' records how
+ * a block must be freed; freeing it another way (free() on new'd memory,
+ * delete on new[]) is reported, and so is a sized delete with the wrong
+ * size. alignment 0 means malloc's. debug_new returns NULL when out of
+ * memory; debug_delete takes size 0 when it isn't known.
+ */
+#define LEAK_TRACKER_KIND_MALLOC    0
+#define LEAK_TRACKER_KIND_NEW       1
+#define LEAK_TRACKER_KIND_NEW_ARRAY 2
+void* debug_new   (size_t size, size_t alignment, int kind, const char *file, int line);
+void  debug_delete(void *ptr, size_t size, int kind, const char *file, int line);
+
 /* Logging and stats */
 void  log_memory_leaks(FILE *out);
 void  log_memory_stats(FILE *out);
 void  get_memory_stats(MemStats *statsOut);
 
+/*
+ * Per call site totals, kept up to date as blocks come and go so reports
+ * don't have to walk every live block. With sampling on they only count
+ * the sampled blocks.
+ */
+typedef struct {
+    const char *file;
+    int         line;
+    size_t      liveCount;   /* Active allocations made here */
+    size_t      liveBytes;   /* Their requested bytes */
+    size_t      peakBytes;   /* Highest liveBytes observed */
+    size_t      totalCount;  /* Allocations ever made here */
+    size_t      totalBytes;  /* Bytes ever allocated here (realloc growth included) */
+    unsigned    id;          /* Site id, for leak_tracker_enable_site() */
+} LeakSite;
+
+/* Fill out[] with up to maxSites sites holding the most live bytes, biggest first */
+size_t get_leak_sites(LeakSite *out, size_t maxSites);
+/* Print the topN sites by live bytes (0 = all of them) */
+void  log_leak_sites(FILE *out, size_t topN);
+/*
+ * Stop (enabled = 0) or resume tracking new blocks from a site. Blocks it
+ * already made stay tracked; over-aligned ones always are.
+ */
+void  leak_tracker_enable_site(unsigned site, int enabled);
+
+/*
+ * Budgets: once a site (an id from get_leak_sites(), or
+ * LEAK_TRACKER_ALL_SITES for the whole process) would hold more than
+ * 'bytes' live bytes, malloc and growing reallocs fail (return NULL) and a
+ * diagnostic is queued. 0 removes the budget. The process total is exact
+ * for one thread and within 64 KB per other allocating thread.
+ * A handler, if set, is asked first with the site (or
+ * LEAK_TRACKER_ALL_SITES), the bytes requested, the live bytes and the
+ * budget; returning non-zero lets the allocation go ahead. It runs inside
+ * the allocation call (for realloc with a lock held), so it must not
+ * allocate or free through the tracker.
+ *
+ * Failure injection: every everyN-th call at a site (0 = off) fails, and
+ * otherwise each call fails with 'probability', drawn from a hash of the
+ * seed and the call's number at that site, so a run making calls in the
+ * same order fails the same ones. With LEAK_TRACKER_ALL_SITES it counts
+ * all calls. Settings apply to malloc, calloc, realloc and new, tracked
+ * or not.
+ *
+ * None of this costs more than one branch until something is set, and
+ * the checks only read counters the tracker keeps anyway.
+ */
+#define LEAK_TRACKER_ALL_SITES ((unsigned)-1)
+typedef int (*LeakBudgetHandler)(void *ctx, unsigned site, size_t request, size_t live, size_t budget);
+
+void  leak_tracker_set_budget(unsigned site, size_t bytes);
+void  leak_tracker_set_budget_handler(LeakBudgetHandler handler, void *ctx);
+void  leak_tracker_inject_failures(unsigned site, unsigned long long everyN, double probability);
+void  leak_tracker_set_failure_seed(unsigned long long seed);
+/* Calls failed so far by injection and by budgets */
+void  leak_tracker_get_failures(size_t *injected, size_t *overBudget);
+
+/*
+ * Heap snapshots for servers that always hold a lot of live memory.
+ * A snapshot is only a point in time (every block records when it was
+ * allocated), so taking one costs nothing and never blocks other threads.
+ * leak_tracker_diff() reports, per call site, the blocks allocated since
+ * snapshot a that are still live, in liveCount/liveBytes, biggest first.
+ * Blocks don't record when they were freed, so the diff is always against
+ * now: b must be 0, anything else returns 0 sites. It walks the live set
+ * one shard at a time, letting other threads in every thousand slots.
+ * Blocks those threads allocate or free meanwhile move others around in
+ * the shard's table, so the counts are then approximate: a block may be
+ * missed or counted twice.
+ */
+typedef unsigned long long LeakSnapshot;
+
+LeakSnapshot leak_tracker_snapshot(void);
+size_t leak_tracker_diff(LeakSnapshot a, LeakSnapshot b, LeakSite *out, size_t maxSites);
+void  log_snapshot_diff(FILE *out, LeakSnapshot a, LeakSnapshot b, size_t topN);
+
+/*
+ * Epochs, for scoped leak checks (e.g. one per request): blocks this thread
+ * allocates between begin and end are tagged with the epoch, wherever they
+ * are freed later. end() reports how many of them are still live, in O(1);
+ * epoch_live() asks again later. Epochs nest: end() returns to the
+ * enclosing one. Up to LEAK_TRACKER_EPOCHS (1024) epochs can be active at
+ * once (begin returns 0 beyond that). An ended epoch stays queryable until
+ * its slot is needed again, then gives -1. With sampling on, only sampled
+ * blocks are tagged.
+ */
+unsigned leak_tracker_epoch_begin(void);
+int   leak_tracker_epoch_end(unsigned epoch, size_t *blocks, size_t *bytes);
+int   leak_tracker_epoch_live(unsigned epoch, size_t *blocks, size_t *bytes);
+/* List the blocks of an epoch that are still live (walks only those) */
+void  log_epoch_leaks(FILE *out, unsigned epoch);
+
+/*
+ * Realloc call sites: how the blocks they resize grow, and what it costs.
+ * A realloc that moves a block copies its data; growing one element at a
+ * time that way copies O(n^2) bytes, which 'quadratic' flags.
+ */
+typedef struct {
+    const char *file;
+    int         line;
+    size_t      reallocs;      /* Calls on tracked blocks from here */
+    size_t      moved;         /* ... that moved the block */
+    size_t      bytesCopied;   /* Bytes copied by those moves */
+    size_t      bytesGrown;    /* Bytes added by the growing calls */
+    double      avgGrowth;     /* Mean new/old size of the growing calls */
+    size_t      longestChain;  /* Most reallocs seen on a single block (up to 4095) */
+    int         quadratic;     /* Copies dwarf growth: add a capacity hint */
+} ReallocSite;
+
+/* Fill out[] with up to maxSites realloc sites copying the most bytes, biggest first */
+size_t get_realloc_sites(ReallocSite *out, size_t maxSites);
+/* Print the topN realloc sites by bytes copied (0 = all of them) */
+void  log_realloc_sites(FILE *out, size_t topN);
+
+/*
+ * Internal fragmentation per call site: what its live blocks take from the
+ * system allocator beyond their requested bytes. Slack is the allocator's
+ * rounding of the real blocks, which include the tracker's guards, so it
+ * is an estimate of the rounding the same sizes get without the tracker.
+ * Sites with a lot of slack per block gain most from asking for a size
+ * class boundary.
+ */
+typedef struct {
+    const char *file;
+    int         line;
+    size_t      liveCount;     /* Active allocations made here */
+    size_t      liveBytes;     /* Their requested bytes */
+    size_t      overheadBytes; /* Tracker header, padding and guards on them */
+    size_t      slackBytes;    /* Allocator rounding on them */
+    unsigned    id;            /* Site id, as in LeakSite */
+} SlackSite;
+
+/* Fill out[] with up to maxSites sites wasting the most slack bytes, biggest first */
+size_t get_slack_sites(SlackSite *out, size_t maxSites);
+/* Print the topN sites by slack bytes (0 = all of them) */
+void  log_slack_sites(FILE *out, size_t topN);
+
+/*
+ * Histograms, merged from per-thread counts when read. Bin b holds values
+ * from leak_tracker_hist_bin_low(b) up to the next bin's low value: one
+ * bin each for 0..3, then four per power of two. Lifetimes are in clock
+ * ticks (the TSC on x86); ticksPerSecond converts them (0 if not measured
+ * yet). With sampling on they only count the sampled blocks.
+ */
+#define LEAK_TRACKER_HIST_BINS 256
+typedef struct {
+    size_t sizes[LEAK_TRACKER_HIST_BINS];     /* Blocks allocated, by requested size */
+    size_t growth[LEAK_TRACKER_HIST_BINS];    /* Growing reallocs, by bytes added */
+    size_t lifetimes[LEAK_TRACKER_HIST_BINS]; /* Freed blocks, by ticks they were live */
+    double ticksPerSecond;
+} MemHistograms;
+
+void  get_memory_histograms(MemHistograms *out);
+unsigned long long leak_tracker_hist_bin_low(unsigned bin);
+void  log_memory_histograms(FILE *out);
+
+/*
+ * Streaming export of the stats and every live block, for tools: as JSON
+ * lines (one object per line, "type" = "stats", "block" or "end") or in a
+ * compact binary form. Output goes through a small buffer to 'sink', which
+ * returns 0 on success; anything else stops the export. The sink is called
+ * with a shard locked, so it must not allocate through the tracker.
+ * Returns 0, or -1 if the sink failed.
+ */
+#define LEAK_TRACKER_JSON   0
+#define LEAK_TRACKER_BINARY 1
+typedef int (*LeakTrackerSink)(void *ctx, const void *data, size_t len);
+
+int   leak_tracker_export(int format, LeakTrackerSink sink, void *ctx);
+int   leak_tracker_export_fd(int format, int fd);
+/* Turn a binary export read from 'in' into the JSON lines of the same export */
+int   leak_tracker_decode(FILE *in, LeakTrackerSink sink, void *ctx);
+
+/*
+ * Allocation tracing: from leak_tracker_trace_start() until _stop(), every
+ * malloc, calloc, realloc and free made through the tracker (tracked or
+ * not) is appended to the binary file 'path' with its time, thread, call
+ * site, size and pointer. Each thread writes to its own memory-mapped
+ * chunk of chunkBytes (rounded to pages; 0 = 1 MB), so recording takes no
+ * lock. Returns 0, or -1 if the file can't be created, a trace is already
+ * running or there is no mmap().
+ *
+ * leak_tracker_trace_read() calls 'cb' for every event of a trace file,
+ * all threads merged in time order, until cb returns non-zero (which is
+ * then returned). Returns 0 at the end, -1 if the file is unreadable. A
+ * trace that was never stopped (the program crashed) is still readable,
+ * only without file names and real times.
+ */
+#define LEAK_TRACKER_TRACE_MALLOC  1 /* also aligned_alloc, posix_memalign, new */
+#define LEAK_TRACKER_TRACE_CALLOC  2
+#define LEAK_TRACKER_TRACE_REALLOC 3
+#define LEAK_TRACKER_TRACE_FREE    4 /* also delete */
+
+typedef struct {
+    int                op;        /* LEAK_TRACKER_TRACE_* */
+    int                kind;      /* LEAK_TRACKER_KIND_* */
+    unsigned           thread;    /* recording thread, numbered from 0 */
+    unsigned           site;      /* site id in the recording run (not for frees) */
+    const char        *file;      /* that site, NULL if unknown */
+    int                line;
+    unsigned long long ns;        /* since the trace started */
+    size_t             size;      /* requested size (calloc: count * size) */
+    size_t             alignment; /* 0 = malloc's */
+    unsigned long long ptr;       /* block returned or freed */
+    unsigned long long oldPtr;    /* realloc: block passed in (0 = NULL) */
+} LeakTraceEvent;
+
+typedef int (*LeakTraceCallback)(void *ctx, const LeakTraceEvent *ev);
+
+int   leak_tracker_trace_start(const char *path, size_t chunkBytes);
+void  leak_tracker_trace_stop(void);
+int   leak_tracker_trace_read(const char *path, LeakTraceCallback cb, void *ctx);
+
+/*
+ * Live introspection: the agent publishes MemStats, the top sites by live
+ * bytes and the histograms into a shared file mapping at 'path' (e.g.
+ * /dev/shm/myapp.leaks) every intervalMs, from its own thread. It reads
+ * the same lock-free counters as get_memory_stats(), so it never takes a
+ * lock that allocation needs. intervalMs == 0 publishes only on
+ * leak_tracker_agent_publish(), which is also the only way to update the
+ * segment in NO_THREAD_SAFE_LEAK_TRACKER builds. Returns 0, or -1 if an
+ * agent is already running or the file can't be mapped.
+ *
+ * Other processes call leak_tracker_agent_read() (or map the file
+ * themselves) to read a segment. A seqlock guards it: 'seq' is odd while
+ * an update is in progress, and a reader copies and retries if seq has
+ * changed meanwhile. Readers never block the writer. The layout only
+ * matches between builds for the same architecture, so check 'size'.
+ */
+#define LEAK_TRACKER_AGENT_MAGIC 0x4C544147u /* "LTAG" */
+#define LEAK_TRACKER_AGENT_SITES 32
+#define LEAK_TRACKER_AGENT_FILE  96
+
+typedef struct {
+    char        file[LEAK_TRACKER_AGENT_FILE]; /* longer names keep their end */
+    int         line;
+    unsigned    id;
+    size_t      liveCount;
+    size_t      liveBytes;
+    size_t      peakBytes;
+    size_t      totalCount;
+    size_t      totalBytes;
+} LeakAgentSite;
+
+typedef struct {
+    unsigned            magic;     /* LEAK_TRACKER_AGENT_MAGIC once the first update is in */
+    unsigned            size;      /* sizeof(LeakAgentSegment) of the writer */
+    unsigned            pid;
+    unsigned            seq;       /* seqlock, odd while being written */
+    unsigned long long  updates;
+    unsigned long long  timeNs;    /* wall clock of the last update */
+    MemStats            stats;
+    unsigned            siteCount;
+    LeakAgentSite       sites[LEAK_TRACKER_AGENT_SITES]; /* biggest first */
+    MemHistograms       hist;
+} LeakAgentSegment;
+
+int   leak_tracker_start_agent(const char *path, unsigned intervalMs);
+void  leak_tracker_stop_agent(void);
+void  leak_tracker_agent_publish(void);
+/* A consistent copy of the segment at 'path'; 0, or -1 if it isn't one */
+int   leak_tracker_agent_read(const char *path, LeakAgentSegment *out);
+
 /* Force-free everything currently tracked (be cautious!) */
 void  free_all_tracked(void);
 
+/*
+ * Teardown of everything tracked, e.g. at the end of a test or on exit.
+ * The tables go wholesale; the records go back to the tracker's pool and
+ * only the memory of records no thread holds is released, so threads may
+ * keep allocating meanwhile (their new blocks may or may not be torn down).
+ *   FREE   - free every block (free_all_tracked() is this, on one thread),
+ *            using up to 'threads' threads (0 = one per shard).
+ *   FORGET - drop the records and leave the blocks alone, for a clean
+ *            exit: no free() per block. Later frees of forgotten blocks
+ *            are ignored, reallocs of them fail; other pointers the
+ *            tracker doesn't know still go to free() and realloc().
+ * No other thread may use the blocks that exist when it starts. Under LD_PRELOAD the C
+ * library's own blocks (stdio buffers...) are tracked too, so only FORGET
+ * is safe there short of exit.
+ *
+ * leak_tracker_teardown_step() frees at most maxBlocks tracked blocks, as
+ * if free() had been called on each (guard zones checked, pointers
+ * quarantined, lifetimes counted), taking one shard lock at a time, so an
+ * event loop can tear down a large heap without long pauses. Returns how
+ * many blocks are still tracked; blocks allocated in between are freed by
+ * later steps.
+ */
+#define LEAK_TRACKER_TEARDOWN_FREE   0
+#define LEAK_TRACKER_TEARDOWN_FORGET 1
+void  leak_tracker_teardown(int mode, unsigned threads);
+size_t leak_tracker_teardown_step(size_t maxBlocks);
+
+/*
+ * Double-free quarantine: remember up to maxEntries freed pointers totalling
+ * at most maxBytes (oldest are forgotten first). With delayReuse != 0 freed
+ * blocks are only returned to the system when they leave the quarantine, so
+ * their addresses cannot be reused while still being watched.
+ * Defaults: 65536 entries, 64 MB, no delayed reuse. maxEntries == 0 disables.
+ */
+void  leak_tracker_set_quarantine(size_t maxEntries, size_t maxBytes, int delayReuse);
+
+/*
+ * Guard zones: every block is surrounded by 'bytes' of a known pattern on
+ * each side (rounded up to a multiple of 8, between 8 (the default) and
+ * 4096), checked when it is freed or resized. Applies to blocks allocated
+ * afterwards; only change it while no other thread is using the tracker.
+ */
+void  leak_tracker_set_guard_size(size_t bytes);
+
+/*
+ * Guard pages: new blocks of minSize..maxSize bytes are placed at the end
+ * of their own pages, right before an inaccessible page, so an overrun
+ * crashes on the faulting store instead of being found at free time; freed
+ * ones are made inaccessible for a while too. This costs at least two pages
+ * per block, so keep the range narrow or set sampledOnly to only do it for
+ * blocks picked by sampling. maxSize == 0 (the default) turns it off. Only
+ * change it while no other thread is using the tracker; a no-op without
+ * mmap().
+ */
+void  leak_tracker_set_guard_pages(size_t minSize, size_t maxSize, int sampledOnly);
+
+/*
+ * Check the header and guard zones of every live block now, using up to
+ * 'threads' threads (0 = one per shard). Each damaged block is reported
+ * like a corruption found at free time; returns how many there were.
+ */
+size_t leak_tracker_verify_heap(unsigned threads);
+
+/*
+ * Reachability scan (Linux), a conservative mark phase like LeakSanitizer's.
+ * Every aligned word that holds the start of a tracked block marks that
+ * block as still reachable. The words scanned are the writable data of
+ * the loaded objects (data, bss), the scanning thread's thread-locals,
+ * the stacks of the threads that use the tracker and the contents of every
+ * reachable block. The blocks left over are definitely lost, or
+ * indirectly lost if only other lost blocks point at them (in a cycle of
+ * lost blocks one of them counts as definitely lost).
+ *
+ * Each record keeps its label until the next scan and log_memory_leaks()
+ * prints it. Up to 'threads' threads scan (0 = one per CPU). Allocation
+ * and free wait until the scan is done. Other threads should be idle,
+ * since their stacks are read as they are. Pointers kept only in
+ * untracked memory (sampled-out blocks, other allocators, the main
+ * thread's thread-locals if another thread scans), or only into the
+ * middle of a block, are not seen. Returns 0, or -1 where there is no
+ * scan or on OOM.
+ */
+#define LEAK_TRACKER_REACH_UNKNOWN   0 /* allocated since the last scan */
+#define LEAK_TRACKER_REACH_REACHABLE 1
+#define LEAK_TRACKER_REACH_INDIRECT  2
+#define LEAK_TRACKER_REACH_LOST      3
+
+typedef struct {
+    size_t reachableBlocks, reachableBytes;
+    size_t indirectBlocks,  indirectBytes;
+    size_t lostBlocks,      lostBytes;
+} LeakReachability;
+
+int   leak_tracker_scan(unsigned threads, LeakReachability *out);
+/* Scan, then print the totals and the lost blocks only, definitely lost first */
+void  log_lost_blocks(FILE *out, unsigned threads);
+
+/*
+ * Threading mode of a thread-safe build:
+ *   LOCKED  - every call updates the shared tables under a shard lock.
+ *   BATCHED - new blocks are batched per thread and published in groups;
+ *             blocks freed by the thread that allocated them soon after
+ *             never reach the shared tables.
+ *   SINGLE  - no locking at all, for programs that only ever allocate
+ *             from one thread.
+ * Only switch while no other thread is using the tracker. No-op when built
+ * with NO_THREAD_SAFE_LEAK_TRACKER.
+ */
+#define LEAK_TRACKER_THREADS_LOCKED  0
+#define LEAK_TRACKER_THREADS_BATCHED 1
+#define LEAK_TRACKER_THREADS_SINGLE  2
+void  leak_tracker_set_thread_mode(int mode);
+
+/*
+ * Record the call stack of each tracked allocation, up to 'depth' frames
+ * (at most 32; 0, the default, turns it off). Identical stacks are stored
+ * once, and log_memory_leaks() prints the stack under each leak. Function
+ * names need the program to be linked with -rdynamic. Only available where
+ * backtrace() is (glibc, macOS); a no-op elsewhere.
+ */
+void  leak_tracker_set_stack_depth(int depth);
+
+/*
+ * Sampling: track only about one allocation per 'bytes' allocated (chosen
+ * at random, weighted by size) and hand the others straight to the system
+ * allocator. Leak reports and MemStats then include scaled estimates.
+ * 0 (the default) tracks every allocation. Only change it while no other
+ * thread is using the tracker; double frees and overruns are only caught
+ * on sampled blocks.
+ */
+void  leak_tracker_set_sample_interval(size_t bytes);
+
+/*
+ * Diagnostics (double free, unknown pointer, corruption) are queued and
+ * written out later, never from inside the allocation calls. Each call site
+ * reports at most a few identical events per drain; the rest are counted
+ * and summarised. Pending diagnostics are also written to stderr by
+ * log_memory_leaks().
+ *
+ * leak_tracker_drain() writes what is queued (to stderr if out is NULL) and
+ * returns the number of lines written. The reporter thread does the same
+ * every intervalMs until stopped; returns 0 on success, -1 if already
+ * running or unavailable (NO_THREAD_SAFE_LEAK_TRACKER builds).
+ */
+size_t leak_tracker_drain(FILE *out);
+int   leak_tracker_start_reporter(FILE *out, unsigned intervalMs);
+void  leak_tracker_stop_reporter(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LEAK_TRACKER_H */
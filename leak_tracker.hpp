@@ -0,0 +1,218 @@
+#ifndef LEAK_TRACKER_HPP
+#define LEAK_TRACKER_HPP
+
+/*
+ * C++ front end. Replaces the global operator new/delete (all of the sized,
+ * aligned and nothrow forms) with tracked ones, and offers
+ * leak_tracker::allocator<T> for containers. Blocks remember how they were
+ * allocated, so free() on new'd memory or delete on new[]'d memory is
+ * reported.
+ *
+ * The replacement operators have to be defined in exactly one translation
+ * unit: define LEAK_TRACKER_DEFINE_NEW before including this header there.
+ * Compile leak_tracker.c as C and link it in as usual.
+ *
+ * The C malloc macros are left out here (they would clash with std::malloc
+ * in library headers); C++ code is tracked through new and the allocator.
+ */
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+#if __cplusplus >= 202002L && defined(__has_include)
+  #if __has_include(<source_location>)
+    #include <source_location>
+  #endif
+#endif
+
+#ifndef LEAK_TRACKER_NO_MACROS
+  #define LEAK_TRACKER_NO_MACROS
+#endif
+#include "leak_tracker.h"
+
+namespace leak_tracker {
+
+namespace detail {
+
+/* operator new semantics: retry through the new handler, then throw */
+inline void* allocate(std::size_t size, std::size_t alignment, int kind,
+                      const char *file, int line) {
+    for (;;) {
+        void *p = debug_new(size, alignment, kind, file, line);
+        if (p) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+inline void* allocate_nothrow(std::size_t size, std::size_t alignment, int kind,
+                              const char *file, int line) noexcept {
+    try {
+        return allocate(size, alignment, kind, file, line);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+} // namespace detail
+
+/*
+ * Allocator recording the call site it was created at, e.g.
+ *
+ *   std::vector<int, leak_tracker::allocator<int>> v{leak_tracker::allocator<int>()};
+ *
+ * (a container that creates its own allocator records the line inside the
+ * library header instead). Rebound copies share the site.
+ */
+template <class T>
+class allocator {
+public:
+    using value_type      = T;
+    using is_always_equal = std::true_type;
+
+#ifdef __cpp_lib_source_location
+    allocator(std::source_location loc = std::source_location::current()) noexcept
+        : file_(loc.file_name()), line_(static_cast<int>(loc.line())) {}
+#elif defined(__GNUC__)
+    allocator(const char *file = __builtin_FILE(), int line = __builtin_LINE()) noexcept
+        : file_(file), line_(line) {}
+#else
+    allocator(const char *file = "(allocator)", int line = 0) noexcept
+        : file_(file), line_(line) {}
+#endif
+
+    template <class U>
+    allocator(const allocator<U>& other) noexcept : file_(other.file_), line_(other.line_) {}
+
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(detail::allocate(n * sizeof(T), alignof(T),
+                                                LEAK_TRACKER_KIND_NEW, file_, line_));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        debug_delete(p, n * sizeof(T), LEAK_TRACKER_KIND_NEW, file_, line_);
+    }
+
+    template <class U>
+    bool operator==(const allocator<U>&) const noexcept { return true; }
+    template <class U>
+    bool operator!=(const allocator<U>&) const noexcept { return false; }
+
+private:
+    template <class U> friend class allocator;
+
+    const char *file_;
+    int         line_;
+};
+
+} // namespace leak_tracker
+
+/*
+ * new with a call site: LEAK_TRACKER_NEW Foo(args) records this file and
+ * line instead of "operator new". Delete as usual.
+ */
+inline void* operator new(std::size_t size, const char *file, int line) {
+    return leak_tracker::detail::allocate(size, 0, LEAK_TRACKER_KIND_NEW, file, line);
+}
+inline void* operator new[](std::size_t size, const char *file, int line) {
+    return leak_tracker::detail::allocate(size, 0, LEAK_TRACKER_KIND_NEW_ARRAY, file, line);
+}
+/* Only called if the constructor throws */
+inline void operator delete(void *p, const char *file, int line) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW, file, line);
+}
+inline void operator delete[](void *p, const char *file, int line) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW_ARRAY, file, line);
+}
+#define LEAK_TRACKER_NEW new (__FILE__, __LINE__)
+
+#ifdef LEAK_TRACKER_DEFINE_NEW
+
+#define LEAK_TRACKER_OP_NEW    "operator new", 0
+#define LEAK_TRACKER_OP_DELETE "operator delete", 0
+
+void* operator new(std::size_t size) {
+    return leak_tracker::detail::allocate(size, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_NEW);
+}
+void* operator new[](std::size_t size) {
+    return leak_tracker::detail::allocate(size, 0, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_NEW);
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return leak_tracker::detail::allocate_nothrow(size, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_NEW);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return leak_tracker::detail::allocate_nothrow(size, 0, LEAK_TRACKER_KIND_NEW_ARRAY,
+                                                  LEAK_TRACKER_OP_NEW);
+}
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t al) {
+    return leak_tracker::detail::allocate(size, static_cast<std::size_t>(al),
+                                          LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_NEW);
+}
+void* operator new[](std::size_t size, std::align_val_t al) {
+    return leak_tracker::detail::allocate(size, static_cast<std::size_t>(al),
+                                          LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_NEW);
+}
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return leak_tracker::detail::allocate_nothrow(size, static_cast<std::size_t>(al),
+                                                  LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_NEW);
+}
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return leak_tracker::detail::allocate_nothrow(size, static_cast<std::size_t>(al),
+                                                  LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_NEW);
+}
+#endif
+
+/* The alignment isn't needed to free; sizes are checked against the record. */
+void operator delete(void *p) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete(void *p, std::size_t size) noexcept {
+    debug_delete(p, size, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p, std::size_t size) noexcept {
+    debug_delete(p, size, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+#ifdef __cpp_aligned_new
+void operator delete(void *p, std::align_val_t) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete(void *p, std::size_t size, std::align_val_t) noexcept {
+    debug_delete(p, size, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p, std::size_t size, std::align_val_t) noexcept {
+    debug_delete(p, size, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+#endif
+void operator delete(void *p, const std::nothrow_t&) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p, const std::nothrow_t&) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+#ifdef __cpp_aligned_new
+void operator delete(void *p, std::align_val_t, const std::nothrow_t&) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW, LEAK_TRACKER_OP_DELETE);
+}
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t&) noexcept {
+    debug_delete(p, 0, LEAK_TRACKER_KIND_NEW_ARRAY, LEAK_TRACKER_OP_DELETE);
+}
+#endif
+
+#undef LEAK_TRACKER_OP_NEW
+#undef LEAK_TRACKER_OP_DELETE
+
+#endif /* LEAK_TRACKER_DEFINE_NEW */
+
+#endif /* LEAK_TRACKER_HPP */
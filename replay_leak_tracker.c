@@ -0,0 +1,425 @@
+/*
+ * Replays an allocation trace written by leak_tracker_trace_start() (or by
+ * the preload library with LEAK_TRACKER_TRACE=file) as fast as possible,
+ * either through the tracker or on the system allocator. To try another
+ * allocator, run the "-s" mode with it preloaded:
+ *
+ *   ./replay_leak_tracker trace.bin            # through the tracker
+ *   ./replay_leak_tracker -s trace.bin         # system allocator
+ *   LD_PRELOAD=libjemalloc.so ./replay_leak_tracker -s trace.bin
+ *
+ * The trace is decoded up front and its pointers are turned into slot
+ * numbers, so the timed loop does nothing but allocator calls. Events of
+ * all threads are replayed from one thread in time order. Frees and
+ * reallocs of blocks the trace never saw allocated (they predate the
+ * trace) are counted as skipped; such reallocs are replayed as mallocs.
+ *
+ * Prints one JSON line per run, like bench_leak_tracker:
+ *   {"trace":..,"allocator":..,"run":1,"ops":..,"skipped":..,"ns_per_op":..,
+ *    "rss":..,"live_blocks":..,"live_bytes":..}
+ * With the tracker, "-l N" also prints the N sites holding the most memory
+ * at the end of the trace, and "-t file" traces the replay itself.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#define LEAK_TRACKER_NO_MACROS
+#include "leak_tracker.h"
+
+/* One event, with pointers replaced by slot numbers */
+typedef struct {
+    unsigned char op;
+    unsigned char kind;
+    unsigned char alignShift; /* 0 = malloc's alignment */
+    unsigned      slot;
+    unsigned      oldSlot;    /* realloc; NO_SLOT = replayed as malloc */
+    unsigned      site;       /* index into g_sites */
+    size_t        size;
+} ReplayOp;
+
+typedef struct {
+    const char *file;
+    int         line;
+} ReplaySite;
+
+#define NO_SLOT ((unsigned)-1)
+
+/* Trace pointer -> slot, open addressing; only used while loading */
+typedef struct {
+    unsigned long long key;   /* 0 = empty */
+    unsigned           slot;
+} PtrEntry;
+
+static ReplayOp   *g_ops      = NULL;
+static size_t      g_opCount  = 0, g_opCap = 0;
+static ReplaySite *g_sites    = NULL;
+static size_t      g_siteCap  = 0;
+static PtrEntry   *g_map      = NULL;
+static size_t      g_mapCap   = 0, g_mapUsed = 0;
+static unsigned   *g_freeSlots = NULL;
+static size_t      g_freeCount = 0, g_freeCap = 0;
+static unsigned    g_slotCount = 0;
+static size_t      g_skipped   = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static long long rss_bytes(void) {
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long long size = 0, resident = 0;
+        int n = fscanf(f, "%lld %lld", &size, &resident);
+        fclose(f);
+        if (n == 2) {
+            return resident * (long long)sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return (long long)ru.ru_maxrss;
+#else
+    return (long long)ru.ru_maxrss * 1024;
+#endif
+}
+
+static int grow(void **array, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t newCap = *cap ? *cap * 2 : 1024;
+    while (newCap < need) {
+        newCap *= 2;
+    }
+    void *p = realloc(*array, newCap * elem);
+    if (!p) {
+        return -1;
+    }
+    memset((char *)p + *cap * elem, 0, (newCap - *cap) * elem);
+    *array = p;
+    *cap = newCap;
+    return 0;
+}
+
+static size_t map_hash(unsigned long long key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDull;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+static PtrEntry *map_find(unsigned long long key) {
+    size_t mask = g_mapCap - 1;
+    size_t i = map_hash(key) & mask;
+    while (g_map[i].key && g_map[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &g_map[i];
+}
+
+/* Backward-shift deletion keeps probe chains intact without tombstones. */
+static void map_remove(PtrEntry *e) {
+    size_t mask = g_mapCap - 1;
+    size_t i = (size_t)(e - g_map);
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!g_map[j].key) {
+            break;
+        }
+        size_t home = map_hash(g_map[j].key) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_map[i] = g_map[j];
+            i = j;
+        }
+    }
+    g_map[i].key = 0;
+    g_mapUsed--;
+}
+
+static int map_rehash(void) {
+    PtrEntry *old = g_map;
+    size_t oldCap = g_mapCap;
+    g_mapCap = oldCap ? oldCap * 2 : 4096;
+    g_map = calloc(g_mapCap, sizeof(PtrEntry));
+    if (!g_map) {
+        return -1;
+    }
+    for (size_t i = 0; i < oldCap; i++) {
+        if (old[i].key) {
+            *map_find(old[i].key) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* A slot for a new block at trace address 'ptr' */
+static unsigned slot_bind(unsigned long long ptr) {
+    if ((g_mapUsed + 1) * 2 > g_mapCap && map_rehash() != 0) {
+        return NO_SLOT;
+    }
+    PtrEntry *e = map_find(ptr);
+    if (e->key) {
+        /* Allocated twice without a free in between: the trace lost one. */
+        g_skipped++;
+        return e->slot;
+    }
+    unsigned slot = g_freeCount ? g_freeSlots[--g_freeCount] : g_slotCount++;
+    e->key = ptr;
+    e->slot = slot;
+    g_mapUsed++;
+    return slot;
+}
+
+/* The slot of the block at 'ptr', unbound; NO_SLOT if it was never seen */
+static unsigned slot_unbind(unsigned long long ptr) {
+    if (!g_mapCap) {
+        return NO_SLOT;
+    }
+    PtrEntry *e = map_find(ptr);
+    if (!e->key) {
+        return NO_SLOT;
+    }
+    unsigned slot = e->slot;
+    map_remove(e);
+    if (grow((void **)&g_freeSlots, &g_freeCap, g_freeCount + 1, sizeof(unsigned)) == 0) {
+        g_freeSlots[g_freeCount++] = slot;
+    }
+    return slot;
+}
+
+static const char *intern_name(const char *file) {
+    size_t len = strlen(file);
+    char *copy = malloc(len + 1);
+    if (copy) {
+        memcpy(copy, file, len + 1);
+    }
+    return copy;
+}
+
+/* leak_tracker_trace_read() callback: turn one event into a ReplayOp */
+static int load_event(void *ctx, const LeakTraceEvent *ev) {
+    (void)ctx;
+    if (grow((void **)&g_ops, &g_opCap, g_opCount + 1, sizeof(ReplayOp)) != 0) {
+        return -1;
+    }
+    ReplayOp *op = &g_ops[g_opCount];
+    memset(op, 0, sizeof(*op));
+    op->op = (unsigned char)ev->op;
+    op->kind = (unsigned char)ev->kind;
+    op->size = ev->size;
+    op->site = ev->site;
+    if (ev->alignment) {
+        while (((size_t)1 << op->alignShift) < ev->alignment) {
+            op->alignShift++;
+        }
+    }
+    if (ev->op != LEAK_TRACKER_TRACE_FREE) {
+        if (grow((void **)&g_sites, &g_siteCap, (size_t)ev->site + 1, sizeof(ReplaySite)) != 0) {
+            return -1;
+        }
+        if (!g_sites[ev->site].file) {
+            g_sites[ev->site].file = ev->file ? intern_name(ev->file) : "(trace)";
+            g_sites[ev->site].line = ev->file ? ev->line : (int)ev->site;
+        }
+    }
+    switch (ev->op) {
+    case LEAK_TRACKER_TRACE_FREE:
+        op->slot = slot_unbind(ev->ptr);
+        if (op->slot == NO_SLOT) {
+            g_skipped++;
+            return 0;
+        }
+        break;
+    case LEAK_TRACKER_TRACE_REALLOC:
+        op->oldSlot = ev->oldPtr ? slot_unbind(ev->oldPtr) : NO_SLOT;
+        if (ev->oldPtr && op->oldSlot == NO_SLOT) {
+            g_skipped++;
+        }
+        op->slot = slot_bind(ev->ptr);
+        break;
+    default:
+        op->slot = slot_bind(ev->ptr);
+        break;
+    }
+    if (op->slot == NO_SLOT) {
+        return -1;
+    }
+    g_opCount++;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------
+ * Replay
+ * --------------------------------------------------------------------- */
+
+static void **g_blocks = NULL;
+static size_t *g_sizes = NULL;
+static unsigned char *g_kinds = NULL; /* how each live block was allocated */
+
+static void *sys_alloc(const ReplayOp *op) {
+    if (op->alignShift) {
+        void *p = NULL;
+        size_t align = (size_t)1 << op->alignShift;
+        if (align < sizeof(void *)) {
+            align = sizeof(void *);
+        }
+        return posix_memalign(&p, align, op->size) == 0 ? p : NULL;
+    }
+    return op->op == LEAK_TRACKER_TRACE_CALLOC ? calloc(1, op->size) : malloc(op->size);
+}
+
+static void *trk_alloc(const ReplayOp *op) {
+    const ReplaySite *s = &g_sites[op->site];
+    if (op->kind != LEAK_TRACKER_KIND_MALLOC) {
+        return debug_new(op->size, op->alignShift ? (size_t)1 << op->alignShift : 0,
+                         op->kind, s->file, s->line);
+    }
+    if (op->alignShift) {
+        return debug_aligned_alloc((size_t)1 << op->alignShift, op->size, s->file, s->line);
+    }
+    if (op->op == LEAK_TRACKER_TRACE_CALLOC) {
+        return debug_calloc(1, op->size, s->file, s->line);
+    }
+    return debug_malloc(op->size, s->file, s->line);
+}
+
+static void replay(int tracked) {
+    for (size_t i = 0; i < g_opCount; i++) {
+        const ReplayOp *op = &g_ops[i];
+        void **slot = &g_blocks[op->slot];
+        switch (op->op) {
+        case LEAK_TRACKER_TRACE_FREE:
+            if (tracked) {
+                debug_delete(*slot, 0, op->kind, "(replay)", 0);
+            } else {
+                free(*slot);
+            }
+            *slot = NULL;
+            break;
+        case LEAK_TRACKER_TRACE_REALLOC: {
+            void *old = op->oldSlot == NO_SLOT ? NULL : g_blocks[op->oldSlot];
+            const ReplaySite *s = &g_sites[op->site];
+            if (op->oldSlot != NO_SLOT) {
+                g_blocks[op->oldSlot] = NULL;
+            }
+            *slot = tracked ? debug_realloc(old, op->size, s->file, s->line)
+                            : realloc(old, op->size);
+            g_sizes[op->slot] = op->size;
+            g_kinds[op->slot] = LEAK_TRACKER_KIND_MALLOC;
+            break;
+        }
+        default:
+            *slot = tracked ? trk_alloc(op) : sys_alloc(op);
+            g_sizes[op->slot] = op->size;
+            g_kinds[op->slot] = op->kind;
+            break;
+        }
+    }
+}
+
+/* Free whatever is left so the next run starts from the same state */
+static void release_all(int tracked) {
+    for (unsigned i = 0; i < g_slotCount; i++) {
+        if (g_blocks[i]) {
+            if (tracked) {
+                debug_delete(g_blocks[i], 0, g_kinds[i], "(replay)", 0);
+            } else {
+                free(g_blocks[i]);
+            }
+            g_blocks[i] = NULL;
+        }
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-s] [-n runs] [-l topSites] [-t replayTrace] trace.bin\n"
+            "  -s  replay on the system allocator (default: the tracker)\n"
+            "  -n  number of runs, default 1\n"
+            "  -l  after the first run, print the top sites still holding memory\n"
+            "  -t  record a trace of the replay itself (tracker only)\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int tracked = 1, runs = 1, opt;
+    size_t topSites = 0;
+    const char *replayTrace = NULL;
+    while ((opt = getopt(argc, argv, "sn:l:t:h")) != -1) {
+        switch (opt) {
+        case 's': tracked = 0; break;
+        case 'n': runs = atoi(optarg); break;
+        case 'l': topSites = (size_t)strtoul(optarg, NULL, 10); break;
+        case 't': replayTrace = optarg; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || runs < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+
+    double t0 = now_ns();
+    if (leak_tracker_trace_read(path, load_event, NULL) != 0) {
+        fprintf(stderr, "replay: cannot read trace %s\n", path);
+        return 1;
+    }
+    fprintf(stderr, "replay: %zu events, %u slots, %zu skipped, loaded in %.1f ms\n",
+            g_opCount, g_slotCount, g_skipped, (now_ns() - t0) / 1e6);
+    free(g_map);
+    free(g_freeSlots);
+    g_blocks = calloc(g_slotCount ? g_slotCount : 1, sizeof(void *));
+    g_sizes = calloc(g_slotCount ? g_slotCount : 1, sizeof(size_t));
+    g_kinds = calloc(g_slotCount ? g_slotCount : 1, 1);
+    if (!g_blocks || !g_sizes || !g_kinds || (g_opCount && !g_sites)) {
+        fprintf(stderr, "replay: out of memory\n");
+        return 1;
+    }
+
+    for (int run = 1; run <= runs; run++) {
+        long long rss0 = rss_bytes();
+        if (tracked && replayTrace && run == 1) {
+            leak_tracker_trace_start(replayTrace, 0);
+        }
+        t0 = now_ns();
+        replay(tracked);
+        double ns = now_ns() - t0;
+        if (tracked && replayTrace && run == 1) {
+            leak_tracker_trace_stop();
+        }
+        size_t liveBlocks = 0, liveBytes = 0;
+        for (unsigned i = 0; i < g_slotCount; i++) {
+            if (g_blocks[i]) {
+                liveBlocks++;
+                liveBytes += g_sizes[i];
+            }
+        }
+        printf("{\"trace\":\"%s\",\"allocator\":\"%s\",\"run\":%d,\"ops\":%zu,\"skipped\":%zu,"
+               "\"ns_per_op\":%.2f,\"rss\":%lld,\"live_blocks\":%zu,\"live_bytes\":%zu}\n",
+               path, tracked ? "tracked" : "system", run, g_opCount, g_skipped,
+               g_opCount ? ns / (double)g_opCount : 0.0, rss_bytes() - rss0,
+               liveBlocks, liveBytes);
+        fflush(stdout);
+        if (tracked && topSites && run == 1) {
+            log_leak_sites(stderr, topSites);
+        }
+        release_all(tracked);
+    }
+    return 0;
+}
+
+// gcc -O2 -Wall -Wextra -o replay_leak_tracker replay_leak_tracker.c leak_tracker.c -pthread
+// ./replay_leak_tracker -n 3 trace.bin
@@ -1,7 +1,20 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE /* RTLD_NEXT */
+#endif
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "leak_tracker.h"
+#ifdef __linux__
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+#include <pthread.h>
+#endif
 /* 
  * Because of the macros in leak_tracker.h,
  * any call to malloc/realloc/free in this file actually
@@ -117,7 +130,708 @@ char* getUserInput(void) {
     return buffer;
 }
 
-int main(void) {
+/* ---- Checks: each returns with the tracked set back where it started ---- */
+
+static int g_checks, g_failed;
+
+#define CHECK(cond) do { \
+        g_checks++; \
+        if (!(cond)) { \
+            g_failed++; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+#if defined(__GNUC__)
+    #define NOINLINE __attribute__((noinline))
+#else
+    #define NOINLINE
+#endif
+
+static size_t live_blocks(void) {
+    MemStats st;
+    get_memory_stats(&st);
+    return st.allocationCount;
+}
+
+static size_t live_bytes(void) {
+    MemStats st;
+    get_memory_stats(&st);
+    return st.currentAllocated;
+}
+
+/* Drain the queued diagnostics; whether one of them contains 'text' */
+static int diag_contains(const char *text) {
+    char buf[8192];
+    FILE *f = tmpfile();
+    if (!f) return 0;
+    leak_tracker_drain(f);
+    rewind(f);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    return strstr(buf, text) != NULL;
+}
+
+/* The site at file:line among the first n, or NULL */
+static const LeakSite* find_site(const LeakSite *sites, size_t n, int line) {
+    for (size_t i = 0; i < n; i++) {
+        if (sites[i].line == line && strcmp(sites[i].file, __FILE__) == 0) return &sites[i];
+    }
+    return NULL;
+}
+
+#define TABLE_BLOCKS 20000
+void *g_blocks[TABLE_BLOCKS];
+
+/* Enough blocks to grow the tables several times, freed out of order */
+static void check_table(void) {
+    size_t blocks = live_blocks(), bytes = live_bytes(), sum = 0;
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) {
+        g_blocks[i] = malloc(i % 64 + 1);
+        sum += i % 64 + 1;
+    }
+    CHECK(live_blocks() == blocks + TABLE_BLOCKS);
+    CHECK(live_bytes() == bytes + sum);
+    for (size_t i = 0; i < TABLE_BLOCKS; i += 2) free(g_blocks[i]);
+    CHECK(live_blocks() == blocks + TABLE_BLOCKS / 2);
+    for (size_t i = 1; i < TABLE_BLOCKS; i += 2) free(g_blocks[TABLE_BLOCKS - i]);
+    CHECK(live_blocks() == blocks);
+    CHECK(live_bytes() == bytes);
+    memset(g_blocks, 0, sizeof(g_blocks));
+}
+
+static void check_double_free(void) {
+    CHECK(!diag_contains("ERROR")); /* nothing from the demo */
+    size_t blocks = live_blocks(), bytes = live_bytes();
+    char *p = malloc(40);
+    free(p);
+    CHECK(!diag_contains("Double free"));
+    free(p);
+    CHECK(diag_contains("Double free"));
+    CHECK(realloc(p, 80) == NULL);
+    CHECK(diag_contains("Realloc of freed pointer"));
+    CHECK(live_blocks() == blocks && live_bytes() == bytes);
+
+    /* With delayed reuse a freed address isn't handed out again at once. */
+    leak_tracker_set_quarantine(65536, 64 * 1024 * 1024, 1);
+    char *q = malloc(40);
+    free(q);
+    char *r = malloc(40);
+    CHECK(r != q);
+    free(r);
+}
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+#define CHECK_THREADS 4
+#define THREAD_BLOCKS (TABLE_BLOCKS / CHECK_THREADS)
+
+/* Keeps the even blocks of its share of g_blocks and frees the odd ones */
+static void* churn_thread(void *arg) {
+    void **mine = (void**)arg;
+    for (size_t i = 0; i < THREAD_BLOCKS; i++) {
+        mine[i] = malloc(i % 100 + 1);
+        if (i % 2) {
+            free(mine[i]);
+            mine[i] = NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Blocks made on other threads, freed on this one */
+static void check_threads(void) {
+    pthread_t threads[CHECK_THREADS];
+    size_t blocks = live_blocks(), bytes = live_bytes(), kept = 0;
+    MemStats before, after;
+    size_t total = 0;
+    get_memory_stats(&before);
+    for (size_t i = 0; i < THREAD_BLOCKS; i++) {
+        if (i % 2 == 0) kept += i % 100 + 1;
+        total += i % 100 + 1;
+    }
+    int started = 0;
+    for (int t = 0; t < CHECK_THREADS; t++) {
+        started += pthread_create(&threads[t], NULL, churn_thread, &g_blocks[t * THREAD_BLOCKS]) == 0;
+    }
+    CHECK(started == CHECK_THREADS);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    CHECK(live_blocks() == blocks + started * (THREAD_BLOCKS / 2));
+    CHECK(live_bytes() == bytes + started * kept);
+    get_memory_stats(&after);
+    CHECK(after.totalAllocated == before.totalAllocated + started * total);
+    CHECK(after.peakAllocated >= after.currentAllocated);
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) free(g_blocks[i]);
+    memset(g_blocks, 0, sizeof(g_blocks));
+    CHECK(live_blocks() == blocks && live_bytes() == bytes);
+}
+#endif
+
+static void check_guards(void) {
+    size_t blocks = live_blocks();
+    volatile char *p = malloc(16);
+    volatile size_t end = 16;
+    char saved = p[end];
+    CHECK(leak_tracker_verify_heap(0) == 0);
+    p[end] = (char)(saved ^ 0x5A);
+    CHECK(leak_tracker_verify_heap(0) == 1);
+    CHECK(diag_contains("Back sentinel corrupted"));
+    p[end] = saved;
+    CHECK(leak_tracker_verify_heap(0) == 0);
+    free((void*)p);
+    CHECK(!diag_contains("corrupt"));
+    CHECK(live_blocks() == blocks);
+}
+
+static void check_aligned(void) {
+    void *a = aligned_alloc(64, 128);
+    void *b = NULL;
+    CHECK(a && (uintptr_t)a % 64 == 0);
+    CHECK(posix_memalign(&b, 256, 100) == 0 && (uintptr_t)b % 256 == 0);
+    b = realloc(b, 4000);
+    CHECK(b && (uintptr_t)b % 256 == 0);
+    free(a);
+    free(b);
+}
+
+static void check_sites(void) {
+    LeakSite sites[256];
+    void *p[3];
+    int line = __LINE__ + 1;
+    for (int i = 0; i < 3; i++) p[i] = malloc(100);
+    const LeakSite *site = find_site(sites, get_leak_sites(sites, 256), line);
+    CHECK(site && site->liveCount == 3 && site->liveBytes == 300);
+    free(p[0]);
+    site = find_site(sites, get_leak_sites(sites, 256), line);
+    CHECK(site && site->liveCount == 2 && site->totalCount >= 3 && site->peakBytes >= 300);
+    for (int i = 1; i < 3; i++) free(p[i]);
+}
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+/* Leaks are listed with the stack they were allocated from */
+static void check_stacks(void) {
+    char buf[16384];
+    FILE *f = tmpfile();
+    if (!f) return;
+    leak_tracker_set_stack_depth(8);
+    void *p = malloc(33);
+    log_memory_leaks(f);
+    leak_tracker_set_stack_depth(0);
+    rewind(f);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    CHECK(strstr(buf, "        #0 ") && strstr(buf, "        #1 "));
+    free(p);
+}
+#endif
+
+#ifdef __linux__
+/* Whether writing p[index] kills a child process with SIGSEGV */
+static int child_crashes(volatile char *p, size_t index) {
+    int status = 0;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        p[index] = 1;
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return 0;
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+/* A block in the guard-page range ends right before an inaccessible page */
+static void check_guard_pages(void) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), blocks = live_blocks();
+    leak_tracker_set_guard_pages(64, 256, 0);
+    volatile char *p = malloc(100);
+    size_t past = (((uintptr_t)p + 100 + page - 1) & ~(uintptr_t)(page - 1)) - (uintptr_t)p;
+    CHECK(p && live_blocks() == blocks + 1);
+    CHECK(!child_crashes(p, 99));
+    CHECK(past - 100 < 64 && child_crashes(p, past));
+    free((void*)p);
+    CHECK(child_crashes(p, 0)); /* freed pages stay inaccessible for a while */
+    leak_tracker_set_guard_pages(0, 0, 0);
+    CHECK(live_blocks() == blocks);
+}
+#endif
+
+static void check_histograms(void) {
+    MemHistograms *before = malloc(sizeof(MemHistograms));
+    MemHistograms *after  = malloc(sizeof(MemHistograms));
+    unsigned bin = 0;
+    while (bin + 1 < LEAK_TRACKER_HIST_BINS && leak_tracker_hist_bin_low(bin + 1) <= 1000) bin++;
+    get_memory_histograms(before);
+    free(malloc(1000));
+    get_memory_histograms(after);
+    CHECK(after->sizes[bin] == before->sizes[bin] + 1);
+    free(before);
+    free(after);
+}
+
+static void check_realloc_chain(void) {
+    ReallocSite sites[256];
+    size_t n;
+    char *p = malloc(8);
+    int line = __LINE__ + 1;
+    for (int i = 1; i <= 10; i++) p = realloc(p, (size_t)8 << i);
+    free(p);
+    n = get_realloc_sites(sites, 256);
+    const ReallocSite *site = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (sites[i].line == line && strcmp(sites[i].file, __FILE__) == 0) site = &sites[i];
+    }
+    CHECK(site && site->reallocs == 10 && site->longestChain == 10);
+}
+
+typedef struct {
+    char   data[4096];
+    size_t len;
+} Buffer;
+
+static int to_buffer(void *ctx, const void *data, size_t len) {
+    Buffer *b = (Buffer*)ctx;
+    if (b->len + len >= sizeof(b->data)) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+static int to_file(void *ctx, const void *data, size_t len) {
+    return fwrite(data, 1, len, (FILE*)ctx) == len ? 0 : -1;
+}
+
+/* Not on the heap: they would be exported too */
+static Buffer g_json, g_decoded;
+
+static void check_export(void) {
+    Buffer *json = &g_json, *decoded = &g_decoded;
+    FILE *bin = tmpfile();
+    void *p = malloc(100);
+    CHECK(leak_tracker_export(LEAK_TRACKER_JSON, to_buffer, json) == 0);
+    CHECK(strstr(json->data, "\"blocks\":1,") && strstr(json->data, "\"size\":100"));
+    CHECK(strstr(json->data, "{\"type\":\"end\",\"blocks\":1}"));
+    CHECK(strstr(json->data, "\"block_overhead\":") && strstr(json->data, "\"usable\":"));
+    if (bin) {
+        CHECK(leak_tracker_export(LEAK_TRACKER_BINARY, to_file, bin) == 0);
+        rewind(bin);
+        CHECK(leak_tracker_decode(bin, to_buffer, decoded) == 0);
+        CHECK(strcmp(json->data, decoded->data) == 0);
+        fclose(bin);
+    }
+    free(p);
+}
+
+static void check_snapshots(void) {
+    LeakSite sites[256];
+    void *old = malloc(5);
+    LeakSnapshot a = leak_tracker_snapshot();
+    int line = __LINE__ + 1;
+    void *p = malloc(7), *q = malloc(7);
+    const LeakSite *site = find_site(sites, leak_tracker_diff(a, 0, sites, 256), line);
+    CHECK(site && site->liveCount == 2 && site->liveBytes == 14);
+    free(q);
+    site = find_site(sites, leak_tracker_diff(a, 0, sites, 256), line);
+    CHECK(site && site->liveCount == 1 && site->liveBytes == 7);
+    CHECK(find_site(sites, leak_tracker_diff(a, 0, sites, 256), line - 3) == NULL);
+    CHECK(leak_tracker_diff(a, leak_tracker_snapshot(), sites, 256) == 0); /* only against now */
+    free(p);
+    free(old);
+
+    /* Enough blocks for the diff to let go of a shard's lock on the way. */
+    line = __LINE__ + 1;
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) g_blocks[i] = malloc(3);
+    site = find_site(sites, leak_tracker_diff(a, 0, sites, 256), line);
+    CHECK(site && site->liveCount == TABLE_BLOCKS && site->liveBytes == 3 * TABLE_BLOCKS);
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) free(g_blocks[i]);
+    memset(g_blocks, 0, sizeof(g_blocks));
+}
+
+static void check_epochs(void) {
+    size_t blocks = 0, bytes = 0;
+    unsigned epoch = leak_tracker_epoch_begin();
+    CHECK(epoch != 0);
+    char *a = malloc(10), *b = malloc(20), *c = malloc(30);
+    free(b);
+    CHECK(leak_tracker_epoch_end(epoch, &blocks, &bytes) == 0);
+    CHECK(blocks == 2 && bytes == 40);
+    free(a);
+    CHECK(leak_tracker_epoch_live(epoch, &blocks, &bytes) == 0);
+    CHECK(blocks == 1 && bytes == 30);
+    free(c);
+}
+
+static int g_siteLine;
+
+static void* alloc_at_site(size_t size) {
+    g_siteLine = __LINE__ + 1;
+    return malloc(size);
+}
+
+/* A disabled site's blocks go untracked, the ones it made before stay */
+static void check_enable_site(void) {
+    LeakSite sites[256];
+    size_t blocks = live_blocks();
+    void *a = alloc_at_site(50);
+    const LeakSite *site = find_site(sites, get_leak_sites(sites, 256), g_siteLine);
+    CHECK(site && site->liveCount == 1);
+    if (!site) return;
+    unsigned id = site->id;
+    leak_tracker_enable_site(id, 0);
+    void *b = alloc_at_site(50);
+    CHECK(b && live_blocks() == blocks + 1);
+    free(b);
+    leak_tracker_enable_site(id, 1);
+    void *c = alloc_at_site(50);
+    CHECK(live_blocks() == blocks + 2);
+    free(a);
+    free(c);
+    CHECK(live_blocks() == blocks);
+}
+
+#ifdef __linux__
+typedef struct {
+    size_t mallocs, reallocs, frees;
+    size_t reallocSize;
+    int    mallocLine;
+} TraceCounts;
+
+static int count_event(void *ctx, const LeakTraceEvent *ev) {
+    TraceCounts *n = (TraceCounts*)ctx;
+    if (ev->op == LEAK_TRACKER_TRACE_MALLOC) {
+        n->mallocs++;
+        n->mallocLine = ev->line;
+    } else if (ev->op == LEAK_TRACKER_TRACE_REALLOC) {
+        n->reallocs++;
+        n->reallocSize = ev->size;
+    } else if (ev->op == LEAK_TRACKER_TRACE_FREE) {
+        n->frees++;
+    }
+    return 0;
+}
+
+static void check_trace(void) {
+    TraceCounts n = { 0, 0, 0, 0, 0 };
+    CHECK(leak_tracker_trace_start("test_code.trace", 0) == 0);
+    int line = __LINE__ + 1;
+    char *p = malloc(10);
+    p = realloc(p, 20);
+    free(p);
+    leak_tracker_trace_stop();
+    CHECK(leak_tracker_trace_read("test_code.trace", count_event, &n) == 0);
+    CHECK(n.mallocs == 1 && n.reallocs == 1 && n.frees == 1);
+    CHECK(n.mallocLine == line && n.reallocSize == 20);
+    remove("test_code.trace");
+}
+#endif
+
+#ifdef __linux__
+static void check_agent(void) {
+    LeakAgentSegment *seg = malloc(sizeof(LeakAgentSegment));
+    int line = __LINE__ + 1;
+    void *p = malloc(777);
+    CHECK(leak_tracker_start_agent("test_code.agent", 0) == 0);
+    leak_tracker_agent_publish();
+    CHECK(leak_tracker_agent_read("test_code.agent", seg) == 0);
+    CHECK(seg->magic == LEAK_TRACKER_AGENT_MAGIC && seg->size == sizeof(LeakAgentSegment));
+    CHECK(seg->stats.allocationCount == live_blocks());
+    int found = 0;
+    for (unsigned i = 0; i < seg->siteCount && i < LEAK_TRACKER_AGENT_SITES; i++) {
+        found |= seg->sites[i].line == line && seg->sites[i].liveBytes == 777;
+    }
+    CHECK(found);
+    leak_tracker_stop_agent();
+    remove("test_code.agent");
+    free(p);
+    free(seg);
+}
+#endif
+
+static void check_failures(void) {
+    size_t injected = 0, before = 0, failed = 0;
+    leak_tracker_get_failures(&before, NULL);
+    leak_tracker_inject_failures(LEAK_TRACKER_ALL_SITES, 3, 0.0);
+    for (int i = 0; i < 9; i++) {
+        void *p = malloc(16);
+        if (!p) failed++;
+        free(p);
+    }
+    leak_tracker_inject_failures(LEAK_TRACKER_ALL_SITES, 0, 0.0);
+    leak_tracker_get_failures(&injected, NULL);
+    CHECK(failed == 3 && injected == before + 3);
+
+    size_t blocks = live_blocks();
+    leak_tracker_set_budget(LEAK_TRACKER_ALL_SITES, live_bytes() + 100);
+    void *a = malloc(60), *b = malloc(60);
+    leak_tracker_set_budget(LEAK_TRACKER_ALL_SITES, 0);
+    CHECK(a && !b && live_blocks() == blocks + 1);
+    CHECK(diag_contains("Process memory budget exceeded"));
+    free(a);
+}
+
+static void check_slack(void) {
+    MemStats st;
+    SlackSite sites[256];
+    char *p[2];
+    int line = __LINE__ + 1;
+    for (int i = 0; i < 2; i++) p[i] = malloc((size_t)i + 1);
+    size_t n = get_slack_sites(sites, 256);
+    const SlackSite *site = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (sites[i].line == line && strcmp(sites[i].file, __FILE__) == 0) site = &sites[i];
+    }
+    get_memory_stats(&st);
+    CHECK(st.usableBytes == st.currentAllocated + st.overheadBytes + st.slackBytes);
+    CHECK(site && site->liveCount == 2 && site->liveBytes == 3 && site->overheadBytes > 0);
+#if defined(__GLIBC__) && !defined(LEAK_TRACKER_NO_USABLE_SIZE)
+    /* Sizes one apart can't both fill their size class exactly. */
+    CHECK(site && site->slackBytes > 0 && st.slackBytes >= site->slackBytes);
+#endif
+    free(p[0]);
+    free(p[1]);
+}
+
+/* Sampled blocks still catch double frees, the others go to the system */
+static void check_sampling(void) {
+    MemStats st;
+    size_t blocks = live_blocks();
+    leak_tracker_set_sample_interval(1); /* a 64-byte block is always picked */
+    char *p = malloc(64);
+    get_memory_stats(&st);
+    CHECK(st.sampleInterval == 1 && st.allocationCount == blocks + 1);
+    leak_tracker_drain(NULL);
+    free(p);
+    free(p);
+    CHECK(diag_contains("Double free"));
+    CHECK(realloc(p, 128) == NULL);
+    CHECK(diag_contains("Realloc of freed pointer"));
+
+    leak_tracker_set_sample_interval(1 << 16);
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) g_blocks[i] = malloc(32);
+    get_memory_stats(&st);
+    CHECK(st.allocationCount < blocks + TABLE_BLOCKS / 100);
+    CHECK(st.estimatedBlocks > 0 && st.estimatedBytes > 0);
+    for (size_t i = 0; i < TABLE_BLOCKS; i++) free(g_blocks[i]);
+    memset(g_blocks, 0, sizeof(g_blocks));
+    leak_tracker_set_sample_interval(0);
+    CHECK(live_blocks() == blocks);
+    CHECK(!diag_contains("Unknown"));
+}
+
+#ifdef __linux__
+void     *g_kept;   /* reachable through this global */
+uintptr_t g_hidden; /* a lost block, its address disguised */
+
+static NOINLINE void make_scan_blocks(void) {
+    void **lost = malloc(2 * sizeof(void*));
+    lost[0] = malloc(16); /* only a lost block points here: indirectly lost */
+    lost[1] = NULL;
+    g_kept = malloc(24);
+    g_hidden = (uintptr_t)lost ^ (uintptr_t)-1;
+}
+
+static NOINLINE void scrub_stack(void) {
+    volatile char junk[8192];
+    for (size_t i = 0; i < sizeof(junk); i++) junk[i] = 0;
+}
+
+/* First: exact counts need nothing else to be tracked */
+static void check_scan(unsigned threads) {
+    LeakReachability r;
+    make_scan_blocks();
+    scrub_stack();
+    CHECK(leak_tracker_scan(threads, &r) == 0);
+    CHECK(r.reachableBlocks == 1 && r.reachableBytes == 24);
+    CHECK(r.indirectBlocks == 1 && r.indirectBytes == 16);
+    CHECK(r.lostBlocks == 1 && r.lostBytes == 2 * sizeof(void*));
+
+    void **lost = (void**)(g_hidden ^ (uintptr_t)-1);
+    CHECK(leak_tracker_scan(1, &r) == 0);
+    CHECK(r.reachableBlocks == 3 && r.lostBlocks == 0 && r.indirectBlocks == 0);
+    free(lost[0]);
+    free(lost);
+    free(g_kept);
+}
+#endif
+
+/* Frees whatever is still tracked */
+static void check_teardown(void) {
+    size_t left = live_blocks() + 100, steps = 0;
+    for (size_t i = 0; i < 100; i++) g_blocks[i] = malloc(i + 1);
+    while (left > 0 && steps++ < 1000) {
+        size_t now = leak_tracker_teardown_step(30);
+        CHECK(now <= left && now + 30 >= left);
+        left = now;
+    }
+    CHECK(left == 0 && live_blocks() == 0 && live_bytes() == 0);
+    free(g_blocks[0]); /* freed by the step, so this is a double free */
+    CHECK(diag_contains("Double free"));
+    memset(g_blocks, 0, sizeof(g_blocks));
+
+    for (size_t i = 0; i < 1000; i++) g_blocks[i] = malloc(i % 50 + 1);
+    leak_tracker_teardown(LEAK_TRACKER_TEARDOWN_FREE, 4);
+    CHECK(live_blocks() == 0 && live_bytes() == 0);
+    memset(g_blocks, 0, sizeof(g_blocks));
+}
+
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+/* Allocates and keeps everything: a concurrent teardown may free any of it */
+static void* alloc_thread(void *arg) {
+    (void)arg;
+    for (size_t i = 0; i < THREAD_BLOCKS; i++) (void)malloc(i % 100 + 1);
+    return NULL;
+}
+
+/* Teardowns while other threads allocate */
+static void check_teardown_threads(void) {
+    pthread_t threads[CHECK_THREADS];
+    int started = 0;
+    for (int t = 0; t < CHECK_THREADS; t++) {
+        started += pthread_create(&threads[t], NULL, alloc_thread, NULL) == 0;
+    }
+    CHECK(started == CHECK_THREADS);
+    for (int i = 0; i < 200; i++) free_all_tracked();
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free_all_tracked();
+    CHECK(live_blocks() == 0 && live_bytes() == 0);
+    CHECK(!diag_contains("ERROR"));
+}
+#endif
+
+/* Last: the forgotten blocks stay allocated */
+static void check_forget(void) {
+    for (size_t i = 0; i < 1000; i++) g_blocks[i] = malloc(16);
+    leak_tracker_teardown(LEAK_TRACKER_TEARDOWN_FORGET, 2);
+    CHECK(live_blocks() == 0 && live_bytes() == 0);
+    free(g_blocks[0]); /* forgotten: ignored */
+    CHECK(realloc(g_blocks[1], 32) == NULL);
+    CHECK(!diag_contains("ERROR"));
+    memset(g_blocks, 0, sizeof(g_blocks));
+
+    /* A block the tracker never saw still goes to the system allocator. */
+    char *foreign = (malloc)(16);
+    CHECK(foreign != NULL);
+    strcpy(foreign, "foreign");
+    foreign = realloc(foreign, 4096);
+    CHECK(foreign && strcmp(foreign, "foreign") == 0);
+    free(foreign);
+    CHECK(!diag_contains("ERROR"));
+}
+
+static int run_checks(void) {
+#ifdef __linux__
+    check_scan(0);
+    leak_tracker_set_thread_mode(LEAK_TRACKER_THREADS_SINGLE);
+    check_scan(4);
+    leak_tracker_set_thread_mode(LEAK_TRACKER_THREADS_LOCKED);
+#endif
+    check_table();
+    check_double_free();
+    check_failures();
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    check_threads();
+    leak_tracker_set_thread_mode(LEAK_TRACKER_THREADS_BATCHED);
+    check_threads();
+    check_table();
+    leak_tracker_set_thread_mode(LEAK_TRACKER_THREADS_SINGLE);
+    check_table();
+    leak_tracker_set_thread_mode(LEAK_TRACKER_THREADS_LOCKED);
+    check_failures(); /* the budget must count what exited threads left unfolded */
+#endif
+    check_guards();
+    check_aligned();
+    check_sites();
+#if defined(__GLIBC__) || defined(__APPLE__)
+    check_stacks();
+#endif
+#ifdef __linux__
+    check_guard_pages();
+#endif
+    check_histograms();
+    check_realloc_chain();
+    check_export();
+    check_snapshots();
+    check_epochs();
+    check_enable_site();
+#ifdef __linux__
+    check_trace();
+#endif
+#ifdef __linux__
+    check_agent();
+#endif
+    check_slack();
+    check_sampling();
+    check_teardown();
+#ifndef NO_THREAD_SAFE_LEAK_TRACKER
+    check_teardown_threads();
+#endif
+    check_forget();
+    printf("\n%d checks, %d failed\n", g_checks, g_failed);
+    return g_failed ? 1 : 0;
+}
+
+/*
+ * --preload: run under LD_PRELOAD=./libleak_tracker.so. The parenthesised
+ * names skip the macros above, so these calls reach the preloaded tracker
+ * like any uninstrumented program's would.
+ */
+static int check_preload(void) {
+#ifdef __linux__
+    void (*stats)(MemStats*) = (void (*)(MemStats*))dlsym(RTLD_NEXT, "get_memory_stats");
+    size_t (*drain)(FILE*) = (size_t (*)(FILE*))dlsym(RTLD_NEXT, "leak_tracker_drain");
+    if (!stats || !drain) {
+        fprintf(stderr, "--preload: libleak_tracker.so is not preloaded\n");
+        return 1;
+    }
+    char buf[8192];
+    MemStats before, after;
+    FILE *f = tmpfile();
+    if (!f) return 1;
+    drain(f);
+    stats(&before);
+    void *volatile p = (malloc)(32);
+    stats(&after);
+    CHECK(after.allocationCount == before.allocationCount + 1);
+    (free)(p);
+    stats(&after);
+    CHECK(after.allocationCount == before.allocationCount);
+    (free)(p);
+    CHECK((realloc)(p, 64) == NULL);
+    /* Worker threads are created under the tracker too. */
+    size_t (*verify)(unsigned) = (size_t (*)(unsigned))dlsym(RTLD_NEXT, "leak_tracker_verify_heap");
+    CHECK(verify && verify(4) == 0);
+    int (*scan)(unsigned, LeakReachability*) =
+        (int (*)(unsigned, LeakReachability*))dlsym(RTLD_NEXT, "leak_tracker_scan");
+    LeakReachability r;
+    CHECK(scan && scan(4, &r) == 0);
+    drain(f);
+    rewind(f);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    CHECK(strstr(buf, "Double free") != NULL);
+    CHECK(strstr(buf, "Realloc of freed pointer") != NULL);
+    /* Last: the C library's own blocks are forgotten with ours. */
+    void (*teardown)(int, unsigned) = (void (*)(int, unsigned))dlsym(RTLD_NEXT, "leak_tracker_teardown");
+    if (teardown) teardown(LEAK_TRACKER_TEARDOWN_FORGET, 4);
+    CHECK(teardown != NULL);
+    printf("%d checks, %d failed\n", g_checks, g_failed);
+    return g_failed ? 1 : 0;
+#else
+    fprintf(stderr, "--preload: Linux only\n");
+    return 1;
+#endif
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--preload") == 0) return check_preload();
+
+    /* Freed blocks keep their addresses while quarantined, so the checks
+     * at the end see no stale pointers to new blocks. */
+    leak_tracker_set_quarantine(65536, 64 * 1024 * 1024, 1);
+
     StringList list;
     initStringList(&list);
 
@@ -175,7 +889,7 @@ int main(void) {
     log_memory_leaks(stdout);
     log_memory_stats(stdout);
 
-    return 0;
+    return run_checks();
 }
 
 // run main
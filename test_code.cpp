@@ -0,0 +1,105 @@
+/*
+ * Checks for the C++ front end (leak_tracker.hpp). Build leak_tracker.c as C:
+ *   gcc -c leak_tracker.c -o leak_tracker.o
+ *   g++ -std=c++17 -Wall -Wextra -o test_code_cpp test_code.cpp leak_tracker.o -pthread
+ */
+#define LEAK_TRACKER_DEFINE_NEW
+#include "leak_tracker.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static int g_checks, g_failed;
+
+#define CHECK(cond) do { \
+        g_checks++; \
+        if (!(cond)) { \
+            g_failed++; \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+static size_t live_blocks() {
+    MemStats st;
+    get_memory_stats(&st);
+    return st.allocationCount;
+}
+
+/* Drain the queued diagnostics; whether one of them contains 'text' */
+static bool diag_contains(const char *text) {
+    char buf[8192];
+    std::FILE *f = std::tmpfile();
+    if (!f) return false;
+    leak_tracker_drain(f);
+    std::rewind(f);
+    size_t len = std::fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    std::fclose(f);
+    return std::strstr(buf, text) != nullptr;
+}
+
+/* The site at this file's 'line', or nullptr */
+static const LeakSite* find_site(const LeakSite *sites, size_t n, int line) {
+    for (size_t i = 0; i < n; i++) {
+        if (sites[i].line == line && std::strcmp(sites[i].file, __FILE__) == 0) return &sites[i];
+    }
+    return nullptr;
+}
+
+struct alignas(64) Wide {
+    char bytes[64];
+};
+
+/* Through a volatile, so the compiler can't see which delete it pairs with */
+template <class T>
+static T* hide(T *p) {
+    T *volatile v = p;
+    return v;
+}
+
+int main() {
+    LeakSite sites[256];
+    size_t blocks = live_blocks();
+
+    int line = __LINE__ + 1;
+    int *one = LEAK_TRACKER_NEW int(7);
+    int *many = new int[16];
+    CHECK(live_blocks() == blocks + 2);
+    const LeakSite *site = find_site(sites, get_leak_sites(sites, 256), line);
+    CHECK(site && site->liveCount == 1 && site->liveBytes == sizeof(int));
+    delete one;
+    delete[] many;
+    CHECK(live_blocks() == blocks);
+    CHECK(!diag_contains("ERROR"));
+
+    Wide *w = new Wide;
+    CHECK(reinterpret_cast<std::uintptr_t>(w) % alignof(Wide) == 0);
+    delete w;
+    CHECK(!diag_contains("ERROR"));
+
+    /* Each of these is reported, and the block is freed all the same. */
+    delete hide(new int[4]);
+    CHECK(diag_contains("Mismatched free/delete/delete[]"));
+    delete[] hide(new int);
+    CHECK(diag_contains("Mismatched free/delete/delete[]"));
+    debug_free(hide(new char), __FILE__, __LINE__);
+    CHECK(diag_contains("Mismatched free/delete/delete[]"));
+    ::operator delete(hide(::operator new(24)), 16);
+    CHECK(diag_contains("passed the wrong size"));
+    CHECK(live_blocks() == blocks);
+
+    {
+        line = __LINE__ + 1;
+        std::vector<int, leak_tracker::allocator<int>> v{leak_tracker::allocator<int>()};
+        v.resize(100);
+        site = find_site(sites, get_leak_sites(sites, 256), line);
+        CHECK(site && site->liveCount == 1 && site->liveBytes == 100 * sizeof(int));
+    }
+    CHECK(live_blocks() == blocks);
+    CHECK(!diag_contains("ERROR"));
+
+    std::printf("%d checks, %d failed\n", g_checks, g_failed);
+    return g_failed ? 1 : 0;
+}